@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LOG_TAG "heartbeat"
+//#define LOG_DEBUG
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "debug.h"
+#include "heartbeat.h"
+
+struct heartbeat *heartbeat_open(void)
+{
+	struct heartbeat *hb;
+	size_t size;
+	void *addr;
+	int fd;
+
+	size = sizeof(struct heartbeat_header) +
+		HEARTBEAT_SLOTS * sizeof(struct heartbeat_slot);
+
+	/*
+	 * Every user may be the first one. A new object is zero filled,
+	 * which is an empty table, so creating it twice is harmless.
+	 */
+	fd = shm_open(HEARTBEAT_SHM_NAME, O_CREAT | O_RDWR, 0666);
+	if (fd < 0) {
+		pr_err("shm_open %s failed, %s\n", HEARTBEAT_SHM_NAME, strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(fd, size) < 0) {
+		pr_err("ftruncate failed, %s\n", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		pr_err("mmap failed, %s\n", strerror(errno));
+		return NULL;
+	}
+
+	hb = (struct heartbeat *)malloc(sizeof(*hb));
+	if (!hb) {
+		pr_err("heartbeat malloc fail\n");
+		munmap(addr, size);
+		return NULL;
+	}
+	hb->hdr = (struct heartbeat_header *)addr;
+	hb->slots = (struct heartbeat_slot *)(hb->hdr + 1);
+	hb->size = size;
+	hb->hdr->slots = HEARTBEAT_SLOTS;
+	__atomic_store_n(&hb->hdr->magic, HEARTBEAT_MAGIC, __ATOMIC_RELEASE);
+	return hb;
+}
+
+void heartbeat_close(struct heartbeat *hb)
+{
+	if (!hb)
+		return;
+	munmap(hb->hdr, hb->size);
+	free(hb);
+}
+
+static int heartbeat_pid_dead(pid_t pid)
+{
+	return kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+/*
+ * heartbeat_claim - move a slot from state old to HEARTBEAT_INIT
+ */
+static int heartbeat_claim(struct heartbeat_slot *slot, uint32_t old)
+{
+	return __atomic_compare_exchange_n(&slot->state, &old, HEARTBEAT_INIT, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+int heartbeat_register(struct heartbeat *hb, const char *name, uint32_t timeout_ms)
+{
+	struct heartbeat_slot *slot;
+	int i, index = -1;
+
+	if (name[0] == '/')
+		name++;
+
+	/* take over the slot of a dead instance first */
+	for (i = 0; i < HEARTBEAT_SLOTS && index < 0; i++) {
+		slot = &hb->slots[i];
+		if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == HEARTBEAT_USED &&
+				!strncmp(slot->name, name, HEARTBEAT_NAME_SIZE) &&
+				(slot->pid == getpid() || heartbeat_pid_dead(slot->pid)) &&
+				heartbeat_claim(slot, HEARTBEAT_USED))
+			index = i;
+	}
+	for (i = 0; i < HEARTBEAT_SLOTS && index < 0; i++) {
+		if (heartbeat_claim(&hb->slots[i], HEARTBEAT_FREE))
+			index = i;
+	}
+	if (index < 0) {
+		pr_err("heartbeat table full\n");
+		errno = ENOSPC;
+		return -1;
+	}
+
+	slot = &hb->slots[index];
+	snprintf(slot->name, HEARTBEAT_NAME_SIZE, "%s", name);
+	slot->pid = getpid();
+	slot->timeout_ms = timeout_ms;
+	slot->beat_ns = heartbeat_now_ns();
+	__atomic_store_n(&slot->state, HEARTBEAT_USED, __ATOMIC_RELEASE);
+	pr_info("heartbeat slot %d for %s, timeout %ums\n", index, name, timeout_ms);
+	return index;
+}
+
+void heartbeat_unregister(struct heartbeat *hb, int slot)
+{
+	if (slot < 0 || slot >= HEARTBEAT_SLOTS)
+		return;
+	__atomic_store_n(&hb->slots[slot].state, HEARTBEAT_FREE, __ATOMIC_RELEASE);
+}
+
+int heartbeat_scan(struct heartbeat *hb, heartbeat_stale_fn func, void *data)
+{
+	struct heartbeat_slot *slot;
+	uint64_t now = heartbeat_now_ns();
+	uint64_t beat, age;
+	int i, stale = 0;
+
+	for (i = 0; i < HEARTBEAT_SLOTS; i++) {
+		slot = &hb->slots[i];
+		if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != HEARTBEAT_USED)
+			continue;
+		if (heartbeat_pid_dead(slot->pid)) {
+			pr_info("free heartbeat slot %d of exited %s\n", i, slot->name);
+			if (heartbeat_claim(slot, HEARTBEAT_USED))
+				__atomic_store_n(&slot->state, HEARTBEAT_FREE, __ATOMIC_RELEASE);
+			continue;
+		}
+		beat = __atomic_load_n(&slot->beat_ns, __ATOMIC_ACQUIRE);
+		age = now > beat ? (now - beat) / 1000000ULL : 0;
+		if (age > slot->timeout_ms) {
+			stale++;
+			if (func)
+				func(slot, age, data);
+		}
+	}
+	return stale;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdint.h>
+#include "hist.h"
+
+uint64_t hist_bucket_max(int bucket)
+{
+	int shift;
+
+	if (bucket < HIST_SUB)
+		return bucket;
+	if (bucket == HIST_BUCKETS - 1)
+		return UINT64_MAX;
+	shift = (bucket >> HIST_SUB_BITS) - 1;
+	return (((uint64_t)(HIST_SUB + (bucket & (HIST_SUB - 1))) + 1) << shift) - 1;
+}
+
+uint64_t hist_percentile(const struct hist *h, double percent)
+{
+	uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	uint64_t rank, seen = 0;
+	uint64_t value;
+	int i;
+
+	if (!count)
+		return 0;
+	rank = (uint64_t)(percent * count / 100.0 + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= rank)
+			break;
+	}
+	value = i < HIST_BUCKETS ? hist_bucket_max(i) : max;
+	return value < max ? value : max;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+	uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	int i;
+
+	dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+	if (max > dst->max)
+		dst->max = max;
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifdef __cplusplus
+export "C" {
+#endif
+
+#ifndef __FUTEX_H__
+#define __FUTEX_H__
+
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/*
+ * futex_wait - sleep while *addr still equals val
+ * @addr: futex word
+ * @val: expected value
+ * @timeout: relative timeout, NULL means wait forever
+ * @shared: non-zero if the word lives in memory shared between processes
+ *
+ * Returns 0 when woken up, -1 with errno set on timeout (ETIMEDOUT),
+ * value mismatch (EAGAIN) or signal (EINTR).
+ */
+static inline int futex_wait(uint32_t *addr, uint32_t val,
+							const struct timespec *timeout, int shared)
+{
+	int op = shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE;
+
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+/*
+ * futex_wake - wake up waiters sleeping on addr
+ * @addr: futex word
+ * @count: max number of waiters to wake
+ * @shared: non-zero if the word lives in memory shared between processes
+ */
+static inline int futex_wake(uint32_t *addr, int count, int shared)
+{
+	int op = shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE;
+
+	return syscall(SYS_futex, addr, op, count, NULL, NULL, 0);
+}
+
+#endif //__FUTEX_H__
+
+#ifdef __cplusplus
+}
+#endif
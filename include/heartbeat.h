@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifdef __cplusplus
+export "C" {
+#endif
+
+#ifndef __HEARTBEAT_H__
+#define __HEARTBEAT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define HEARTBEAT_SHM_NAME "/ipc-heartbeat"
+#define HEARTBEAT_MAGIC 0x54424854 /* "THBT" */
+#define HEARTBEAT_SLOTS 256
+#define HEARTBEAT_NAME_SIZE 40
+
+/* slot states */
+#define HEARTBEAT_FREE 0
+#define HEARTBEAT_INIT 1
+#define HEARTBEAT_USED 2
+
+/*
+ * heartbeat_slot - liveness of one app in the shared table
+ *
+ * The app only stores beat_ns, a monotonic time got from the vdso,
+ * so feeding costs no syscall. A slot has a cache line of its own.
+ */
+struct heartbeat_slot {
+	uint32_t state;
+	int32_t pid;
+	uint32_t timeout_ms;
+	uint32_t reserved;
+	uint64_t beat_ns;
+	char name[HEARTBEAT_NAME_SIZE];
+} __attribute__((aligned(64)));
+
+struct heartbeat_header {
+	uint32_t magic;
+	uint32_t slots;
+} __attribute__((aligned(64)));
+
+/*
+ * heartbeat - process local handle of the mapped table
+ */
+struct heartbeat {
+	struct heartbeat_header *hdr;
+	struct heartbeat_slot *slots;
+	size_t size;
+};
+
+/*
+ * heartbeat_open - map the heartbeat table, create it if missing
+ *
+ * Shared by apps and the supervisor, it's never removed.
+ */
+struct heartbeat *heartbeat_open(void);
+
+/*
+ * heartbeat_close - unmap the table and free handle
+ */
+void heartbeat_close(struct heartbeat *hb);
+
+/*
+ * heartbeat_register - get a slot for this process
+ * @hb: table handle
+ * @name: app name, leading '/' is ignored
+ * @timeout_ms: the app is stale when it doesn't beat for so long
+ *
+ * A slot left by an earlier instance of the app is taken over.
+ * Returns slot index, -1 with errno ENOSPC if table is full.
+ */
+int heartbeat_register(struct heartbeat *hb, const char *name, uint32_t timeout_ms);
+
+/*
+ * heartbeat_unregister - give back a slot got by heartbeat_register
+ */
+void heartbeat_unregister(struct heartbeat *hb, int slot);
+
+static inline uint64_t heartbeat_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * heartbeat_beat - tell the supervisor the app is alive
+ */
+static inline void heartbeat_beat(struct heartbeat *hb, int slot)
+{
+	__atomic_store_n(&hb->slots[slot].beat_ns, heartbeat_now_ns(),
+			__ATOMIC_RELEASE);
+}
+
+/*
+ * heartbeat_stale_fn - called by heartbeat_scan for a stale app
+ * @slot: slot of the app, stays registered until the app unregisters
+ *	  or exits
+ * @age_ms: time since the last beat
+ * @data: private data of heartbeat_scan
+ */
+typedef void (*heartbeat_stale_fn)(struct heartbeat_slot *slot, uint64_t age_ms,
+				void *data);
+
+/*
+ * heartbeat_scan - find apps which stopped beating
+ * @hb: table handle
+ * @func: called for every stale app
+ * @data: private data of func
+ *
+ * Slots of processes which exited without unregistering are freed.
+ * Returns the number of stale apps.
+ */
+int heartbeat_scan(struct heartbeat *hb, heartbeat_stale_fn func, void *data);
+
+#endif //__HEARTBEAT_H__
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef __cplusplus
+export "C" {
+#endif
+
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Values are bucketed like HdrHistogram: the top HIST_SUB_BITS bits
+ * below the leading one pick one of HIST_SUB sub buckets of its
+ * power of two, so a bucket is at most 1/HIST_SUB of its values wide
+ * at every magnitude. Values from 2^HIST_MAX_SHIFT on share the last
+ * bucket, in ns that is over 18 minutes.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_SHIFT 40
+#define HIST_BUCKETS ((HIST_MAX_SHIFT - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/*
+ * hist - log bucketed histogram of latencies
+ *
+ * Recording is a few relaxed atomic adds, any thread may record and
+ * read concurrently, a reader gets counts which are close but not
+ * an exact snapshot.
+ */
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline int hist_bucket(uint64_t value)
+{
+	int msb;
+
+	if (value < HIST_SUB)
+		return value;
+	msb = 63 - __builtin_clzll(value);
+	if (msb >= HIST_MAX_SHIFT)
+		return HIST_BUCKETS - 1;
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+		((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * hist_record - count one value
+ */
+static inline void hist_record(struct hist *h, uint64_t value)
+{
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&h->buckets[hist_bucket(value)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum, value, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	while (value > max && !__atomic_compare_exchange_n(&h->max, &max, value, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * hist_bucket_max - largest value counted in a bucket
+ */
+uint64_t hist_bucket_max(int bucket);
+
+/*
+ * hist_percentile - value below which a share of the values are
+ * @h: histogram
+ * @percent: 0 .. 100, e.g. 99.9
+ *
+ * Returns the upper end of the bucket holding the percentile, not
+ * more than the largest value recorded, 0 if the histogram is empty.
+ */
+uint64_t hist_percentile(const struct hist *h, double percent);
+
+/*
+ * hist_merge - add the counts of src to dst
+ */
+void hist_merge(struct hist *dst, const struct hist *src);
+
+/*
+ * hist_reset - forget all values
+ */
+static inline void hist_reset(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+#endif //__HIST_H__
+
+#ifdef __cplusplus
+}
+#endif
@@ -35,6 +35,7 @@ export "C" {
 #include <mqueue.h>
 #include <stdint.h>
 #include "looper.h"
+#include "siglib.h"
 
 #define MSG_QUEUE_NAME_SIZE 64
 #define MSG_QUEUE_MAX_SIZE 4096
@@ -49,6 +50,45 @@ struct ipc_msg {
 	char content[MSG_CONTENT_SIZE];
 };
 
+/*
+ * ipc_hdr - compact header in front of every frame on the wire
+ *
+ * A frame is the header, then srclen bytes of source app name if
+ * IPC_HDR_SOURCE is set, then len bytes of payload, then the send
+ * time if IPC_HDR_STAMP is set. Only these bytes are copied through
+ * the queue. Registered apps set IPC_HDR_SOURCE_ID instead, source
+ * names them in the registry.
+ */
+struct ipc_hdr {
+	uint16_t type;
+	uint16_t flags;
+	uint32_t seq;
+	uint32_t source;	/* source endpoint id */
+	uint16_t len;		/* payload length */
+	uint8_t srclen;
+	uint8_t reserved;
+};
+
+/* frame carries source app name, needed to send a reply */
+#define IPC_HDR_SOURCE 0x1
+/* payload is a descriptor of a buffer in sender's shared memory pool */
+#define IPC_HDR_SHMBUF 0x2
+/* payload is a batch of frames, each 4 bytes aligned */
+#define IPC_HDR_BATCH 0x4
+/* source endpoint id is in the registry, needed to send a reply */
+#define IPC_HDR_SOURCE_ID 0x8
+/* CLOCK_MONOTONIC ns of the send follows the payload, unaligned */
+#define IPC_HDR_STAMP 0x10
+#define IPC_STAMP_SIZE ((int)sizeof(uint64_t))
+/* bits 8-9 hold the message priority, also used as mqueue priority */
+#define IPC_HDR_PRIO_SHIFT 8
+#define IPC_HDR_PRIO_MASK (0x3 << IPC_HDR_PRIO_SHIFT)
+#define IPC_HDR_PRIO(prio) (((prio) << IPC_HDR_PRIO_SHIFT) & IPC_HDR_PRIO_MASK)
+#define IPC_HDR_GET_PRIO(flags) (((flags) & IPC_HDR_PRIO_MASK) >> IPC_HDR_PRIO_SHIFT)
+
+/* max payload length of a frame */
+#define IPC_MAX_PAYLOAD (MSG_QUEUE_MAX_SIZE - (int)sizeof(struct ipc_hdr))
+
 struct ipc_reply {
 	int type;
 	/*
@@ -64,6 +104,41 @@ struct ipc_reply {
  * */
 int ipc_watchdog_init(int second);
 
+/*
+ * IPC WATCHDOG FLAGS
+ * */
+
+/*
+ * Feed a slot of the shared heartbeat table instead of arming a
+ * SIGABRT timer of this process. Feeding is a timestamp store, and
+ * a supervisor scanning the table kills or restarts stale apps,
+ * see heartbeat.h and samples/watchdog_supervisor.c.
+ */
+#define IPC_WATCHDOG_HEARTBEAT 0x1
+
+/*
+ * ipc_watchdog_init_ex - init watchdog settings
+ * @second: init watchdog timeout time
+ * @flags: IPC_WATCHDOG_* flags
+ * */
+int ipc_watchdog_init_ex(int second, int flags);
+
+/*
+ * ipc_stall_init - watch looper handlers with a stall monitor
+ * @budget_ms: handlers running longer are logged with message type
+ * and thread stack, once per stall
+ * @abort_ms: handlers running longer raise SIGABRT, 0 never aborts
+ *
+ * Unlike the watchdog this catches a handler stuck for a fraction of
+ * the watchdog timeout, it costs two stores per message. See stall.h.
+ *
+ * NOTE:
+ * The stack is logged from a handler for SIGRTMAX - 2 that this call
+ * installs for the whole process, the application must not use that
+ * signal once the stall monitor is enabled.
+ * */
+int ipc_stall_init(int budget_ms, int abort_ms);
+
 /*
  * ipc_watchdog_feed - feed watchdog when receive watchdog message
  *
@@ -78,6 +153,321 @@ int ipc_watchdog_feed(void);
 */
 int ipc_send_msg_async(char *name, struct ipc_msg *msg);
 
+/*
+* ipc_send_buf - send a async message with variable length payload
+* @name: app name
+* @type: message type
+* @ptr: payload
+* @len: payload length, up to IPC_MAX_PAYLOAD
+*
+* Only the header and len bytes are sent. The receiver gets the
+* payload with ipc_msg_payload(), and the first MSG_CONTENT_SIZE
+* bytes also in msg->content.
+*/
+int ipc_send_buf(char *name, int type, const void *ptr, int len);
+
+/*
+ * IPC SEND FLAGS
+ * */
+
+/*
+ * Message priority from 0 (default) to IPC_PRIO_MAX. Higher priority
+ * messages pass lower ones in the receiver's mqueue and looper, lower
+ * priorities still get a share of the looper so they never starve.
+ * Ring endpoints keep arrival order in the ring itself.
+ */
+#define IPC_PRIO_MAX LOOPER_PRIO_MAX
+#define IPC_SEND_PRIO_MASK 0x3
+#define IPC_SEND_PRIO(prio) ((prio) & IPC_SEND_PRIO_MASK)
+
+/*
+ * Fail with errno EAGAIN at once if the queue or ring of the app is
+ * full, instead of waiting up to 3 seconds for room. The message is
+ * not sent then, see ipc_queue_stat() to pace sends by free room.
+ */
+#define IPC_SEND_NONBLOCK 0x4
+
+/*
+* ipc_send_ex - send a async message with send flags
+* @name: app name
+* @type: message type
+* @ptr: payload
+* @len: payload length, up to IPC_MAX_PAYLOAD
+* @flags: IPC_SEND_* flags
+*/
+int ipc_send_ex(char *name, int type, const void *ptr, int len, int flags);
+
+/*
+* ipc_send_msg_ex - send a async ipc_msg with send flags
+* @name: app name
+* @msg: request message
+* @flags: IPC_SEND_* flags
+*/
+int ipc_send_msg_ex(char *name, struct ipc_msg *msg, int flags);
+
+/*
+* ipc_msg_payload - get the payload of a received message
+* @msg: message handed to msg_handler
+* @len: store payload length
+*
+* The returned buffer is valid until msg_handler returns.
+*/
+void *ipc_msg_payload(struct ipc_msg *msg, int *len);
+
+/*
+* ipc_msg_hdr - get the frame header of a received message
+* @msg: message handed to msg_handler
+*/
+const struct ipc_hdr *ipc_msg_hdr(struct ipc_msg *msg);
+
+/*
+* ipc_shmbuf_init - create the shared memory pool of this endpoint
+* @count: buffer count
+* @size: size of each buffer
+*
+* Large payloads are written into pool buffers and only a small
+* descriptor is sent, see ipc_send_shmbuf(). Fails with EINVAL if
+* count or size isn't positive, or the pool would exceed 4GB.
+*/
+int ipc_shmbuf_init(int count, int size);
+
+/*
+* ipc_shmbuf_alloc - get a buffer from the shared memory pool
+* @len: bytes needed
+*
+* Returns NULL if len is larger than pool buffer size or all
+* buffers are in use.
+*/
+void *ipc_shmbuf_alloc(int len);
+
+/*
+* ipc_shmbuf_free - give back a buffer got by ipc_shmbuf_alloc
+* @buf: buffer point
+*
+* Should be called after the last ipc_send_shmbuf of the buffer,
+* the buffer returns to the pool when all receivers are done.
+*/
+void ipc_shmbuf_free(void *buf);
+
+/*
+* ipc_send_shmbuf - send a shared memory buffer without copying it
+* @name: app name
+* @type: message type
+* @buf: buffer got by ipc_shmbuf_alloc
+* @len: valid bytes in buffer
+*
+* The receiver gets the buffer by ipc_msg_payload(), and holds it
+* until its msg_handler returns. Messages the receiver drops give
+* the buffer back too, except a malformed descriptor which keeps
+* it referenced until the pool is created again.
+*/
+int ipc_send_shmbuf(char *name, int type, void *buf, int len);
+
+/*
+* ipc_batch_enable - pack async messages to the same app together
+* @linger_us: max time a message waits for others, 0 to disable
+*
+* With batching, async messages (ipc_send_msg_async, ipc_send_buf,
+* ipc_send_shmbuf and their peer versions) bound for the same app
+* are packed into one queue message, sent when it is full, when
+* ipc_flush() is called, or linger_us after the first message.
+* Sync messages and replies are never delayed, and flush the
+* batch of their app first to keep order.
+*/
+int ipc_batch_enable(int linger_us);
+
+/*
+* ipc_outbound_enable - send async messages from a sender thread
+* @depth: most messages queued for one app, 0 to disable
+*
+* With the outbound thread, async messages (ipc_send_msg_async,
+* ipc_send_buf, ipc_send_ex with or without IPC_SEND_NONBLOCK and
+* their peer versions) are only queued for their app, and the
+* thread sends them without waiting on any queue. An app with a
+* full queue is retried later and only delays its own messages,
+* the caller and the other apps go on. When depth messages wait for
+* an app, sends to it fail with EAGAIN. Messages queued together
+* are packed into batches. Sync messages and replies are sent by
+* the caller, after the messages queued for their app.
+*/
+int ipc_outbound_enable(int depth);
+
+/*
+* ipc_flush - send all batched and queued messages now
+*/
+void ipc_flush(void);
+
+#define IPC_STATS_BATCH_BUCKETS 6
+
+/*
+ * ipc_stats - receive side counters
+ * @recv_frames: frames taken from the queue or ring
+ * @recv_batches: times received messages were handed to looper
+ * @batch_max: most messages handed to looper at once
+ * @batch_hist: batch sizes, bucket i counts sizes 2^i .. 2^(i+1) - 1,
+ *		the last bucket counts all larger sizes
+ * @queue_depth: messages waiting in the queue or ring now
+ * @queue_maxmsg: capacity of the queue or ring
+ * @queue_full: sends of all apps which found the queue full, 0 if
+ *		the app isn't in the registry
+ * @send_sync: sync requests sent, ipc_send_msg_sync and the like
+ * @send_async: async messages sent, including async calls
+ * @recv_request: requests received, handed to their handler
+ * @recv_reply: replies received
+ */
+struct ipc_stats {
+	uint64_t recv_frames;
+	uint64_t recv_batches;
+	uint32_t batch_max;
+	uint64_t batch_hist[IPC_STATS_BATCH_BUCKETS];
+	uint32_t queue_depth;
+	uint32_t queue_maxmsg;
+	uint64_t queue_full;
+	uint64_t send_sync;
+	uint64_t send_async;
+	uint64_t recv_request;
+	uint64_t recv_reply;
+};
+
+/*
+* ipc_get_stats - get receive side counters
+* @stats: filled with a snapshot of counters
+*/
+int ipc_get_stats(struct ipc_stats *stats);
+
+/*
+ * hops of a received message, each has its own latency histogram
+ */
+enum {
+	IPC_HOP_TRANSIT,	/* send call to dequeue by the receive thread */
+	IPC_HOP_DISPATCH,	/* dequeue to looper enqueue */
+	IPC_HOP_QUEUE,		/* looper enqueue to handler start */
+	IPC_HOP_HANDLER,	/* handler start to handler end */
+	IPC_HOP_TOTAL,		/* send call to handler end */
+	IPC_HOP_COUNT,
+};
+
+/* type of ipc_latency_get for all message types together */
+#define IPC_LATENCY_ALL (-1)
+
+/*
+ * ipc_latency - latency summary of one hop
+ * @count: messages measured
+ * @mean_ns: average latency
+ * @max_ns: largest latency
+ * @p50_ns: median, percentiles are exact to 1/8 of their value
+ * @p90_ns: 90th percentile
+ * @p99_ns: 99th percentile
+ * @p999_ns: 99.9th percentile
+ */
+struct ipc_latency {
+	uint64_t count;
+	uint64_t mean_ns;
+	uint64_t max_ns;
+	uint64_t p50_ns;
+	uint64_t p90_ns;
+	uint64_t p99_ns;
+	uint64_t p999_ns;
+};
+
+/*
+* ipc_latency_enable - measure latency of every message hop
+* @enable: 1 to start, 0 to stop
+*
+* Senders stamp messages of application types with a monotonic
+* time, adding IPC_STAMP_SIZE bytes to the frame unless it's already
+* IPC_MAX_PAYLOAD long. Receivers time the dequeue, the looper
+* enqueue and their handlers, and keep a histogram per message type
+* and hop. Transit and total need stamped messages, i.e. latency on
+* in the sender too. Handlers registered with IPC_HANDLER_INLINE
+* have no dispatch and queue hop. Costs a few clock reads from the
+* vDSO per message.
+*/
+int ipc_latency_enable(int enable);
+
+/*
+* ipc_latency_get - get the latency summary of a hop
+* @type: message type, or IPC_LATENCY_ALL
+* @hop: IPC_HOP_*
+* @lat: filled with the summary, all zero if nothing was measured
+*/
+int ipc_latency_get(int type, int hop, struct ipc_latency *lat);
+
+/*
+* ipc_latency_reset - forget measured latencies
+*/
+void ipc_latency_reset(void);
+
+/*
+ * Capabilities of an endpoint, besides the IPC_INIT_* flags it was
+ * initialized with.
+ */
+/* has a shared memory pool, see ipc_shmbuf_init */
+#define IPC_CAP_SHMBUF 0x10000
+
+/*
+ * ipc_endpoint - an app found in the service registry
+ * @id: endpoint id, the source of frames the app sends
+ * @pid: process id of the app
+ * @ring: 1 if the app receives from a ring, 0 from a message queue
+ * @caps: IPC_INIT_* flags of the app and IPC_CAP_* bits
+ */
+struct ipc_endpoint {
+	uint32_t id;
+	int pid;
+	int ring;
+	uint32_t caps;
+};
+
+/*
+* ipc_lookup - find an app in the service registry
+* @name: app name
+* @ep: filled with the endpoint of the app
+*
+* Every app registers in a shared memory table in ipc_init and
+* unregisters in ipc_deinit, the lookup takes no lock and no
+* syscall. Returns -1 with errno ENOENT if the app never ran,
+* ESRCH if it has exited.
+*/
+int ipc_lookup(const char *name, struct ipc_endpoint *ep);
+
+/*
+* ipc_publish - send a message to all subscribers of a topic
+* @topic: topic name, no '/'
+* @type: message type, 0-8999
+* @ptr: payload
+* @len: payload length, up to IPC_MAX_PAYLOAD
+*
+* The frame is written once into a shared memory ring of the topic,
+* subscribers read it with their own cursor. The publisher never
+* waits for slow subscribers, they lose the oldest messages instead,
+* see ipc_topic_lost(). Only subscribers which read everything are
+* notified, with a small frame.
+*/
+int ipc_publish(const char *topic, int type, const void *ptr, int len);
+
+/*
+* ipc_subscribe - receive messages published to a topic from now on
+* @topic: topic name, no '/'
+*
+* Messages are handed to the message handlers like other messages,
+* with the type given to ipc_publish.
+*/
+int ipc_subscribe(const char *topic);
+
+/*
+* ipc_unsubscribe - stop receiving messages of a topic
+* @topic: topic name
+*/
+int ipc_unsubscribe(const char *topic);
+
+/*
+* ipc_topic_lost - get messages of a topic lost because this app was slow
+* @topic: subscribed topic name
+* @lost: store the count
+*/
+int ipc_topic_lost(const char *topic, uint64_t *lost);
+
 /*
 * ipc_send_msg_sync - send a sync message and will wait for reply
 * @name: app name
@@ -86,12 +476,133 @@ int ipc_send_msg_async(char *name, struct ipc_msg *msg);
 */
 int ipc_send_msg_sync(char *name, struct ipc_msg *msg, struct ipc_reply *reply);
 
+/*
+ * ipc_peer - opaque handle of a destination app, see ipc_peer_open()
+ * */
+struct ipc_peer;
+
+/*
+ * ipc_queue_stat - flow control state of the queue of an app
+ * @depth: messages waiting in the queue now
+ * @maxmsg: capacity, maxmsg - depth messages can be sent without
+ *	    waiting or EAGAIN
+ * @msgsize: max frame size the queue takes
+ * @full: sends of this process which found the queue full
+ * @outbound: messages of this process waiting for the outbound
+ *	      thread, see ipc_outbound_enable()
+ */
+struct ipc_queue_stat {
+	uint32_t depth;
+	uint32_t maxmsg;
+	uint32_t msgsize;
+	uint64_t full;
+	uint32_t outbound;
+};
+
+/*
+* ipc_queue_stat - get the flow control state of an app's queue
+* @name: app name
+* @st: filled with the state
+*
+* Reading depth of a ring costs no syscall, of a POSIX queue one.
+*/
+int ipc_queue_stat(char *name, struct ipc_queue_stat *st);
+
+/*
+* ipc_queue_attr - set depth and message size of endpoints created later
+* @maxmsg: queue depth, or ring slots rounded up to power of two,
+*	   0 for the default (10 for a queue, RING_DEFAULT_SLOTS)
+* @msgsize: max frame size, up to MSG_QUEUE_MAX_SIZE, 0 for that
+*
+* Applies to ipc_init and ipc_ctx_create called afterwards. Values
+* for a POSIX queue are checked against /proc/sys/fs/mqueue/msg_max
+* and msgsize_max. Returns -1 with errno EINVAL if out of range.
+*/
+int ipc_queue_attr(int maxmsg, int msgsize);
+
+/*
+* ipc_peer_open - get a handle of the app for repeated sends
+* @name: app name
+*
+* The handle keeps the app's queue open, so sending through it
+* skips the name lookup. If the app restarts, the handle will
+* follow its new queue. Returns NULL if the app doesn't exist.
+*/
+struct ipc_peer *ipc_peer_open(char *name);
+
+/*
+* ipc_peer_send_async - send a async message through a peer handle
+* @peer: handle returned by ipc_peer_open
+* @msg: request message
+*/
+int ipc_peer_send_async(struct ipc_peer *peer, struct ipc_msg *msg);
+
+/*
+* ipc_peer_send_sync - send a sync message through a peer handle
+* @peer: handle returned by ipc_peer_open
+* @msg: request message
+* @reply: reply which need to send
+*/
+int ipc_peer_send_sync(struct ipc_peer *peer, struct ipc_msg *msg, struct ipc_reply *reply);
+
+/*
+* ipc_peer_send_buf - send a variable length message through a peer handle
+* @peer: handle returned by ipc_peer_open
+* @type: message type
+* @ptr: payload
+* @len: payload length, up to IPC_MAX_PAYLOAD
+*/
+int ipc_peer_send_buf(struct ipc_peer *peer, int type, const void *ptr, int len);
+
+/*
+* ipc_peer_stat - ipc_queue_stat through a peer handle
+* @peer: handle returned by ipc_peer_open
+* @st: filled with the state
+*/
+int ipc_peer_stat(struct ipc_peer *peer, struct ipc_queue_stat *st);
+
+/*
+* ipc_peer_close - release a peer handle
+* @peer: handle returned by ipc_peer_open
+*/
+void ipc_peer_close(struct ipc_peer *peer);
+
+/*
+* ipc_reply_cb - completion callback of ipc_call_async
+* @status: 0 if reply is received, ETIMEDOUT if no reply in time,
+*	   ECANCELED if the context was destroyed first
+* @reply: the reply, valid only in callback
+* @ctx: private data given to ipc_call_async
+*/
+typedef void (*ipc_reply_cb)(int status, struct ipc_reply *reply, void *ctx);
+
+/*
+* ipc_call_async - send a request and get its reply by callback
+* @name: app name
+* @msg: request message
+* @callback: called in looper thread with the reply or a timeout,
+*	     must not be NULL
+* @ctx: private data of callback
+* @timeout_ms: max time to wait for the reply, not negative
+*
+* Return immediately after the request is sent, so a looper can
+* keep many requests outstanding. The callback is not called if
+* this function fails. Calls still pending when the context is
+* destroyed get their callback with ECANCELED, in the thread which
+* destroys it.
+*/
+int ipc_call_async(char *name, struct ipc_msg *msg, ipc_reply_cb callback,
+					void *ctx, int timeout_ms);
+
 /*
 * ipc_send_reply - send a reply for a sync message
 * @msg: request message
 * @reply: reply which need to send
 *
 * This function will set reply->type equal (msg->type + MSG_TYPE_REPLY_BASE)
+* msg must be the message handed to msg_handler, and the reply must be
+* sent before the handler returns. A reply to a copy of the message is
+* sent from the default context without the request seq, with an error.
 */
 int ipc_send_reply(struct ipc_msg *msg, struct ipc_reply *reply);
 
@@ -116,12 +627,221 @@ void ipc_stop_loop(void);
 */
 int ipc_init(char *name, msg_handler handler);
 
+/*
+ * IPC INIT FLAGS
+ * */
+
+/*
+ * Receive messages from a lock-free ring in /dev/shm instead of
+ * POSIX message queue. Senders find the ring by app name, so the
+ * send APIs don't change.
+ */
+#define IPC_INIT_RING 0x1
+
+/*
+ * Run ipc_main_loop on epoll. The queue (or the doorbell of a ring),
+ * the timers of ipc_timer_wheel(), the signals of ipc_signal_init()
+ * and wakeups from other threads are waited in the main loop thread
+ * without polling, so no timer or signal thread is needed.
+ */
+#define IPC_INIT_EPOLL 0x2
+
+/*
+ * Same main loop as IPC_INIT_EPOLL, but the fds are watched with
+ * io_uring multishot polls and timeouts, so a wakeup reaps all its
+ * completions after one io_uring_enter. Falls back to epoll if the
+ * kernel lacks io_uring or multishot poll (5.13).
+ */
+#define IPC_INIT_URING 0x4
+
+/*
+* ipc_init_ex - ipc initialize with endpoint options
+*
+* @name: app name
+* @handler: data handle callback in looper thread
+* @flags: IPC_INIT_* flags
+*/
+int ipc_init_ex(char *name, msg_handler handler, int flags);
+
+/*
+* ipc_init_looper - ipc initialize with a looper created by application
+*
+* @name: app name
+* @looper: looper handling messages, e.g. from looper_pool_create,
+*	   its loop_cb is the message handler and its free_cb is
+*	   replaced by ipclib. ipc_deinit destroys it. Fails with
+*	   EBUSY if it already serves a context.
+* @flags: IPC_INIT_* flags
+*/
+int ipc_init_looper(char *name, struct looper *looper, int flags);
+
+/*
+* ipc_handler_cb - handler of registered message types
+* @msg: received message, valid until the handler returns
+*/
+typedef void (*ipc_handler_cb)(struct ipc_msg *msg);
+
+/*
+ * IPC HANDLER FLAGS
+ * */
+
+/*
+ * Run the handler in the receive thread as soon as the message is
+ * received, without the looper hop. Only for short handlers which
+ * never block: the receive thread handles nothing else meanwhile,
+ * and the message may be handled before earlier looper messages.
+ */
+#define IPC_HANDLER_INLINE 0x1
+
+/*
+* ipc_register_handler - handle a range of message types with a handler
+* @first: first type, 0 .. MSG_TYPE_REPLY_BASE - 1
+* @last: last type, equal to first for one type
+* @handler: called for the types instead of the handler of ipc_init,
+*	    NULL removes a registration
+* @flags: IPC_HANDLER_* flags
+*
+* Handlers are found by direct indexing on the type, the handler of
+* ipc_init (which may be NULL) gets the types not registered.
+*/
+int ipc_register_handler(int first, int last, ipc_handler_cb handler, int flags);
+
+/*
+* ipc_timer_wheel - timer wheel processed by the epoll main loop
+*
+* Timers on it fire in the main loop thread, or in a looper if one is
+* given to wheel_timer_init. Returns NULL without IPC_INIT_EPOLL.
+*/
+struct timer_wheel;
+struct timer_wheel *ipc_timer_wheel(void);
+
+/*
+* ipc_signal_init - handle signals in the epoll main loop
+* @func: called in main loop thread with the signal number
+*
+* Same signals as set_signal_thread, read from a signalfd. Must be
+* called before ipc_init and before any thread is created, so every
+* thread has the signals blocked.
+*/
+int ipc_signal_init(sigfunc func);
+
 /*
 * ipc_deinit - ipc de-initialize
 * Applications should call this function when exit
 */
 void ipc_deinit(void);
 
+/*
+ * ipc_ctx - an endpoint of its own: queue or ring, main loop, looper,
+ * handler table and pending calls
+ *
+ * A process may create several contexts with different names, e.g.
+ * one per core to spread high volume traffic, each run by its own
+ * thread. The global ipc_* functions work on the default context
+ * made by ipc_init. Signals, watchdog, shared memory pool, topics
+ * and async calls stay with the default context.
+ * */
+struct ipc_ctx;
+
+/*
+* ipc_ctx_create - create an endpoint context
+* @name: app name of the context, different from other endpoints
+* @handler: data handle callback in looper thread of the context
+* @flags: IPC_INIT_* flags
+*
+* Like ipc_init, exits the process if the endpoint can't be created.
+*/
+struct ipc_ctx *ipc_ctx_create(char *name, msg_handler handler, int flags);
+
+/*
+* ipc_ctx_create_looper - create an endpoint context with a looper
+* created by application
+* @name: app name of the context
+* @looper: looper handling messages, see ipc_init_looper
+* @flags: IPC_INIT_* flags
+*
+* Returns NULL with errno EBUSY if the looper serves another context.
+*/
+struct ipc_ctx *ipc_ctx_create_looper(char *name, struct looper *looper, int flags);
+
+/*
+* ipc_ctx_destroy - stop a context and remove its endpoint
+* @ctx: context of ipc_ctx_create, its main loop must have returned
+*/
+void ipc_ctx_destroy(struct ipc_ctx *ctx);
+
+/*
+* ipc_default_ctx - the context of ipc_init, NULL before it
+*/
+struct ipc_ctx *ipc_default_ctx(void);
+
+/*
+* ipc_msg_ctx - the context which received a message
+* @msg: message handed to a handler
+*
+* Returns NULL if msg is a copy or its handler already returned.
+*/
+struct ipc_ctx *ipc_msg_ctx(struct ipc_msg *msg);
+
+/*
+* ipc_ctx_run - receive and dispatch messages of a context
+* @ctx: context
+*
+* Returns after ipc_ctx_stop. The calling thread is the receive
+* thread of the context, pin it to place the context on a core.
+*/
+void ipc_ctx_run(struct ipc_ctx *ctx);
+
+/*
+* ipc_ctx_stop - make ipc_ctx_run return
+* @ctx: context
+*/
+void ipc_ctx_stop(struct ipc_ctx *ctx);
+
+/*
+* ipc_ctx_send - send a async message from a context
+* @ctx: context, the source of the message
+* @name: app name
+* @type: message type
+* @ptr: payload
+* @len: payload length, up to IPC_MAX_PAYLOAD
+* @flags: IPC_SEND_* flags
+*/
+int ipc_ctx_send(struct ipc_ctx *ctx, char *name, int type, const void *ptr,
+				int len, int flags);
+
+/*
+* ipc_ctx_send_sync - send a sync message and wait for its reply
+* @ctx: context, the reply comes back to it, so its loop must run
+* @name: app name
+* @msg: request message
+* @reply: store the reply
+*/
+int ipc_ctx_send_sync(struct ipc_ctx *ctx, char *name, struct ipc_msg *msg,
+				struct ipc_reply *reply);
+
+/*
+* ipc_ctx_register_handler - ipc_register_handler of a context
+*/
+int ipc_ctx_register_handler(struct ipc_ctx *ctx, int first, int last,
+				ipc_handler_cb handler, int flags);
+
+/*
+* ipc_ctx_get_stats - ipc_get_stats of a context
+*/
+int ipc_ctx_get_stats(struct ipc_ctx *ctx, struct ipc_stats *stats);
+
+/*
+* ipc_ctx_latency_get - ipc_latency_get of a context
+*/
+int ipc_ctx_latency_get(struct ipc_ctx *ctx, int type, int hop,
+				struct ipc_latency *lat);
+
+/*
+* ipc_ctx_latency_reset - ipc_latency_reset of a context
+*/
+void ipc_ctx_latency_reset(struct ipc_ctx *ctx);
+
 
 /*
  * MSG TYPE DEFINITIONS
@@ -137,6 +857,12 @@ void ipc_deinit(void);
 
 /* 9000-9999: common use */
 #define MSG_TYPE_WATCHDOG 9000
+/* used internally to wake up the receive loop, never handed to apps */
+#define MSG_TYPE_WAKEUP 9001
+/* used internally for batched frames, unpacked by receiver */
+#define MSG_TYPE_BATCH 9002
+/* used internally to tell a subscriber its topics have messages */
+#define MSG_TYPE_TOPIC 9003
 
 
 /* 0-8999: applications use */
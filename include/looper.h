@@ -33,7 +33,10 @@ export "C" {
 #include <stdint.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <time.h>
 #include "list_node.h"
+#include "mpsc.h"
+#include "stall.h"
 
 /*
 * Callbacks which are needed to construct a looper.
@@ -41,15 +44,67 @@ export "C" {
 typedef void (*msg_handler)(void *data);
 typedef void (*msg_free)(void *data);
 
+/*
+* looper_prio_fn - get the priority of dispatched data
+*
+* Returns 0 (default) .. LOOPER_PRIO_MAX, higher is handled first.
+*/
+typedef int (*looper_prio_fn)(void *data);
+
+/*
+* looper_tag_fn - get the tag of dispatched data
+*
+* The tag, e.g. a message type, is logged by the stall monitor when
+* the handler of data runs over its budget.
+*/
+typedef uint32_t (*looper_tag_fn)(void *data);
+
+/*
+* looper_entity_fn - get the msg_entity embedded in dispatched data
+*
+* Lets dispatch link data without allocating an entity. The entity
+* must stay valid until free_cb releases data, and data must not be
+* queued twice at the same time. NULL means entities are allocated
+* from the looper's entity pool.
+*/
+typedef struct msg_entity *(*looper_entity_fn)(void *data);
+
+#define LOOPER_PRIO_LEVELS 4
+#define LOOPER_PRIO_MAX (LOOPER_PRIO_LEVELS - 1)
+
 /*
 * msg_entity - message entity structure in message list
 */
 struct msg_entity {
 	struct list_node node;
+	struct mpsc_node qnode;
 	uint32_t msg_id;
+	uint8_t prio;
+	/* entity lives in data, see looper_entity_fn */
+	uint8_t embedded;
+	/* delayed messages only: id for looper_cancel and due time */
+	int timer_id;
+	uint64_t deadline;
+	msg_handler func;
 	void *data;
 };
 
+/*
+* looper_runq - messages ready to run, one list per priority
+*
+* Higher levels go first, but each level may only run a weighted
+* number of messages before waiting levels below get a turn, so
+* bulk traffic is never starved by a flood of urgent messages.
+*/
+struct looper_runq {
+	struct list_node level[LOOPER_PRIO_LEVELS];
+	uint32_t credit[LOOPER_PRIO_LEVELS];
+	/* bit i set if level i is not empty / has credit left */
+	uint32_t mask;
+	uint32_t credit_mask;
+	uint32_t count;
+};
+
 /*
 * looper - core structure for looper
 *
@@ -61,9 +116,40 @@ struct looper {
 	int (*start)(struct looper *looper);
 	int (*stop)(struct looper *looper);
 	void (*dispatch)(struct looper *looper, void  *data);
+	/*
+	* post - run func(data) in looper thread instead of loop_cb,
+	* free_cb is not called for posted data.
+	*/
+	void (*post)(struct looper *looper, msg_handler func, void *data);
+	/*
+	* dispatch_batch - dispatch many data, taking the lock and waking up
+	* once for every chunk of them
+	*/
+	void (*dispatch_batch)(struct looper *looper, void **data, int count);
 	struct list_node head;
 	uint32_t msg_id;
 	bool running;
+	int flags;
+	/* used instead of head/lock/condition with LOOPER_F_LOCKFREE */
+	struct mpsc_queue queue;
+	uint32_t sleeping;
+	/* new messages are moved here by the looper thread */
+	struct looper_runq runq;
+	/* priority of dispatched data, NULL means all are default */
+	looper_prio_fn prio_cb;
+	/* tag of dispatched data for stall logs, NULL means 0 */
+	looper_tag_fn tag_cb;
+	/* entity embedded in dispatched data, NULL allocates one */
+	looper_entity_fn entity_cb;
+	/* handler state of the looper thread, see stall.h */
+	struct stall_slot stall;
+	/* delayed messages, min-heap on deadline, protected by lock */
+	struct msg_entity **timers;
+	int timer_count;
+	int timer_size;
+	int timer_seq;
+	/* deadline of timers[0] in monotonic ns, UINT64_MAX if none */
+	uint64_t next_deadline;
 	pthread_mutex_t lock;
 	pthread_cond_t condition;
 	pthread_t tid;
@@ -79,6 +165,87 @@ struct looper {
 */
 struct looper *looper_create(msg_handler loop_cb, msg_free free_cb, const char *name);
 
+/*
+ * LOOPER CREATE FLAGS
+ * */
+
+/*
+ * Queue messages in a lock-free list and sleep on a futex only when
+ * the list is empty, dispatch never blocks on other producers.
+ */
+#define LOOPER_F_LOCKFREE 0x1
+
+/*
+* looper_create_flags - create looper structure with options
+* @loop_cb: handler of dispatched data
+* @free_cb: free dispatched data after loop_cb
+* @name: looper name
+* @flags: LOOPER_F_* flags
+*/
+struct looper *looper_create_flags(msg_handler loop_cb, msg_free free_cb,
+					const char *name, int flags);
+
+/*
+ * Set by looper_pool_create, looper_destory frees the whole pool.
+ */
+#define LOOPER_F_POOL 0x2
+
+/*
+* looper_key_fn - get the shard key of dispatched data
+*
+* Data with the same key is handled in dispatch order by one worker,
+* LOOPER_KEY_ANY (or any negative key) means the data can be handled
+* by whichever worker is idle.
+*/
+typedef int (*looper_key_fn)(void *data);
+
+#define LOOPER_KEY_ANY (-1)
+
+/*
+* looper_pool_create - create a looper with several worker threads
+* @loop_cb: handler of dispatched data, called from any worker
+* @free_cb: free dispatched data after loop_cb
+* @name: looper name
+* @threads: number of worker threads
+* @key: shard key of data, NULL makes all data unordered
+*
+* The pool is used with the normal looper operations and destroyed
+* with looper_destory. Posted functions are always unordered.
+*/
+struct looper *looper_pool_create(msg_handler loop_cb, msg_free free_cb,
+					const char *name, int threads, looper_key_fn key);
+
+/*
+* looper_dispatch_delayed - dispatch data after a delay
+* @looper: looper or looper pool
+* @data: data handed to loop_cb
+* @delay_us: delay in microseconds
+*
+* Runs in the looper thread like dispatched data, no timer thread
+* is used. Returns a positive id for looper_cancel, or -1.
+*/
+int looper_dispatch_delayed(struct looper *looper, void *data, uint64_t delay_us);
+
+/*
+* looper_dispatch_at - dispatch data at a point of time
+* @looper: looper or looper pool
+* @data: data handed to loop_cb
+* @when: CLOCK_MONOTONIC time to handle data
+*
+* Returns a positive id for looper_cancel, or -1.
+*/
+int looper_dispatch_at(struct looper *looper, void *data, const struct timespec *when);
+
+/*
+* looper_cancel - cancel delayed data which is not due yet
+* @looper: looper or looper pool
+* @id: id returned by looper_dispatch_delayed/looper_dispatch_at
+*
+* Data is freed with free_cb. Returns 0, or -1 with errno ENOENT
+* if the data has already been handed to loop_cb.
+*/
+int looper_cancel(struct looper *looper, int id);
+
 /*
 * looper_destory - destory looper structure
 *
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifdef __cplusplus
+export "C" {
+#endif
+
+#ifndef __MPSC_H__
+#define __MPSC_H__
+
+#include <stddef.h>
+
+/*
+ * Intrusive multi-producer single-consumer queue.
+ *
+ * Producers only do one atomic exchange on head, the consumer owns
+ * tail and never touches head unless the queue looks empty. A stub
+ * node keeps the queue non-empty so push never needs a CAS loop.
+ */
+struct mpsc_node {
+	struct mpsc_node *next;
+};
+
+struct mpsc_queue {
+	struct mpsc_node *head;
+	/* keep producer and consumer side on different cache lines */
+	char pad[64 - sizeof(struct mpsc_node *)];
+	struct mpsc_node *tail;
+	struct mpsc_node stub;
+};
+
+static inline void mpsc_init(struct mpsc_queue *q)
+{
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+/*
+ * mpsc_push - add a node to the queue tail, safe from any thread
+ * @q: queue
+ * @node: node to add
+ */
+static inline void mpsc_push(struct mpsc_queue *q, struct mpsc_node *node)
+{
+	struct mpsc_node *prev;
+
+	__atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&q->head, node, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/*
+ * mpsc_pop - take the oldest node, consumer thread only
+ * @q: queue
+ *
+ * Returns NULL if the queue is empty, or if a producer is in the
+ * middle of mpsc_push; that producer finishes right after, so the
+ * consumer should retry before it goes to sleep.
+ */
+static inline struct mpsc_node *mpsc_pop(struct mpsc_queue *q)
+{
+	struct mpsc_node *tail = q->tail;
+	struct mpsc_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub) {
+		if (!next)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	/* tail is the last node, put stub behind it so it can be taken */
+	mpsc_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+#endif //__MPSC_H__
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifdef __cplusplus
+export "C" {
+#endif
+
+#ifndef __MSGPOOL_H__
+#define __MSGPOOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * msgpool - fixed size object allocator with per-thread caches
+ *
+ * Free objects are linked through their first word. Each thread
+ * allocates from and frees to its own cache without locks, a cache
+ * going empty or full moves half of cache_max objects from or to
+ * the shared list under one lock. The heap is only used while the
+ * pool grows, or when the shared list is over free_max.
+ *
+ * Pools live as long as the process, there is no destroy: caches
+ * of other threads may still hold objects. Put them in static
+ * storage and init them once.
+ */
+struct msgpool {
+	char name[32];
+	size_t size;
+	uint32_t cache_max;
+	uint32_t free_max;
+	pthread_key_t key;
+	pthread_mutex_t lock;
+	/* shared free list, protected by lock */
+	void *free_list;
+	uint32_t free_count;
+	/* slow path counters, steady state should not move them */
+	uint64_t heap_allocs;
+	uint64_t heap_frees;
+	uint64_t refills;
+	uint64_t flushes;
+};
+
+/*
+ * msgpool_init - init a pool
+ * @pool: pool, usually static
+ * @name: pool name in logs
+ * @size: object size
+ * @cache_max: objects a thread cache holds before flushing half
+ * @free_max: objects kept on the shared list, more go to the heap
+ */
+int msgpool_init(struct msgpool *pool, const char *name, size_t size,
+			uint32_t cache_max, uint32_t free_max);
+
+/*
+ * msgpool_alloc - get an object, NULL if the heap is exhausted
+ *
+ * The object is not zeroed.
+ */
+void *msgpool_alloc(struct msgpool *pool);
+
+/*
+ * msgpool_free - give an object back, from any thread
+ */
+void msgpool_free(struct msgpool *pool, void *obj);
+
+/*
+ * msgpool_flush - move the cache of the calling thread to the
+ * shared list, e.g. before a thread goes idle for long. Threads
+ * exiting flush their cache automatically.
+ */
+void msgpool_flush(struct msgpool *pool);
+
+#endif/*__MSGPOOL_H__*/
+
+#ifdef __cplusplus
+}
+#endif
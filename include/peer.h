@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifdef __cplusplus
+export "C" {
+#endif
+
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <mqueue.h>
+#include <sys/types.h>
+#include "list_node.h"
+#include "ring.h"
+#include "registry.h"
+
+struct ipc_queue_stat;
+
+#define PEER_NAME_SIZE 64
+#define PEER_HASH_SIZE 64
+#define PEER_TABLE_MAX 128
+#define PEER_CHECK_INTERVAL_NS 1000000000ULL
+/* wait of the outbound thread before it retries a full queue */
+#define PEER_OUT_RETRY_NS 1000000ULL
+/* messages the outbound thread sends to one peer before the next */
+#define PEER_OUT_BURST 8
+
+/*
+ * ipc_peer - cached transport of a destination app
+ *
+ * Entries live in a per-process hash table keyed by app name,
+ * recently used ones are kept at the head of the lru list.
+ * Users hold a reference while sending, entries with references
+ * are never evicted.
+ */
+struct ipc_peer {
+	struct list_node hnode;
+	struct list_node lru;
+	char name[PEER_NAME_SIZE];
+	uint32_t hash;
+	int refcnt;
+	int dead;
+	/*
+	 * lock protects the transport below: senders take it as reader,
+	 * validation takes it as writer when the peer is recreated.
+	 */
+	pthread_rwlock_t lock;
+	mqd_t mqd;
+	struct ring *ring;
+	ino_t ino;
+	/* registry id and gen of the app, id is 0 if not registered */
+	uint32_t id;
+	uint32_t gen;
+	/* depth and message size of the transport, sends found it full */
+	uint32_t maxmsg;
+	uint32_t msgsize;
+	uint64_t full;
+	uint64_t check_ns;
+	/*
+	 * batch of async frames not sent yet, protected by batch_lock,
+	 * bnode/bqueued/deadline by the global batch list lock.
+	 */
+	pthread_mutex_t batch_lock;
+	char *batch;
+	int batch_len;
+	int batch_count;
+	int batch_first;
+	struct list_node bnode;
+	int bqueued;
+	uint64_t deadline;
+	/*
+	 * frames waiting for the outbound thread, protected by out_lock,
+	 * onode/oqueued/retry by the global outbound list lock. oqueued
+	 * stays set while the thread sends them.
+	 */
+	pthread_mutex_t out_lock;
+	struct list_node out_frames;
+	uint32_t out_count;
+	struct list_node onode;
+	int oqueued;
+	uint64_t retry;
+};
+
+/*
+ * transport helpers
+ */
+mqd_t mq_rw_create(char *name, int maxmsg, int maxsize);
+mqd_t mq_rd_open(char *name);
+mqd_t mq_wr_open(char *name);
+int mq_recv_msg(mqd_t mq, char *buf, int maxsize);
+int mq_send_msg(mqd_t mq, char *buf, int length, unsigned int prio);
+int mq_try_send(mqd_t mqd, void *buf, int length, unsigned int prio);
+int mq_send_msg_timeout(mqd_t mqd, void *buf, int length, unsigned int prio);
+int ring_send_msg_timeout(struct ring *ring, void *buf, int length);
+
+/*
+ * peer_registry_set - resolve apps through the service registry
+ * @reg: registry handle, NULL to stop using it
+ *
+ * Cached peers keep using the handle. Setting NULL waits for pending
+ * lookups and makes all peers, also ones still referenced, forget
+ * their registry id, the old handle may be closed afterwards.
+ */
+void peer_registry_set(struct registry *reg);
+
+/*
+ * peer_hash - FNV-1a hash of an app name
+ */
+uint32_t peer_hash(const char *name);
+
+/*
+ * peer_get - get the peer of an app and hold a reference
+ * @name: app name, leading '/' is ignored
+ *
+ * Open the peer transport if it's not cached yet.
+ * Returns NULL if the app doesn't exist.
+ */
+struct ipc_peer *peer_get(const char *name);
+
+/*
+ * peer_put - drop a reference got by peer_get
+ */
+void peer_put(struct ipc_peer *peer);
+
+/*
+ * peer_send - send a frame to the peer
+ * @peer: peer got by peer_get
+ * @buf: frame data
+ * @length: frame length
+ *
+ * The transport is re-validated from time to time, and reopened
+ * if the peer queue or ring has been unlinked and recreated.
+ */
+int peer_send(struct ipc_peer *peer, void *buf, int length);
+
+/*
+ * peer_try_send - send a frame without waiting
+ * @peer: peer got by peer_get
+ * @buf: frame data
+ * @length: frame length
+ *
+ * Returns -1 with errno EAGAIN if the peer queue or ring is full,
+ * the frame is not sent then.
+ */
+int peer_try_send(struct ipc_peer *peer, void *buf, int length);
+
+/*
+ * peer_queue_stat - get depth, capacity and full count of the peer queue
+ */
+int peer_queue_stat(struct ipc_peer *peer, struct ipc_queue_stat *st);
+
+/*
+ * peer_send_async - send a async frame, batched if enabled
+ * @peer: peer got by peer_get
+ * @buf: frame data
+ * @length: frame length
+ *
+ * With batching enabled the frame is packed with other frames to
+ * the same peer into one queue message, which is sent when it is
+ * full, on peer_flush_all() or when the linger time expires.
+ * Returns 0 once the frame is batched or queued, frames lost later
+ * are logged and their shared memory buffers given back.
+ */
+int peer_send_async(struct ipc_peer *peer, void *buf, int length);
+
+/*
+ * peer_batch_enable - enable or disable sender side batching
+ * @linger_us: max time a frame waits in a batch, 0 to disable
+ */
+int peer_batch_enable(int linger_us);
+
+/*
+ * peer_outbound_enable - send async frames from the outbound thread
+ * @depth: most frames queued for one peer, 0 to disable
+ *
+ * peer_send_async and peer_try_send only queue the frame for its
+ * peer, the outbound thread sends the queues without waiting and
+ * skips peers whose queue is full, so a slow app only delays its
+ * own frames. Frames queued together are sent in batches. Queueing
+ * fails with EAGAIN when depth frames wait for the peer, and with
+ * EMSGSIZE for a frame larger than the peer message size.
+ * Disabling sends the queued frames before it returns.
+ */
+int peer_outbound_enable(int depth);
+
+/*
+ * peer_flush_all - send all pending batches and queued frames now
+ *
+ * Also waits for the peer the outbound thread is sending, so no
+ * frame queued before the call is left when it returns.
+ */
+void peer_flush_all(void);
+
+/*
+ * peer_invalidate - force the peer to be reopened on next send
+ * @name: app name
+ */
+void peer_invalidate(const char *name);
+
+/*
+ * peer_table_clear - close all cached peers
+ */
+void peer_table_clear(void);
+
+#endif //__PEER_H__
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifdef __cplusplus
+export "C" {
+#endif
+
+#ifndef __REGISTRY_H__
+#define __REGISTRY_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define REGISTRY_SHM_NAME "/ipc-registry"
+#define REGISTRY_MAGIC 0x47455249 /* "IREG" */
+#define REGISTRY_SLOTS 1024
+#define REGISTRY_NAME_SIZE 64
+
+/*
+ * entry states, a FREE entry ends a lookup, a DEAD one keeps the
+ * probe chain of others and is reused by a later registration
+ */
+#define REGISTRY_FREE 0
+#define REGISTRY_INIT 1
+#define REGISTRY_USED 2
+#define REGISTRY_DEAD 3
+
+/* transports */
+#define REGISTRY_MQUEUE 0
+#define REGISTRY_RING 1
+
+/*
+ * registry_entry - one endpoint in the shared table
+ *
+ * The table is open addressed by the hash of name with linear
+ * probing. gen is odd while the entry is written and moves on every
+ * registration and unregistration, so readers copy an entry without
+ * a lock and a cached gen tells if the endpoint is still the same.
+ */
+struct registry_entry {
+	uint32_t state;
+	uint32_t gen;
+	uint32_t hash;
+	int32_t pid;
+	uint32_t transport;
+	uint32_t caps;
+	/* sends which found the endpoint queue full, counted by senders */
+	uint64_t full;
+	char name[REGISTRY_NAME_SIZE];
+} __attribute__((aligned(64)));
+
+struct registry_header {
+	uint32_t magic;
+	uint32_t slots;
+} __attribute__((aligned(64)));
+
+/*
+ * registry - process local handle of the mapped table
+ */
+struct registry {
+	struct registry_header *hdr;
+	struct registry_entry *entries;
+	size_t size;
+};
+
+/*
+ * registry_open - map the registry, create it if missing
+ *
+ * Shared by all endpoints, it's never removed.
+ */
+struct registry *registry_open(void);
+
+/*
+ * registry_close - unmap the registry and free handle
+ */
+void registry_close(struct registry *reg);
+
+/*
+ * registry_register - add an endpoint
+ * @reg: registry handle
+ * @name: app name, leading '/' is ignored
+ * @transport: REGISTRY_MQUEUE or REGISTRY_RING
+ * @caps: capability bits of the endpoint
+ *
+ * An entry of the same name, left by an earlier instance of the app,
+ * is taken over, so the endpoint keeps its id across restarts.
+ * Returns endpoint id, which is never 0, or -1 with errno ENOSPC
+ * if the table is full.
+ */
+int registry_register(struct registry *reg, const char *name,
+			uint32_t transport, uint32_t caps);
+
+/*
+ * registry_unregister - mark an endpoint gone
+ * @reg: registry handle
+ * @id: id returned by registry_register
+ */
+void registry_unregister(struct registry *reg, uint32_t id);
+
+/*
+ * registry_set_caps - add capability bits to a registered endpoint
+ */
+void registry_set_caps(struct registry *reg, uint32_t id, uint32_t caps);
+
+/*
+ * registry_note_full - count a send which found the endpoint queue full
+ */
+static inline void registry_note_full(struct registry *reg, uint32_t id)
+{
+	__atomic_add_fetch(&reg->entries[id - 1].full, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * registry_lookup - find an endpoint by name
+ * @reg: registry handle
+ * @name: app name, leading '/' is ignored
+ * @entry: filled with a copy of the entry
+ *
+ * Lock free and without syscall. Returns endpoint id, or -1 with
+ * errno ENOENT if the name was never registered, ESRCH if the
+ * endpoint has unregistered.
+ */
+int registry_lookup(struct registry *reg, const char *name,
+			struct registry_entry *entry);
+
+/*
+ * registry_get - get an endpoint by id
+ * @reg: registry handle
+ * @id: endpoint id, such as the source of a received frame
+ * @entry: filled with a copy of the entry
+ *
+ * Returns 0, or -1 with errno ESRCH if no endpoint has this id.
+ */
+int registry_get(struct registry *reg, uint32_t id, struct registry_entry *entry);
+
+/*
+ * registry_alive - check if an endpoint is still the one looked up
+ * @reg: registry handle
+ * @id: endpoint id
+ * @gen: gen of the entry got by registry_lookup or registry_get
+ *
+ * False once the endpoint unregistered or was registered again by
+ * a new instance. Two loads, cheap enough to call on every send.
+ */
+static inline int registry_alive(struct registry *reg, uint32_t id, uint32_t gen)
+{
+	struct registry_entry *entry = &reg->entries[id - 1];
+
+	return __atomic_load_n(&entry->gen, __ATOMIC_ACQUIRE) == gen &&
+		__atomic_load_n(&entry->state, __ATOMIC_RELAXED) == REGISTRY_USED;
+}
+
+/*
+ * registry_prune - unregister endpoints whose process has exited
+ *
+ * Apps killed before ipc_deinit leave their entries behind.
+ * Returns the number of entries freed.
+ */
+int registry_prune(struct registry *reg);
+
+#endif //__REGISTRY_H__
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifdef __cplusplus
+export "C" {
+#endif
+
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <mqueue.h>
+
+#define RING_NAME_SIZE 80
+#define RING_MAGIC 0x474e4952 /* "RING" */
+#define RING_DEFAULT_SLOTS 256
+
+/*
+ * ring_slot - one message slot in the shared memory ring
+ *
+ * seq is the slot sequence number used by the lock-free
+ * producers and the consumer to hand the slot over.
+ */
+struct ring_slot {
+	uint32_t seq;
+	uint32_t len;
+	char data[];
+};
+
+/*
+ * ring_header - control block at the start of the shared memory
+ *
+ * Producer and consumer indexes are placed on their own cache
+ * lines so that senders do not bounce the consumer's line.
+ */
+struct ring_header {
+	uint32_t magic;
+	uint32_t slots;
+	uint32_t slot_size;
+	uint32_t stride;
+	int32_t owner;
+	uint32_t closed;
+	/* consumer waits on the doorbell queue instead of the futex */
+	uint32_t doorbell;
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t tail __attribute__((aligned(64)));
+	uint32_t sleeping;
+	uint32_t wake_seq;
+} __attribute__((aligned(64)));
+
+/*
+ * ring - process local handle of a mapped ring
+ */
+struct ring {
+	char name[RING_NAME_SIZE];
+	struct ring_header *hdr;
+	char *slots;
+	size_t size;
+	ino_t ino;
+	int owner;
+	/* doorbell queue, opened on first ring by producers */
+	mqd_t bell;
+};
+
+/*
+ * ring_create - create the ring in /dev/shm and map it
+ * @name: shm object name, start with '/'
+ * @slots: slot count, rounded up to power of two
+ * @slot_size: max bytes of one message
+ *
+ * The caller becomes the single consumer of the ring. Stale
+ * object with the same name will be removed first.
+ */
+struct ring *ring_create(const char *name, uint32_t slots, uint32_t slot_size);
+
+/*
+ * ring_open - map an existing ring as a producer
+ * @name: shm object name, start with '/'
+ */
+struct ring *ring_open(const char *name);
+
+/*
+ * ring_push - put a message into the ring
+ * @r: ring handle
+ * @buf: message data
+ * @len: message length
+ *
+ * Lock-free, can be called from many threads and processes.
+ * The consumer is only woken up if it is sleeping.
+ *
+ * Returns 0 on success, -1 with errno EAGAIN when ring is full,
+ * EMSGSIZE when message is too large, EPIPE when ring is closed.
+ */
+int ring_push(struct ring *r, const void *buf, uint32_t len);
+
+/*
+ * ring_count - messages in the ring, slots being written included
+ */
+static inline uint32_t ring_count(struct ring *r)
+{
+	return __atomic_load_n(&r->hdr->head, __ATOMIC_RELAXED) -
+		__atomic_load_n(&r->hdr->tail, __ATOMIC_RELAXED);
+}
+
+/*
+ * ring_pop - get a message from the ring
+ * @r: ring handle
+ * @buf: buffer to store message
+ * @maxlen: buffer size
+ * @timeout_ms: wait time if ring is empty, < 0 means forever
+ *
+ * Must be called by the ring owner only.
+ * Returns message length, -1 with errno ETIMEDOUT on timeout,
+ * or EAGAIN if ring is empty and timeout_ms is 0.
+ */
+int ring_pop(struct ring *r, void *buf, uint32_t maxlen, int timeout_ms);
+
+/*
+ * ring_doorbell - let the consumer wait in poll or epoll
+ * @r: ring handle of the owner
+ *
+ * Creates a one message POSIX queue next to the ring. Producers
+ * send a byte to it instead of a futex wakeup when the consumer is
+ * armed by ring_doorbell_arm(). Returns the queue descriptor, which
+ * becomes readable when the doorbell rings, or -1 on error.
+ */
+mqd_t ring_doorbell(struct ring *r);
+
+/*
+ * ring_doorbell_arm - prepare to wait on the doorbell
+ * @r: ring handle of the owner
+ *
+ * Clears a pending ring and asks producers to ring. Returns 0 if
+ * the consumer may wait, -1 with errno EAGAIN if messages are
+ * already in the ring.
+ */
+int ring_doorbell_arm(struct ring *r);
+
+/*
+ * ring_doorbell_disarm - stop producers ringing after the wait
+ */
+void ring_doorbell_disarm(struct ring *r);
+
+/*
+ * ring_close - unmap the ring and free handle
+ */
+void ring_close(struct ring *r);
+
+/*
+ * ring_destroy - mark ring closed, remove it from /dev/shm and free handle
+ *
+ * Used by the owner when endpoint is going away.
+ */
+void ring_destroy(struct ring *r);
+
+#endif //__RING_H__
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifdef __cplusplus
+export "C" {
+#endif
+
+#ifndef __SHMBUF_H__
+#define __SHMBUF_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "list_node.h"
+
+#define SHMBUF_MAGIC 0x46554253 /* "SBUF" */
+#define SHMBUF_NAME_SIZE 32
+
+/*
+ * shmbuf_slot - state of one buffer, shared by all processes
+ * @refcnt: buffer is free when it drops to 0
+ * @generation: changed on every allocation, so a stale
+ *              descriptor can be detected
+ */
+struct shmbuf_slot {
+	uint32_t refcnt;
+	uint32_t generation;
+};
+
+/*
+ * shmbuf_header - control block at the start of the pool
+ */
+struct shmbuf_header {
+	uint32_t magic;
+	uint32_t count;
+	uint32_t size;
+	uint32_t data_offset;
+	int32_t owner;
+	uint32_t closed;
+	uint32_t next_generation;
+	uint32_t hint;
+	struct shmbuf_slot slot[];
+};
+
+/*
+ * shmbuf_desc - descriptor which travels through the queue
+ *
+ * The payload itself stays in the sender's pool.
+ */
+struct shmbuf_desc {
+	uint32_t pool;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t generation;
+};
+
+/*
+ * shmbuf_pool - process local handle of a mapped pool
+ */
+struct shmbuf_pool {
+	struct list_node node;
+	uint32_t id;
+	struct shmbuf_header *hdr;
+	size_t size;
+	int owner;
+	int users;
+	int stale;
+};
+
+/*
+ * shmbuf_pool_create - create a buffer pool in /dev/shm
+ * @id: pool id, the owner endpoint id
+ * @count: buffer count
+ * @size: size of each buffer
+ *
+ * Returns NULL with errno EINVAL if count or size is 0, or the pool
+ * doesn't fit the 32 bits offsets of descriptors.
+ */
+struct shmbuf_pool *shmbuf_pool_create(uint32_t id, uint32_t count, uint32_t size);
+
+/*
+ * shmbuf_pool_destroy - mark pool closed and remove it
+ */
+void shmbuf_pool_destroy(struct shmbuf_pool *pool);
+
+/*
+ * shmbuf_alloc - allocate a buffer, returned with one reference
+ * @pool: owner pool
+ * @len: bytes needed
+ *
+ * Returns NULL with errno EMSGSIZE if len is larger than buffer
+ * size, ENOBUFS if all buffers are in use.
+ */
+void *shmbuf_alloc(struct shmbuf_pool *pool, uint32_t len);
+
+/*
+ * shmbuf_ref - take one more reference for a receiver
+ * @pool: owner pool
+ * @data: buffer returned by shmbuf_alloc
+ * @len: valid bytes in buffer
+ * @desc: store descriptor to send
+ */
+int shmbuf_ref(struct shmbuf_pool *pool, void *data, uint32_t len,
+				struct shmbuf_desc *desc);
+
+/*
+ * shmbuf_free - drop the reference got by shmbuf_alloc or shmbuf_ref
+ */
+void shmbuf_free(struct shmbuf_pool *pool, void *data);
+
+/*
+ * shmbuf_map - get the data of a received descriptor
+ * @desc: received descriptor
+ * @pool: store the mapped pool to release later
+ *
+ * Pools of other processes are mapped on first use and cached.
+ * Returns NULL if the descriptor is stale.
+ */
+void *shmbuf_map(const struct shmbuf_desc *desc, struct shmbuf_pool **pool);
+
+/*
+ * shmbuf_release - release a received buffer back to its pool
+ */
+void shmbuf_release(struct shmbuf_pool *pool, const struct shmbuf_desc *desc);
+
+/*
+ * shmbuf_drop - drop the reference of a descriptor which won't be mapped
+ * @desc: descriptor of a frame which is dropped
+ *
+ * Nothing is done if the descriptor is stale.
+ */
+void shmbuf_drop(const struct shmbuf_desc *desc);
+
+/*
+ * shmbuf_cache_clear - unmap all cached pools of other processes
+ */
+void shmbuf_cache_clear(void);
+
+#endif //__SHMBUF_H__
+
+#ifdef __cplusplus
+}
+#endif
@@ -47,6 +47,18 @@ typedef void (*sigfunc)(int signo);
  * */
 void set_signal_thread(sigfunc func);
 
+/*
+ * set_signal_fd - get a signalfd for the signals of set_signal_thread
+ *
+ * The signals are blocked in the calling thread, read them from the
+ * returned fd in an event loop instead of a sigwait thread.
+ *
+ * NOTE:
+ * Like set_signal_thread, this function must be called before any
+ * new thread is created.
+ * */
+int set_signal_fd(void);
+
 /*
  * set_signal - set process signal handler by sigaction
  * @func: signal handler set by caller.
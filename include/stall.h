@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifdef __cplusplus
+export "C" {
+#endif
+
+#ifndef __STALL_H__
+#define __STALL_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include "list_node.h"
+
+/* signal sent to a stalled thread to log its stack */
+#define STALL_DUMP_SIGNAL (SIGRTMAX - 2)
+#define STALL_DUMP_FRAMES 32
+
+/*
+ * stall_slot - what a handler thread is doing, read by the monitor
+ *
+ * The thread publishes the start time of its handler in since, 0
+ * means idle. Publishing is two plain stores and a vDSO clock read,
+ * no syscall and no lock.
+ */
+struct stall_slot {
+	struct list_node node;
+	const char *name;
+	pid_t tid;
+	/* caller defined tag of running handler, e.g. message type */
+	uint32_t tag;
+	/* CLOCK_MONOTONIC_COARSE ns the handler started, 0 if idle */
+	uint64_t since;
+	/* since of the stall reported last, each stall is logged once */
+	uint64_t reported;
+};
+
+static inline uint64_t stall_now_ns(void)
+{
+	struct timespec ts;
+
+	/* ms resolution is plenty for budgets, and cheaper */
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * stall_enter - mark the start of a handler
+ * @slot: slot of the calling thread
+ * @tag: logged if the handler stalls
+ */
+static inline void stall_enter(struct stall_slot *slot, uint32_t tag)
+{
+	__atomic_store_n(&slot->tag, tag, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->since, stall_now_ns(), __ATOMIC_RELEASE);
+}
+
+/*
+ * stall_leave - mark the calling thread idle
+ */
+static inline void stall_leave(struct stall_slot *slot)
+{
+	__atomic_store_n(&slot->since, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * stall_register - add the calling thread to the monitored slots
+ * @slot: slot owned by the thread
+ * @name: name in logs, must live until stall_unregister
+ *
+ * Must be called from the monitored thread itself, it unblocks
+ * STALL_DUMP_SIGNAL there so the monitor can log its stack.
+ *
+ * NOTE:
+ * The stack is logged by a signal handler in the stalled thread, a
+ * call which isn't restarted after signals, e.g. sleep or poll, may
+ * return EINTR in a handler over budget.
+ */
+void stall_register(struct stall_slot *slot, const char *name);
+
+/*
+ * stall_unregister - remove a slot before its thread exits
+ */
+void stall_unregister(struct stall_slot *slot);
+
+/*
+ * stall_monitor_start - start the monitor thread
+ * @budget_ms: handlers running longer are logged with tag and stack
+ * @abort_ms: handlers running longer raise SIGABRT, 0 never aborts
+ *
+ * One thread checks all registered slots, it may be started before
+ * or after the threads register. The first call installs a process
+ * wide handler for STALL_DUMP_SIGNAL, registering alone never does.
+ * Returns 0, or -1 on error.
+ */
+int stall_monitor_start(uint32_t budget_ms, uint32_t abort_ms);
+
+/*
+ * stall_monitor_stop - stop the monitor thread
+ */
+void stall_monitor_stop(void);
+
+#endif/*__STALL_H__*/
+
+#ifdef __cplusplus
+}
+#endif
@@ -33,6 +33,7 @@ export "C" {
 #include <signal.h>
 #include <time.h>
 #include <stdint.h>
+#include "timer_wheel.h"
 
 #define MAX_USEC_PER_SECOND 1000000
 
@@ -44,10 +45,14 @@ enum {
 
 typedef void (*timer_cb) (void *data);
 
+/*
+ * timer_wrapper - timer on the shared timer wheel
+ *
+ * Callbacks run one after another in the wheel thread, no thread
+ * is created per expiry.
+ */
 struct timer_wrapper {
-	timer_t timerid;
-	struct sigevent sev;
-	struct itimerspec its;
+	struct wheel_timer timer;
 	int created;
 };
 
@@ -57,6 +62,13 @@ struct timer_wrapper {
  *
  * */
 int timer_init(struct timer_wrapper *t, timer_cb func, void *data);
+/*
+ * timer_init_wheel - init a timer on the given timer wheel
+ *
+ * Callbacks run in the thread which processes the wheel.
+ * */
+int timer_init_wheel(struct timer_wrapper *t, struct timer_wheel *wheel,
+			timer_cb func, void *data);
 /*
  * timer_start - start a timer
  *
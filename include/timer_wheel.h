@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifdef __cplusplus
+export "C" {
+#endif
+
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include "list_node.h"
+#include "looper.h"
+
+/*
+ * Hierarchical timing wheel, TIMER_WHEEL_LEVELS levels of
+ * TIMER_WHEEL_SIZE slots. Level k slots are 64^k ticks wide, timers
+ * move down a level when the wheel reaches their slot. Start, stop
+ * and restart are O(1), and a single timerfd is armed for the next
+ * expiry or cascade only.
+ */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS 6
+
+/* default tick and slack of timer_wheel_default() */
+#define TIMER_WHEEL_TICK_US 1000
+#define TIMER_WHEEL_SLACK_US 0
+
+struct timer_wheel;
+
+/*
+ * wheel_timer - a timer on a timer_wheel
+ *
+ * Owned by the caller, must stay valid until stopped.
+ */
+struct wheel_timer {
+	struct list_node node;
+	struct timer_wheel *wheel;
+	/* expiry and period in ticks */
+	uint64_t expires;
+	uint64_t period;
+	int level;
+	int slot;
+	int pending;
+	msg_handler func;
+	void *data;
+	struct looper *looper;
+};
+
+struct timer_wheel {
+	pthread_mutex_t lock;
+	int fd;
+	uint64_t tick_ns;
+	uint64_t slack;
+	/* monotonic time of tick 0 */
+	uint64_t base_ns;
+	/* next tick to process */
+	uint64_t curr;
+	/* tick timerfd is armed for, UINT64_MAX if disarmed */
+	uint64_t armed;
+	int count;
+	/* bit i of mask[k] set if slots[k][i] is not empty */
+	uint64_t mask[TIMER_WHEEL_LEVELS];
+	struct list_node slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+	pthread_t tid;
+	int thread;
+	int exit;
+};
+
+/*
+ * timer_wheel_create - create a timer wheel
+ * @tick_us: wheel resolution
+ * @slack_us: how late an expiry may be to fire with later ones
+ *
+ * Call timer_wheel_start to run it in its own thread, or poll
+ * timer_wheel_fd and call timer_wheel_process from an event loop.
+ */
+struct timer_wheel *timer_wheel_create(uint64_t tick_us, uint64_t slack_us);
+
+/*
+ * timer_wheel_start - run timer wheel in a thread of its own
+ */
+int timer_wheel_start(struct timer_wheel *wheel);
+
+/*
+ * timer_wheel_fd - timerfd which is readable when timers are due
+ */
+int timer_wheel_fd(struct timer_wheel *wheel);
+
+/*
+ * timer_wheel_process - fire due timers and re-arm timerfd
+ *
+ * Only one thread may process a wheel.
+ */
+void timer_wheel_process(struct timer_wheel *wheel);
+
+/*
+ * timer_wheel_destroy - stop the wheel thread and free the wheel
+ *
+ * Timers still started are dropped.
+ */
+void timer_wheel_destroy(struct timer_wheel *wheel);
+
+/*
+ * timer_wheel_default - shared wheel with its own thread
+ *
+ * Created on first use with TIMER_WHEEL_TICK_US and TIMER_WHEEL_SLACK_US.
+ */
+struct timer_wheel *timer_wheel_default(void);
+
+/*
+ * wheel_timer_init - init a timer
+ * @t: timer
+ * @wheel: timer wheel to run on
+ * @func: callback
+ * @data: callback data
+ * @looper: callback is posted to this looper, NULL to call it in the
+ *	    thread processing the wheel
+ */
+void wheel_timer_init(struct wheel_timer *t, struct timer_wheel *wheel,
+			msg_handler func, void *data, struct looper *looper);
+
+/*
+ * wheel_timer_start - start or restart a timer
+ * @t: timer
+ * @usec: time to first expiry
+ * @period_us: period after first expiry, 0 for one shot
+ */
+int wheel_timer_start(struct wheel_timer *t, uint64_t usec, uint64_t period_us);
+
+/*
+ * wheel_timer_stop - stop a timer
+ *
+ * A callback which is already due may still run once.
+ */
+int wheel_timer_stop(struct wheel_timer *t);
+
+#endif //__TIMER_WHEEL_H__
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifdef __cplusplus
+export "C" {
+#endif
+
+#ifndef __TOPIC_H__
+#define __TOPIC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "list_node.h"
+
+#define TOPIC_NAME_SIZE 64
+#define TOPIC_MAGIC 0x43504f54 /* "TOPC" */
+#define TOPIC_SLOTS 256
+#define TOPIC_SUBS_MAX 32
+
+/* subscriber states */
+#define TOPIC_SUB_FREE 0
+#define TOPIC_SUB_INIT 1
+#define TOPIC_SUB_USED 2
+
+/*
+ * topic_slot - one published message
+ *
+ * seq is the publish sequence number plus one once the message is
+ * complete, 0 while it's written, so a zero filled ring is empty.
+ */
+struct topic_slot {
+	uint64_t seq;
+	uint32_t len;
+	uint32_t reserved;
+	char data[];
+};
+
+/*
+ * topic_sub - one subscriber in the shared table
+ *
+ * waiting is set by a subscriber which read everything, publishers
+ * clear it and notify the subscriber once. cursor and lost are only
+ * written by the subscriber, others read them to find slow ones.
+ */
+struct topic_sub {
+	uint32_t state;
+	int32_t pid;
+	uint32_t waiting;
+	uint32_t reserved;
+	uint64_t cursor;
+	uint64_t lost;
+	char name[TOPIC_NAME_SIZE];
+} __attribute__((aligned(64)));
+
+/*
+ * topic_header - control block at the start of the shared memory
+ *
+ * reserve counts messages ever published, on its own cache line.
+ */
+struct topic_header {
+	uint32_t magic;
+	uint32_t slots;
+	uint32_t slot_size;
+	uint32_t stride;
+	uint64_t reserve __attribute__((aligned(64)));
+	struct topic_sub subs[TOPIC_SUBS_MAX] __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+/*
+ * topic - process local handle of a mapped topic
+ */
+struct topic {
+	struct list_node node;
+	char name[TOPIC_NAME_SIZE];
+	struct topic_header *hdr;
+	char *slots;
+	size_t size;
+	/* subscriber index and read position, -1 if not subscribed */
+	int sub;
+	uint64_t cursor;
+};
+
+/*
+ * topic_open - map a topic, create it if missing
+ * @name: topic name
+ * @slot_size: max bytes of one message
+ *
+ * Publishers and subscribers may open a topic first, they must use
+ * the same slot_size. Topics stay in /dev/shm after the last user.
+ */
+struct topic *topic_open(const char *name, uint32_t slot_size);
+
+/*
+ * topic_close - unsubscribe, unmap the topic and free handle
+ */
+void topic_close(struct topic *t);
+
+/*
+ * topic_write_begin - reserve the slot of the next message
+ * @t: topic handle
+ * @seq: store sequence number for topic_write_end
+ *
+ * Returns the slot data to fill with up to slot_size bytes. Never
+ * blocks, the oldest message is overwritten even if subscribers
+ * didn't read it yet. Must be followed by topic_write_end.
+ */
+void *topic_write_begin(struct topic *t, uint64_t *seq);
+
+/*
+ * topic_write_end - publish a message filled after topic_write_begin
+ */
+void topic_write_end(struct topic *t, uint64_t seq, uint32_t len);
+
+/*
+ * topic_notify_fn - wake up a waiting subscriber
+ *
+ * Returns 0, or -1 if the subscriber could not be notified, it's
+ * tried again after the next message.
+ */
+typedef int (*topic_notify_fn)(const char *name, void *data);
+
+/*
+ * topic_notify - notify subscribers waiting for messages
+ *
+ * Only subscribers which read everything and armed are notified,
+ * busy subscribers find new messages without any notification.
+ * Slots of exited subscribers are freed.
+ */
+void topic_notify(struct topic *t, topic_notify_fn func, void *data);
+
+/*
+ * topic_subscribe - read messages published from now on
+ * @t: topic handle
+ * @name: name passed to topic_notify_fn
+ *
+ * Returns 0, -1 with errno ENOSPC if there are too many subscribers.
+ */
+int topic_subscribe(struct topic *t, const char *name);
+
+/*
+ * topic_unsubscribe - stop reading the topic
+ */
+void topic_unsubscribe(struct topic *t);
+
+/*
+ * topic_read - copy the next message of a subscribed topic
+ * @t: topic handle
+ * @buf: buffer of slot_size bytes
+ *
+ * Messages overwritten before they were read are skipped and added
+ * to the lost counter of the subscriber. Returns the message length,
+ * or -1 with errno EAGAIN if there is no new message.
+ */
+int topic_read(struct topic *t, void *buf);
+
+/*
+ * topic_arm - ask publishers to notify before waiting
+ *
+ * Returns 0 if the subscriber may wait, -1 with errno EAGAIN if a
+ * message came meanwhile and should be read first.
+ */
+int topic_arm(struct topic *t);
+
+/*
+ * topic_lost - messages the subscriber lost because it was too slow
+ */
+uint64_t topic_lost(struct topic *t);
+
+#endif //__TOPIC_H__
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifdef __cplusplus
+export "C" {
+#endif
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+/*
+ * uring - minimal io_uring instance driven by raw syscalls
+ *
+ * Only used by one thread. The submission queue array maps entry i
+ * to sqe i, so sqes are handed out in ring order.
+ */
+struct uring {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_local;	/* tail including sqes not published yet */
+	unsigned int sq_pending;	/* sqes published, not submitted yet */
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+	void *ring_ptr;
+	size_t ring_size;
+	size_t sqes_size;
+};
+
+/*
+ * uring_init - set up an io_uring instance
+ * @ring: instance to init
+ * @entries: submission queue size
+ *
+ * Returns 0, or -1 with errno set if the kernel lacks io_uring or
+ * the features needed here (single mmap and no dropped completions).
+ */
+int uring_init(struct uring *ring, unsigned int entries);
+
+/*
+ * uring_exit - tear down an io_uring instance
+ */
+void uring_exit(struct uring *ring);
+
+/*
+ * uring_poll - queue a poll of a fd
+ * @ring: io_uring instance
+ * @fd: fd to poll
+ * @events: poll events
+ * @multishot: post a completion every time fd becomes ready, until
+ *	       one comes without IORING_CQE_F_MORE
+ * @data: user_data of the completions
+ *
+ * Returns -1 with errno EBUSY if the submission queue is full.
+ */
+int uring_poll(struct uring *ring, int fd, unsigned int events, int multishot,
+				uint64_t data);
+
+/*
+ * uring_timeout - queue a timeout on CLOCK_MONOTONIC
+ * @ring: io_uring instance
+ * @ts: expiry time, read when the sqe is submitted
+ * @abs: non-zero if ts is absolute time
+ * @data: user_data of the completion, which has res -ETIME
+ */
+int uring_timeout(struct uring *ring, struct __kernel_timespec *ts, int abs,
+				uint64_t data);
+
+/*
+ * uring_enter - submit queued sqes and wait for completions
+ * @ring: io_uring instance
+ * @wait_nr: completions to wait for, 0 to not block
+ *
+ * No syscall is made if there is nothing to submit or wait for,
+ * completions are reaped from shared memory by uring_peek_cqe.
+ * Returns 0, or -1 with errno set (EINTR if a signal arrived).
+ */
+int uring_enter(struct uring *ring, unsigned int wait_nr);
+
+/*
+ * uring_peek_cqe - get the next completion, NULL if none
+ */
+static inline struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+/*
+ * uring_cqe_seen - give the completion got by uring_peek_cqe back
+ */
+static inline void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif //__URING_H__
+
+#ifdef __cplusplus
+}
+#endif
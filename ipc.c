@@ -36,121 +36,441 @@
 #include <mqueue.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <stddef.h>
+#include <poll.h>
 #include "debug.h"
 #include "looper.h"
 #include "ipc.h"
 #include "watchdog.h"
 #include "timer.h"
+#include "ring.h"
+#include "peer.h"
+#include "shmbuf.h"
+#include "timer_wheel.h"
+#include "siglib.h"
+#include "uring.h"
+#include "heartbeat.h"
+#include "registry.h"
+#include "msgpool.h"
+#include "topic.h"
+#include "hist.h"
+
+#define IPC_CALL_HASH_SIZE 64
+#define IPC_CALL_TIMEOUT_SEC 3
+
+#define IPC_RECV_TIMEOUT_MS 500
+/* max frames received and handed to looper in one round */
+#define IPC_RECV_BATCH_MAX 32
+/* received packets a thread caches, and kept free in the pool */
+#define IPC_PACKET_CACHE (IPC_RECV_BATCH_MAX * 2)
+#define IPC_PACKET_FREE_MAX 1024
+#define IPC_PACKET_MAGIC 0x49504b54
+/* topics are not read while the looper has so many packets queued */
+#define IPC_TOPIC_BACKLOG TOPIC_SLOTS
+#define IPC_EPOLL_EVENTS 8
+/* default depth of a POSIX queue endpoint, and limits of ipc_queue_attr */
+#define IPC_QUEUE_MAXMSG 10
+#define IPC_QUEUE_MAXMSG_MAX 65536
+#define IPC_QUEUE_MSGSIZE_MIN 512
+#define IPC_MQUEUE_PROC "/proc/sys/fs/mqueue/"
+
+/* epoll_event data of the main loop fds */
+enum {
+	IPC_EV_QUEUE,
+	IPC_EV_WAKEUP,
+	IPC_EV_TIMER,
+	IPC_EV_SIGNAL,
+	IPC_EV_COUNT,
+	/* io_uring timeout, user_data also carries its sequence */
+	IPC_EV_TIMEOUT = IPC_EV_COUNT,
+};
+#define IPC_EV_TAG_BITS 8
+#define IPC_URING_ENTRIES 16
+
+/*
+ * ipc_call - a request which is waiting for its reply
+ *
+ * Every sync caller has its own call on the stack, replies are
+ * routed to it by the request sequence number. Async calls are
+ * malloced and also linked in the timeout list by deadline.
+ */
+struct ipc_call {
+	struct list_node node;
+	struct list_node tnode;
+	uint32_t seq;
+	int type;
+	int done;
+	int status;
+	pthread_cond_t cond;
+	struct ipc_reply reply;
+	ipc_reply_cb callback;
+	void *ctx;
+	uint64_t deadline;
+};
+
+/*
+ * ipc_handler_entry - registered handler of one message type
+ */
+struct ipc_handler_entry {
+	ipc_handler_cb handler;
+	int flags;
+};
 
-struct ipc_lib {
+struct ipc_ctx {
 	char name[MSG_QUEUE_NAME_SIZE];
 	char buf[MSG_QUEUE_MAX_SIZE];
+	/* packet the next frame is received into, see ipc_rx_buf */
+	struct ipc_packet *rx;
+	uint32_t id;
+	/* service registry, reg_id is the registry id or 0 if not registered */
+	struct registry *registry;
+	uint32_t reg_id;
+	int flags;
+	/* depth and message size of the queue or ring */
+	int maxmsg;
+	int msgsize;
 	mqd_t mqd;
+	struct ring *ring;
+	struct shmbuf_pool *pool;
 	pthread_t tid;
+	/* lock protects pending calls */
 	pthread_mutex_t lock;
-    pthread_cond_t condition;
+	struct list_node calls[IPC_CALL_HASH_SIZE];
+	struct list_node timeouts;
+	uint64_t wait_deadline;
 	struct looper *looper;
+	/* handler of ipc_init, gets types without a registered handler */
+	msg_handler handler;
+	/* registered handlers, indexed by type below MSG_TYPE_REPLY_BASE */
+	struct ipc_handler_entry *handlers;
+	/* topics published or subscribed, topic_lock is recursive */
+	pthread_mutex_t topic_lock;
+	struct list_node topics;
+	/* subscribed topics may have messages, see ipc_topic_poll */
+	int topic_pending;
+	/* topics not read until the looper backlog goes down */
+	int topic_throttled;
+	/* packets handed to looper and not freed yet */
+	uint32_t inflight;
+	/* packets waiting to be handed to looper together */
+	void *batch[IPC_RECV_BATCH_MAX];
+	int batch_count;
+	struct ipc_stats stats;
+	/* epoll main loop, fds are -1 without IPC_INIT_EPOLL */
+	int epfd;
+	int evfd;
+	int qfd;
+	struct timer_wheel *wheel;
+	/* io_uring main loop, NULL without IPC_INIT_URING or support */
+	struct uring *uring;
+	struct __kernel_timespec uring_ts;
+	uint64_t uring_deadline;
+	uint64_t uring_timeout_seq;
 	struct timer_wrapper timer;
-	struct ipc_reply reply;
 	struct watchdog_timer wdt;
 	int wdt_timeout;
+	/* heartbeat table and slot, NULL without IPC_WATCHDOG_HEARTBEAT */
+	struct heartbeat *heartbeat;
+	int heartbeat_slot;
+	/* default context of ipc_init, owns signals and watchdog */
+	int primary;
 	int exit;
-	uint32_t send_sync_count;
-	uint32_t send_async_count;
-	uint32_t recv_reply_count;
-	uint32_t recv_request_count;
+	/*
+	 * IPC_HOP_COUNT latency histograms per message type, allocated
+	 * when the type is first measured
+	 */
+	struct hist **latency;
+};
+
+/*
+ * ipc_packet - received request handed to the looper
+ *
+ * msg must be the first member, applications get a point to it
+ * in msg_handler and ipc_msg_payload() finds the packet back.
+ * Packets come from ipc_packet_pool and frames are received into
+ * data directly, the payload stays there and the looper links the
+ * embedded entity, so a message needs no heap call and no copy
+ * except the first MSG_CONTENT_SIZE bytes into msg.content.
+ */
+struct ipc_packet {
+	struct ipc_msg msg;
+	/* IPC_PACKET_MAGIC while the packet is being handled */
+	uint32_t magic;
+	struct ipc_hdr hdr;
+	/* context which received the message */
+	struct ipc_ctx *ipc;
+	struct msg_entity entity;
+	char *payload;
+	int length;
+	struct shmbuf_pool *pool;
+	struct shmbuf_desc desc;
+	/* CLOCK_MONOTONIC ns of send, dequeue and looper enqueue, 0 if unknown */
+	uint64_t sent_ns;
+	uint64_t recv_ns;
+	uint64_t post_ns;
+	char data[MSG_QUEUE_MAX_SIZE];
 };
 
-static struct ipc_lib *ipclib;
+/* default context, made by ipc_init */
+static struct ipc_ctx *ipclib;
+/*
+ * contexts alive and the process wide state they share, set up by
+ * the first context and torn down with the last one
+ */
+static pthread_mutex_t ipc_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+static int ipc_ctx_count;
+static struct registry *ipc_registry;
+/* queue attributes of endpoints created next, 0 for defaults */
+static int ipc_queue_maxmsg;
+static int ipc_queue_msgsize;
+static struct msgpool ipc_packet_pool;
+static pthread_once_t ipc_packet_once = PTHREAD_ONCE_INIT;
+static uint32_t ipc_seq;
+/* signalfd and handler set by ipc_signal_init */
+static int ipc_sigfd = -1;
+static sigfunc ipc_sigfunc;
+/* stamp sent messages and measure received ones, see ipc_latency_enable */
+static int ipc_latency_on;
+
+/*
+ * ipc_count - bump a counter of the context stats, ctx may be NULL
+ */
+#define ipc_count(ctx, counter) do { \
+	if (ctx) \
+		__atomic_add_fetch(&(ctx)->stats.counter, 1, __ATOMIC_RELAXED); \
+} while (0)
 
-mqd_t mq_rw_create(char *name, int maxsize)
+static uint64_t ipc_now_ns(void)
 {
-	mqd_t mq;
-	struct mq_attr attr;
+	struct timespec ts;
 
-	attr.mq_flags = 0;       /* BLOCK */
-	attr.mq_maxmsg = 10;    /* msg count */
-	attr.mq_msgsize = maxsize;  /* msg queue size in bytes */
-	attr.mq_curmsgs = 0; /* current msg count in queue */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * ipc_frame_size - frame length told by its header
+ */
+static inline int ipc_frame_size(const struct ipc_hdr *hdr)
+{
+	return sizeof(*hdr) + hdr->srclen + hdr->len +
+		((hdr->flags & IPC_HDR_STAMP) ? IPC_STAMP_SIZE : 0);
+}
 
-	mq = mq_open(name, O_CREAT | O_RDWR, 0644, &attr);
-	if (mq == (mqd_t) -1) {
-		pr_err("mq_open failed, %s\n", strerror(errno));
+/*
+ * ipc_latency_record - count the latency of a hop
+ * @ipc: context which received the message
+ * @type: message type, below MSG_TYPE_REPLY_BASE
+ * @hop: IPC_HOP_*
+ * @start: CLOCK_MONOTONIC ns the hop started
+ * @end: CLOCK_MONOTONIC ns the hop ended
+ *
+ * Histograms of a type are allocated when it is first measured.
+ */
+static void ipc_latency_record(struct ipc_ctx *ipc, int type, int hop,
+				uint64_t start, uint64_t end)
+{
+	struct hist *hists, *old = NULL;
+
+	hists = __atomic_load_n(&ipc->latency[type], __ATOMIC_ACQUIRE);
+	if (!hists) {
+		hists = (struct hist *)calloc(IPC_HOP_COUNT, sizeof(struct hist));
+		if (!hists)
+			return;
+		if (!__atomic_compare_exchange_n(&ipc->latency[type], &old, hists, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			free(hists);
+			hists = old;
+		}
 	}
-	pr_info("msg queue mqd:%d\n", mq);
-	return mq;
+	/* the clock is system wide, stamps of two cpus may still cross a bit */
+	hist_record(&hists[hop], end > start ? end - start : 0);
+}
+
+/*
+ * ipc_latency_handled - record the hops of a message after its handler
+ * @packet: measured message
+ * @start: CLOCK_MONOTONIC ns the handler started
+ * @queued: the message went through the looper queue
+ */
+static void ipc_latency_handled(struct ipc_packet *packet, uint64_t start, int queued)
+{
+	struct ipc_ctx *ipc = packet->ipc;
+	int type = packet->hdr.type;
+	uint64_t end = ipc_now_ns();
+
+	if (queued && packet->post_ns)
+		ipc_latency_record(ipc, type, IPC_HOP_QUEUE, packet->post_ns, start);
+	ipc_latency_record(ipc, type, IPC_HOP_HANDLER, start, end);
+	if (packet->sent_ns)
+		ipc_latency_record(ipc, type, IPC_HOP_TOTAL, packet->sent_ns, end);
 }
 
-mqd_t mq_rd_open(char *name)
+/*
+ * ipc_send_frame - send a frame to the named app
+ * @name: app name, may start with '/'
+ * @buf: frame data
+ * @length: frame length
+ */
+static int ipc_send_frame(char *name, void *buf, int length)
 {
-	mqd_t mq;
+	struct ipc_peer *peer;
+	int ret;
 
-	mq = mq_open(name, O_RDONLY);
-	if (mq == (mqd_t) -1) {
-		pr_err("mq_open failed, %s\n", strerror(errno));
+	peer = peer_get(name);
+	if (!peer) {
+		pr_err("peer %s not found\n", name);
+		return -1;
 	}
-	return mq;
+	ret = peer_send(peer, buf, length);
+	peer_put(peer);
+	return ret;
 }
 
-int mq_recv_msg(mqd_t mq, char *buf, int maxsize)
+/*
+ * ipc_send_frame_async - send a async frame to the named app
+ * @flags: IPC_SEND_* flags
+ *
+ * Same as ipc_send_frame, but the frame may be batched or queued for
+ * the outbound thread, or fail with EAGAIN on a full queue with
+ * IPC_SEND_NONBLOCK.
+ */
+static int ipc_send_frame_async(char *name, void *buf, int length, int flags)
 {
-	int bytes_read;
+	struct ipc_peer *peer;
+	int ret;
 
-again:
-	bytes_read = mq_receive(mq, buf, maxsize, NULL);
-    if (bytes_read < 0) {
-		if (errno == EINTR)
-			goto again;
-		else {
-			pr_err("mq_receive failed, %s\n", strerror(errno));
-			return -1;
-		}
+	peer = peer_get(name);
+	if (!peer) {
+		pr_err("peer %s not found\n", name);
+		return -1;
 	}
-	return bytes_read;
+	if (flags & IPC_SEND_NONBLOCK)
+		ret = peer_try_send(peer, buf, length);
+	else
+		ret = peer_send_async(peer, buf, length);
+	peer_put(peer);
+	return ret;
 }
 
-
-int mq_send_msg(mqd_t mq, char *buf, int length)
+/*
+ * ipc_build_frame - fill a frame with header and payload
+ * @ipc: ipclib structure point, may be NULL before ipc_init
+ * @frame: buffer of MSG_QUEUE_MAX_SIZE bytes
+ * @type: message type
+ * @source: source app name to carry for reply, or NULL
+ * @ptr: payload
+ * @len: payload length
+ *
+ * A registered app is named by its endpoint id in hdr->source, the
+ * receiver resolves it in the registry, so the name isn't sent.
+ * With latency on, application types get the send time appended if
+ * it fits, frame must have IPC_STAMP_SIZE bytes room for it. The peer
+ * layer drops it again if the frame exceeds the destination queue.
+ *
+ * Returns frame length, -1 with errno EMSGSIZE if payload is too large.
+ */
+static int ipc_build_frame(struct ipc_ctx *ipc, char *frame, int type,
+							const char *source, const void *ptr, int len)
 {
-	int bytes_read;
-
-again:
-	bytes_read = mq_send(mq, buf, length, 0);
-	if (bytes_read < 0) {
-		if (errno == EINTR)
-			goto again;
-		else {
-			pr_err("mq_send failed, %s\n", strerror(errno));
-			return -1;
+	struct ipc_hdr *hdr = (struct ipc_hdr *)frame;
+	int flags = 0;
+	int srclen = 0;
+	uint64_t now;
+	int size;
+
+	if (source) {
+		if (source[0] == '/')
+			source++;
+		if (ipc && ipc->reg_id && !strcmp(source, ipc->name + 1)) {
+			flags = IPC_HDR_SOURCE_ID;
+		} else {
+			flags = IPC_HDR_SOURCE;
+			srclen = strlen(source);
 		}
 	}
-	return bytes_read;
+	if (type < 0 || type > UINT16_MAX || len < 0 || srclen > UINT8_MAX ||
+			len > IPC_MAX_PAYLOAD - srclen) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	hdr->type = type;
+	hdr->flags = flags;
+	hdr->seq = __atomic_add_fetch(&ipc_seq, 1, __ATOMIC_RELAXED);
+	hdr->source = ipc ? ipc->id : 0;
+	hdr->len = len;
+	hdr->srclen = srclen;
+	hdr->reserved = 0;
+	memcpy(frame + sizeof(*hdr), source, srclen);
+	if (len)
+		memcpy(frame + sizeof(*hdr) + srclen, ptr, len);
+	size = sizeof(*hdr) + srclen + len;
+	if (__atomic_load_n(&ipc_latency_on, __ATOMIC_RELAXED) &&
+			type < MSG_TYPE_WATCHDOG && size <= MSG_QUEUE_MAX_SIZE - IPC_STAMP_SIZE) {
+		now = ipc_now_ns();
+		memcpy(frame + size, &now, IPC_STAMP_SIZE);
+		hdr->flags |= IPC_HDR_STAMP;
+		size += IPC_STAMP_SIZE;
+	}
+	return size;
 }
 
-int mq_send_msg_timeout(mqd_t mqd, void *buf, int length)
+/*
+ * ipc_content_len - used length of a content buffer
+ *
+ * Trailing zero bytes are not sent, receiver zero fills them again.
+ */
+static int ipc_content_len(const char *content, int size)
 {
-	int bytes_read;
-	int count = 0;
-	struct timespec expire_time;
+	while (size > 0 && content[size - 1] == 0)
+		size--;
+	return size;
+}
 
-	do {
-		clock_gettime(CLOCK_REALTIME, &expire_time);
-		expire_time.tv_nsec += 300000000; //300ms
-		expire_time.tv_sec += expire_time.tv_nsec / 1000000000;
-		expire_time.tv_nsec = expire_time.tv_nsec % 1000000000;
-		bytes_read = mq_timedsend(mqd, (void *)buf, length, 0, &expire_time);
-		if (bytes_read < 0) {
-			if (errno == EINTR || errno == ETIMEDOUT)
-				continue;
-			else {
-				pr_err("mq_timedsend failed, %s\n", strerror(errno));
-				return -1;
-			}
-		} else if (bytes_read == 0) /* success return 0 */
-			break;
-	} while (count++ < 10);
+/*
+ * ipc_build_msg_frame - build frame of a compatible ipc_msg
+ */
+static int ipc_build_msg_frame(struct ipc_ctx *ipc, char *frame, struct ipc_msg *msg)
+{
+	return ipc_build_frame(ipc, frame, msg->type,
+			msg->source[0] ? msg->source : NULL, msg->content,
+			ipc_content_len(msg->content, MSG_CONTENT_SIZE));
+}
 
-	return bytes_read;
+/*
+ * ipc_send_self - send a frame to the endpoint's own transport
+ * @ipc: ipclib structure point
+ */
+static int ipc_send_self(struct ipc_ctx *ipc, void *buf, int length)
+{
+	struct ipc_hdr *hdr = (struct ipc_hdr *)buf;
+
+	if (ipc->ring)
+		return ring_send_msg_timeout(ipc->ring, buf, length);
+	return mq_send_msg_timeout(ipc->mqd, buf, length,
+			IPC_HDR_GET_PRIO(hdr->flags));
+}
+
+/*
+ * ipc_wakeup - interrupt the receive wait of the main loop
+ * @ipc: ipclib structure point
+ */
+static void ipc_wakeup(struct ipc_ctx *ipc)
+{
+	char frame[sizeof(struct ipc_hdr)];
+
+	if (ipc->evfd >= 0) {
+		if (eventfd_write(ipc->evfd, 1) < 0)
+			pr_err("eventfd write fail, %s\n", strerror(errno));
+		return;
+	}
+	ipc_build_frame(ipc, frame, MSG_TYPE_WAKEUP, NULL, NULL, 0);
+	ipc_send_self(ipc, frame, sizeof(frame));
 }
 
 /****************************************************************/
@@ -160,28 +480,46 @@ int mq_send_msg_timeout(mqd_t mqd, void *buf, int length)
  *
  * Send a MSG_WATCHDOG message to APP MSG QUEUE
  * */
+static void ipc_dispatcher(struct ipc_ctx *ipc, char *frame, int length);
+static void ipc_free_msg_cb(void *data);
+static void ipc_packet_free(struct ipc_packet *packet);
+static void ipc_batch_flush(struct ipc_ctx *ipc);
+
 static void timer_callback(void *data)
 {
-	struct ipc_lib *ipc = (struct ipc_lib *)data;
-	struct ipc_msg msg = {0};
+	struct ipc_ctx *ipc = (struct ipc_ctx *)data;
+	char frame[sizeof(struct ipc_hdr)];
 	struct timespec expire_time;
 
 	clock_gettime(CLOCK_REALTIME, &expire_time);
 	pr_debug("tv_sec:%ld, tv_nsec:%ld\n", expire_time.tv_sec, expire_time.tv_nsec);
 	if (ipc) {
-		msg.type = MSG_TYPE_WATCHDOG;
-		if (mq_send_msg_timeout(ipc->mqd, (void *)&msg, sizeof(struct ipc_msg)) < 0)
+		ipc_build_frame(ipc, frame, MSG_TYPE_WATCHDOG, NULL, NULL, 0);
+		/* don't let a busy queue starve the watchdog */
+		((struct ipc_hdr *)frame)->flags |= IPC_HDR_PRIO(IPC_PRIO_MAX);
+		/*
+		* epoll main loop runs timers itself, hand the frame to looper
+		* directly instead of a round trip through its own queue
+		*/
+		if (ipc->wheel) {
+			ipc_dispatcher(ipc, frame, sizeof(frame));
+			ipc_batch_flush(ipc);
+			return;
+		}
+		if (ipc_send_self(ipc, frame, sizeof(frame)) < 0)
 			pr_err("watchdog message send fail\n");
 	}
 }
 
 /*
- * ipc_watchdog_init - init watchdog settings
+ * ipc_watchdog_init_ex - init watchdog settings
  * @second: init watchdog timeout time
+ * @flags: IPC_WATCHDOG_* flags
  * */
-int ipc_watchdog_init(int second)
+int ipc_watchdog_init_ex(int second, int flags)
 {
-	struct ipc_lib *ipc = ipclib;
+	struct ipc_ctx *ipc = ipclib;
+	int ret;
 
 	if (!ipc) {
 		pr_info("ipclib didn't init\n");
@@ -189,10 +527,29 @@ int ipc_watchdog_init(int second)
 	}
 
 	ipc->wdt_timeout = second;
-	if (timer_init(&ipc->timer, timer_callback, (void *)ipc) < 0) {
+	if (ipc->wheel)
+		ret = timer_init_wheel(&ipc->timer, ipc->wheel, timer_callback, (void *)ipc);
+	else
+		ret = timer_init(&ipc->timer, timer_callback, (void *)ipc);
+	if (ret < 0) {
 		pr_err("timer_init fail\n");
 		return -1;
 	}
+
+	if (flags & IPC_WATCHDOG_HEARTBEAT) {
+		ipc->heartbeat = heartbeat_open();
+		if (!ipc->heartbeat)
+			return -1;
+		ipc->heartbeat_slot = heartbeat_register(ipc->heartbeat, ipc->name,
+				second * 1000);
+		if (ipc->heartbeat_slot < 0) {
+			heartbeat_close(ipc->heartbeat);
+			ipc->heartbeat = NULL;
+			return -1;
+		}
+		return 0;
+	}
+
 	if(software_watchdog_init(&ipc->wdt) < 0) {
 		pr_err("watchdog timer init fail\n");
 		return -1;
@@ -200,6 +557,15 @@ int ipc_watchdog_init(int second)
 	return 0;
 }
 
+/*
+ * ipc_watchdog_init - init watchdog settings
+ * @second: init watchdog timeout time
+ * */
+int ipc_watchdog_init(int second)
+{
+	return ipc_watchdog_init_ex(second, 0);
+}
+
 /*
  * ipc_watchdog_start - start watchdog timer
  *
@@ -207,7 +573,7 @@ int ipc_watchdog_init(int second)
  * */
 static int ipc_watchdog_start(void)
 {
-	struct ipc_lib *ipc = ipclib;
+	struct ipc_ctx *ipc = ipclib;
 	uint64_t usec;
 
 	if (!ipc) {
@@ -222,6 +588,10 @@ static int ipc_watchdog_start(void)
 		if (timer_start(&ipc->timer, usec, PERIODIC_TIMER) < 0)
 			return -1;
 
+		if (ipc->heartbeat) {
+			heartbeat_beat(ipc->heartbeat, ipc->heartbeat_slot);
+			return 0;
+		}
 		if (software_watchdog_start(&ipc->wdt, ipc->wdt_timeout) < 0)
 			return -1;
 	}
@@ -236,35 +606,79 @@ static int ipc_watchdog_start(void)
  * */
 int ipc_watchdog_feed(void)
 {
-	struct ipc_lib *ipc = ipclib;
+	struct ipc_ctx *ipc = ipclib;
 
 	if (!ipc) {
 		pr_info("ipclib didn't init\n");
 		return 0;
 	}
+	/* heartbeat is a plain store, no syscall */
+	if (ipc->heartbeat) {
+		heartbeat_beat(ipc->heartbeat, ipc->heartbeat_slot);
+		return 0;
+	}
 	software_watchdog_feed(&ipc->wdt);
 
 	return 0;
 }
 
 
+/*
+ * ipc_stall_init - log handlers running over a budget
+ * @budget_ms: handlers running longer are logged with type and stack
+ * @abort_ms: handlers running longer raise SIGABRT, 0 never aborts
+ * */
+int ipc_stall_init(int budget_ms, int abort_ms)
+{
+	if (budget_ms <= 0 || abort_ms < 0) {
+		pr_err("invalid stall budget:%d abort:%d\n", budget_ms, abort_ms);
+		return -1;
+	}
+	return stall_monitor_start(budget_ms, abort_ms);
+}
+
 /*
  * ipc_watchdog_remove - remvoe watchdog timer
+ *
+ * The heartbeat slot stays mapped, looper threads may still feed it,
+ * ipc_ctx_destroy gives it back after the looper is stopped.
  * */
 static int ipc_watchdog_remove(void)
 {
-	struct ipc_lib *ipc = ipclib;
+	struct ipc_ctx *ipc = ipclib;
 
 	if (!ipc) {
 		pr_err("ipclib didn't init\n");
 		return -1;
 	}
-	software_watchdog_remove(&ipc->wdt);
 	timer_remove(&ipc->timer);
+	software_watchdog_remove(&ipc->wdt);
 	return 0;
 }
 
 
+/*
+* ipc_send_msg_ex - send a async ipc_msg with send flags
+* @name: app name
+* @msg: request message
+* @flags: IPC_SEND_* flags
+*/
+int ipc_send_msg_ex(char *name, struct ipc_msg *msg, int flags)
+{
+	char frame[MSG_QUEUE_MAX_SIZE];
+	int length;
+	int ret;
+
+	length = ipc_build_msg_frame(ipclib, frame, msg);
+	if (length < 0)
+		return -1;
+	((struct ipc_hdr *)frame)->flags |= IPC_HDR_PRIO(flags & IPC_SEND_PRIO_MASK);
+	ret = ipc_send_frame_async(name, frame, length, flags);
+	if (ret >= 0)
+		ipc_count(ipclib, send_async);
+	return ret;
+}
+
 /*
 * ipc_send_msg_async - send a async message
 * @name: app name
@@ -272,204 +686,1874 @@ static int ipc_watchdog_remove(void)
 */
 int ipc_send_msg_async(char *name, struct ipc_msg *msg)
 {
-	char path[MSG_QUEUE_NAME_SIZE] = {0};
-	mqd_t mqd;
+	return ipc_send_msg_ex(name, msg, 0);
+}
+
+/*
+* ipc_send_buf - send a async message with variable length payload
+* @name: app name
+* @type: message type
+* @ptr: payload
+* @len: payload length, up to IPC_MAX_PAYLOAD
+*/
+int ipc_send_buf(char *name, int type, const void *ptr, int len)
+{
+	return ipc_send_ex(name, type, ptr, len, 0);
+}
+
+/*
+* ipc_send_ex - send a async message with send flags
+* @name: app name
+* @type: message type
+* @ptr: payload
+* @len: payload length, up to IPC_MAX_PAYLOAD
+* @flags: IPC_SEND_* flags
+*/
+int ipc_send_ex(char *name, int type, const void *ptr, int len, int flags)
+{
+	return ipc_ctx_send(ipclib, name, type, ptr, len, flags);
+}
+
+/*
+* ipc_ctx_send - send a async message from a context
+* @ctx: context, the source of the message, may be NULL before ipc_init
+* @name: app name
+* @type: message type
+* @ptr: payload
+* @len: payload length, up to IPC_MAX_PAYLOAD
+* @flags: IPC_SEND_* flags
+*/
+int ipc_ctx_send(struct ipc_ctx *ctx, char *name, int type, const void *ptr,
+				int len, int flags)
+{
+	char frame[MSG_QUEUE_MAX_SIZE];
+	int length;
+	int ret;
 
-	snprintf(path, MSG_QUEUE_NAME_SIZE, "/%s", name);
-	mqd = mq_rd_open(path);
-	if (mqd == (mqd_t)(-1)) {
-		pr_err("mq_rd_open fail\n");
+	length = ipc_build_frame(ctx, frame, type, NULL, ptr, len);
+	if (length < 0) {
+		pr_err("send payload too large, len:%d\n", len);
 		return -1;
 	}
-	return mq_send_msg_timeout(mqd, (void *)msg, sizeof(*msg));
+	((struct ipc_hdr *)frame)->flags |= IPC_HDR_PRIO(flags & IPC_SEND_PRIO_MASK);
+	ret = ipc_send_frame_async(name, frame, length, flags);
+	if (ret >= 0)
+		ipc_count(ctx, send_async);
+	return ret;
 }
 
 /*
-* ipc_send_msg_sync - send a sync message and will wait for reply
+ * ipc_call_cond_init - init condition of a call on monotonic clock
+ */
+static void ipc_call_cond_init(pthread_cond_t *cond)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/*
+* ipc_send_sync - send a sync message to a peer and wait for reply
+* @ipc: ipclib structure point
+* @peer: target peer
 * @msg: request message
 * @reply: reply which need to send
 */
-int ipc_send_msg_sync(char *name, struct ipc_msg *msg, struct ipc_reply *reply)
+static int ipc_send_sync(struct ipc_ctx *ipc, struct ipc_peer *peer,
+						struct ipc_msg *msg, struct ipc_reply *reply)
 {
 	int bytes_read;
-	struct ipc_lib *ipc = ipclib;
+	int ret = 0;
 	struct timespec expire_time;
-	char path[MSG_QUEUE_NAME_SIZE] = {0};
-	mqd_t mqd;
+	struct list_node *head;
+	struct ipc_call call;
+	char frame[MSG_QUEUE_MAX_SIZE];
+	int length;
 
-	/*
-	* reset ipclib reply structure to zero
-	*/
-	memset(&ipc->reply, 0, sizeof(struct ipc_reply));
+	if (!ipc) {
+		pr_err("should init first!\n");
+		return -1;
+	}
 
 	/*
 	* fill message source mq name
 	*/
 	snprintf(msg->source, MSG_QUEUE_NAME_SIZE, "%s", ipc->name);
 
+	length = ipc_build_msg_frame(ipc, frame, msg);
+	if (length < 0)
+		return -1;
+
 	/*
-	* open target application message queue
+	* register the call before sending, reply may come back
+	* before we start to wait
 	*/
-	snprintf(path, MSG_QUEUE_NAME_SIZE, "/%s", name);
-	mqd = mq_rd_open(path);
-	if (mqd == (mqd_t)(-1)) {
-		pr_err("mq_rd_open fail\n");
-		return -1;
-	}
+	memset(&call, 0, sizeof(call));
+	INIT_LIST_NODE(&call.tnode);
+	call.seq = ((struct ipc_hdr *)frame)->seq;
+	call.type = msg->type + MSG_TYPE_REPLY_BASE;
+	ipc_call_cond_init(&call.cond);
+	head = &ipc->calls[call.seq % IPC_CALL_HASH_SIZE];
+	pthread_mutex_lock(&ipc->lock);
+	list_node_add_tail(&call.node, head);
+	pthread_mutex_unlock(&ipc->lock);
 
-	bytes_read = mq_send_msg_timeout(mqd, (void *)msg, sizeof(*msg));
+	bytes_read = peer_send(peer, frame, length);
 	if (bytes_read < 0) {
 		pr_err("ipc_send_msg failed, %s\n", strerror(errno));
-		return -1;
+		ret = -1;
+	} else {
+		ipc_count(ipc, send_sync);
 	}
 
 	/*
 	* block wait for reply signal from receive thread
 	* wait reply 3 second as timeout
 	*/
+	clock_gettime(CLOCK_MONOTONIC, &expire_time);
+	expire_time.tv_sec += IPC_CALL_TIMEOUT_SEC;
 	pthread_mutex_lock(&ipc->lock);
-	while(ipc->reply.type != msg->type + MSG_TYPE_REPLY_BASE){
-		clock_gettime(CLOCK_REALTIME, &expire_time);
-		expire_time.tv_sec += 3;
-		if (pthread_cond_timedwait(&ipc->condition,
-					&ipc->lock, &expire_time) < 0) {
-			/*
-			 * Handle errno as a fault except EINTR
-			 */
-			if (errno == EINTR) {
-				continue;
-			} else {
-				pr_err("pthread_cond_timedwait fail, %s\n",
-						strerror(errno));
-				pthread_mutex_unlock(&ipc->lock);
-				return -1;
-			}
+	while (!ret && !call.done) {
+		ret = pthread_cond_timedwait(&call.cond, &ipc->lock, &expire_time);
+		if (ret) {
+			pr_err("wait reply of seq:%u fail, %s\n", call.seq, strerror(ret));
+			errno = ret;
+			ret = -1;
 		}
 	}
+	list_node_del(&call.node);
+	pthread_mutex_unlock(&ipc->lock);
+	pthread_cond_destroy(&call.cond);
+	if (ret < 0)
+		return -1;
 
 	/*
 	 * copy reply to the argument pointed address
 	*/
-	memcpy(reply, &ipc->reply, sizeof(struct ipc_reply));
-	pthread_mutex_unlock(&ipc->lock);
+	memcpy(reply, &call.reply, sizeof(struct ipc_reply));
 	return bytes_read;
 }
 
 /*
-* ipc_send_reply - send a reply for a sync message
+* ipc_send_msg_sync - send a sync message and will wait for reply
 * @msg: request message
 * @reply: reply which need to send
-*
-* This function will set reply->type equal (msg->type + MSG_TYPE_REPLY_BASE)
 */
-int ipc_send_reply(struct ipc_msg *msg, struct ipc_reply *reply)
+int ipc_send_msg_sync(char *name, struct ipc_msg *msg, struct ipc_reply *reply)
 {
-	mqd_t mqd;
+	return ipc_ctx_send_sync(ipclib, name, msg, reply);
+}
 
-	/**
-	* set reply->type, should start from MSG_TYPE_REPLY_BASE
-	*/
-	reply->type = msg->type + MSG_TYPE_REPLY_BASE;
+/*
+* ipc_ctx_send_sync - send a sync message and wait for its reply
+* @ctx: context, the reply comes back to it
+* @name: app name
+* @msg: request message
+* @reply: store the reply
+*/
+int ipc_ctx_send_sync(struct ipc_ctx *ctx, char *name, struct ipc_msg *msg,
+				struct ipc_reply *reply)
+{
+	struct ipc_peer *peer;
+	int ret;
 
-	/*
-	* get source mq name from request message
-	*/
-	mqd = mq_rd_open(msg->source);
-	if (mqd == (mqd_t)(-1)) {
-		pr_err("mq_rd_open fail\n");
+	peer = peer_get(name);
+	if (!peer) {
+		pr_err("peer %s not found\n", name);
 		return -1;
 	}
+	ret = ipc_send_sync(ctx, peer, msg, reply);
+	peer_put(peer);
+	return ret;
+}
 
+/*
+* ipc_call_complete - run callback of an async call in looper thread
+* @data: the finished ipc_call
+*/
+static void ipc_call_complete(void *data)
+{
+	struct ipc_call *call = (struct ipc_call *)data;
 
-	return mq_send_msg_timeout(mqd, (void *)reply, sizeof(*reply));
+	call->callback(call->status, &call->reply, call->ctx);
+	free(call);
 }
 
-/**
-* ipc_receive_msg - receive messages.
+/*
+* ipc_call_finish - unlink an async call and post its callback
+* @ipc: ipclib structure point, lock must be held
+* @call: async call
+* @status: 0 or error number
+*/
+static void ipc_call_finish(struct ipc_ctx *ipc, struct ipc_call *call, int status)
+{
+	list_node_del(&call->node);
+	list_node_del(&call->tnode);
+	call->status = status;
+	call->done = 1;
+	ipc->looper->post(ipc->looper, ipc_call_complete, call);
+}
+
+/*
+* ipc_expire_calls - finish async calls whose deadline passed
 * @ipc: ipclib structure point
-* @msg: note that it is a point to a point (struct ipc_msg **)
+* @now: current monotonic time in ns
+*
+* Returns the next deadline, or 0 if there is no async call.
 */
-static int ipc_receive_msg(struct ipc_lib *ipc, struct ipc_msg **msg)
+static uint64_t ipc_expire_calls(struct ipc_ctx *ipc, uint64_t now)
 {
-	int bytes_read = -1;
-	struct timespec expire_time;
+	struct ipc_call *call;
+	uint64_t next = 0;
 
-	while(!ipc->exit) {
-		clock_gettime(CLOCK_REALTIME, &expire_time);
-		expire_time.tv_nsec += 500000000; //500ms
-		expire_time.tv_sec += expire_time.tv_nsec / 1000000000;
-		expire_time.tv_nsec = expire_time.tv_nsec % 1000000000;
-		//pr_debug("ipc->mqd:%d, tv_sec:%ld, tv_nsec:%ld\n", ipc->mqd, expire_time.tv_sec, expire_time.tv_nsec);
-		bytes_read = mq_timedreceive(ipc->mqd, (char *)ipc->buf,
-				MSG_QUEUE_MAX_SIZE, NULL, &expire_time);
-		if (bytes_read < 0) {
-			if (errno == EINTR || errno == ETIMEDOUT)
-				continue;
-			else {
-				pr_err("mq_timedreceive failed, %s\n", strerror(errno));
-				return -1;
-			}
-		} else if (bytes_read > 0)
+	pthread_mutex_lock(&ipc->lock);
+	while (!list_is_empty(&ipc->timeouts)) {
+		call = list_node_entry(ipc->timeouts.next, struct ipc_call, tnode);
+		if (call->deadline > now) {
+			next = call->deadline;
 			break;
+		}
+		pr_err("async call seq:%u type:%d timeout\n", call->seq,
+				call->type - MSG_TYPE_REPLY_BASE);
+		ipc_call_finish(ipc, call, ETIMEDOUT);
 	}
-	*msg = (struct ipc_msg *)ipc->buf;
-	return bytes_read;
+	pthread_mutex_unlock(&ipc->lock);
+	return next;
 }
 
-/**
-* ipc_handle_reply - handle message reply.
-* @ipc: ipclib structure point
-* @reply: ipc message reply point
+/*
+* ipc_cancel_calls - complete async calls still pending with ECANCELED
+* @ipc: context being destroyed, its looper is already gone
+*
+* Callbacks run in the calling thread, the looper can't run them.
 */
-static void ipc_handle_reply(struct ipc_lib *ipc, struct ipc_reply *reply)
+static void ipc_cancel_calls(struct ipc_ctx *ipc)
 {
+	struct ipc_call *call;
+
 	pthread_mutex_lock(&ipc->lock);
-	memcpy(&ipc->reply, reply, sizeof(struct ipc_reply));
-	pthread_cond_signal(&ipc->condition);
+	while (!list_is_empty(&ipc->timeouts)) {
+		call = list_node_entry(ipc->timeouts.next, struct ipc_call, tnode);
+		list_node_del(&call->node);
+		list_node_del(&call->tnode);
+		pthread_mutex_unlock(&ipc->lock);
+		call->callback(ECANCELED, &call->reply, call->ctx);
+		free(call);
+		pthread_mutex_lock(&ipc->lock);
+	}
 	pthread_mutex_unlock(&ipc->lock);
 }
 
-/**
-* ipc_dispatcher - handle and post message.
-* @ipc: ipclib structure point
-* @msg: ipc message point
+/*
+* ipc_call_async - send a request and get its reply by callback
+* @name: app name
+* @msg: request message
+* @callback: called in looper thread with the reply or a timeout
+* @ctx: private data of callback
+* @timeout_ms: max time to wait for the reply
 */
-static void ipc_dispatcher(struct ipc_lib *ipc, struct ipc_msg *msg)
+int ipc_call_async(char *name, struct ipc_msg *msg, ipc_reply_cb callback,
+					void *ctx, int timeout_ms)
 {
-	struct ipc_msg *data;
+	struct ipc_ctx *ipc = ipclib;
+	char frame[MSG_QUEUE_MAX_SIZE];
+	struct ipc_call *call, *pos;
+	struct list_node *node, *head;
+	uint64_t deadline;
+	uint32_t seq;
+	int length;
+	int ret;
 
-	/*
-	* reply message don't need to post, handle it here.
-	*/
-	if (msg->type >= MSG_TYPE_REPLY_BASE) {
-		ipc_handle_reply(ipc, (struct ipc_reply *)msg);
+	if (!ipc) {
+		pr_err("should init first!\n");
+		return -1;
+	}
+	if (!callback || timeout_ms < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	snprintf(msg->source, MSG_QUEUE_NAME_SIZE, "%s", ipc->name);
+	length = ipc_build_msg_frame(ipc, frame, msg);
+	if (length < 0)
+		return -1;
+
+	call = (struct ipc_call *)malloc(sizeof(*call));
+	if (!call) {
+		pr_err("ipc call malloc fail\n");
+		return -1;
+	}
+	memset(call, 0, sizeof(*call));
+	call->seq = ((struct ipc_hdr *)frame)->seq;
+	call->type = msg->type + MSG_TYPE_REPLY_BASE;
+	call->callback = callback;
+	call->ctx = ctx;
+	call->deadline = ipc_now_ns() + (uint64_t)timeout_ms * 1000000ULL;
+	seq = call->seq;
+	deadline = call->deadline;
+	head = &ipc->calls[seq % IPC_CALL_HASH_SIZE];
+
+	/*
+	* timeout list is sorted by deadline, most calls use the same
+	* timeout so search from the tail. Once published the call may
+	* be finished and freed by the looper at any time, it is only
+	* found again by seq below.
+	*/
+	pthread_mutex_lock(&ipc->lock);
+	list_node_add_tail(&call->node, head);
+	list_for_each_node_prev(node, &ipc->timeouts) {
+		pos = list_node_entry(node, struct ipc_call, tnode);
+		if (pos->deadline <= call->deadline)
+			break;
+	}
+	list_node_add(&call->tnode, node);
+	pthread_mutex_unlock(&ipc->lock);
+
+	ret = ipc_send_frame(name, frame, length);
+	if (ret < 0) {
+		pthread_mutex_lock(&ipc->lock);
+		list_for_each_node_entry(pos, head, node) {
+			if (pos->seq == seq && pos->callback) {
+				list_node_del(&pos->node);
+				list_node_del(&pos->tnode);
+				pthread_mutex_unlock(&ipc->lock);
+				free(pos);
+				return -1;
+			}
+		}
+		/* already finished by timeout, callback reports it */
+		pthread_mutex_unlock(&ipc->lock);
+		return 0;
+	}
+	ipc_count(ipc, send_async);
+
+	/*
+	* receive thread sleeps until its own deadline, wake it up
+	* if this call expires earlier
+	*/
+	if (deadline < __atomic_load_n(&ipc->wait_deadline, __ATOMIC_RELAXED))
+		ipc_wakeup(ipc);
+	return 0;
+}
+
+/*
+* ipc_batch_enable - pack async messages to the same app together
+* @linger_us: max time a message waits for others, 0 to disable
+*/
+int ipc_batch_enable(int linger_us)
+{
+	return peer_batch_enable(linger_us);
+}
+
+/*
+* ipc_outbound_enable - send async messages from a sender thread
+* @depth: most messages queued for one app, 0 to disable
+*/
+int ipc_outbound_enable(int depth)
+{
+	return peer_outbound_enable(depth);
+}
+
+/*
+* ipc_flush - send all batched and queued messages now
+*/
+void ipc_flush(void)
+{
+	peer_flush_all();
+}
+
+/*
+* ipc_get_stats - get receive side counters
+* @stats: filled with a snapshot of counters
+*/
+int ipc_get_stats(struct ipc_stats *stats)
+{
+	return ipc_ctx_get_stats(ipclib, stats);
+}
+
+/*
+* ipc_ctx_get_stats - ipc_get_stats of a context
+*/
+int ipc_ctx_get_stats(struct ipc_ctx *ctx, struct ipc_stats *stats)
+{
+	struct mq_attr attr;
+
+	if (!ctx || !stats) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(stats, &ctx->stats, sizeof(*stats));
+	stats->queue_maxmsg = ctx->maxmsg;
+	if (ctx->ring)
+		stats->queue_depth = ring_count(ctx->ring);
+	else if (mq_getattr(ctx->mqd, &attr) == 0)
+		stats->queue_depth = attr.mq_curmsgs;
+	if (ctx->reg_id)
+		stats->queue_full = __atomic_load_n(
+				&ctx->registry->entries[ctx->reg_id - 1].full,
+				__ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+* ipc_latency_enable - measure latency of every message hop
+* @enable: 1 to start, 0 to stop
+*/
+int ipc_latency_enable(int enable)
+{
+	__atomic_store_n(&ipc_latency_on, !!enable, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+* ipc_latency_get - get the latency summary of a hop
+* @type: message type, or IPC_LATENCY_ALL
+* @hop: IPC_HOP_*
+* @lat: filled with the summary
+*/
+int ipc_latency_get(int type, int hop, struct ipc_latency *lat)
+{
+	return ipc_ctx_latency_get(ipclib, type, hop, lat);
+}
+
+/*
+* ipc_ctx_latency_get - ipc_latency_get of a context
+*/
+int ipc_ctx_latency_get(struct ipc_ctx *ctx, int type, int hop,
+				struct ipc_latency *lat)
+{
+	struct hist *sum, *hists;
+	int first, last, i;
+
+	if (!ctx || !lat || hop < 0 || hop >= IPC_HOP_COUNT ||
+			type < IPC_LATENCY_ALL || type >= MSG_TYPE_REPLY_BASE) {
+		errno = EINVAL;
+		return -1;
+	}
+	sum = (struct hist *)calloc(1, sizeof(*sum));
+	if (!sum)
+		return -1;
+	first = type == IPC_LATENCY_ALL ? 0 : type;
+	last = type == IPC_LATENCY_ALL ? MSG_TYPE_REPLY_BASE - 1 : type;
+	for (i = first; i <= last; i++) {
+		hists = __atomic_load_n(&ctx->latency[i], __ATOMIC_ACQUIRE);
+		if (hists)
+			hist_merge(sum, &hists[hop]);
+	}
+
+	memset(lat, 0, sizeof(*lat));
+	lat->count = sum->count;
+	if (sum->count) {
+		lat->mean_ns = sum->sum / sum->count;
+		lat->max_ns = sum->max;
+		lat->p50_ns = hist_percentile(sum, 50.0);
+		lat->p90_ns = hist_percentile(sum, 90.0);
+		lat->p99_ns = hist_percentile(sum, 99.0);
+		lat->p999_ns = hist_percentile(sum, 99.9);
+	}
+	free(sum);
+	return 0;
+}
+
+/*
+* ipc_latency_reset - forget measured latencies
+*/
+void ipc_latency_reset(void)
+{
+	ipc_ctx_latency_reset(ipclib);
+}
+
+/*
+* ipc_ctx_latency_reset - ipc_latency_reset of a context
+*
+* Messages being measured meanwhile may be counted partly.
+*/
+void ipc_ctx_latency_reset(struct ipc_ctx *ctx)
+{
+	struct hist *hists;
+	int i, hop;
+
+	if (!ctx)
+		return;
+	for (i = 0; i < MSG_TYPE_REPLY_BASE; i++) {
+		hists = __atomic_load_n(&ctx->latency[i], __ATOMIC_ACQUIRE);
+		for (hop = 0; hists && hop < IPC_HOP_COUNT; hop++)
+			hist_reset(&hists[hop]);
+	}
+}
+
+/*
+* ipc_lookup - find an app in the service registry
+* @name: app name
+* @ep: filled with the endpoint of the app
+*/
+int ipc_lookup(const char *name, struct ipc_endpoint *ep)
+{
+	struct registry_entry entry;
+	int id;
+
+	if (!ipclib || !name || !ep) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!ipclib->registry) {
+		errno = ENOENT;
+		return -1;
+	}
+	id = registry_lookup(ipclib->registry, name, &entry);
+	if (id < 0)
+		return -1;
+	ep->id = id;
+	ep->pid = entry.pid;
+	ep->ring = entry.transport == REGISTRY_RING;
+	ep->caps = entry.caps;
+	return 0;
+}
+
+/*
+* ipc_topic_get - find an opened topic, open it if create is set
+* @ipc: ipclib structure point
+* @name: topic name
+*
+* Topics stay open until ipc_deinit, the handle may be used after
+* topic_lock is released.
+*/
+static struct topic *ipc_topic_get(struct ipc_ctx *ipc, const char *name, int create)
+{
+	struct topic *t;
+
+	pthread_mutex_lock(&ipc->topic_lock);
+	list_for_each_node_entry(t, &ipc->topics, node) {
+		if (!strncmp(t->name, name, TOPIC_NAME_SIZE))
+			goto out;
+	}
+	t = NULL;
+	if (!create) {
+		errno = ENOENT;
+		goto out;
+	}
+	t = topic_open(name, MSG_QUEUE_MAX_SIZE);
+	if (t)
+		list_node_add_tail(&t->node, &ipc->topics);
+out:
+	pthread_mutex_unlock(&ipc->topic_lock);
+	return t;
+}
+
+/*
+* ipc_topic_wake - tell a subscriber its topic has new messages
+*/
+static int ipc_topic_wake(const char *name, void *data)
+{
+	char frame[sizeof(struct ipc_hdr)];
+
+	/*
+	 * A publisher never waits for a subscriber, which is woken up
+	 * by a later message if its queue is full now.
+	 */
+	ipc_build_frame((struct ipc_ctx *)data, frame, MSG_TYPE_TOPIC, NULL, NULL, 0);
+	return ipc_send_frame_async((char *)name, frame, sizeof(frame),
+			IPC_SEND_NONBLOCK);
+}
+
+/*
+* ipc_publish - send a message to all subscribers of a topic
+* @topic: topic name
+* @type: message type
+* @ptr: payload
+* @len: payload length
+*/
+int ipc_publish(const char *topic, int type, const void *ptr, int len)
+{
+	struct topic *t;
+	uint64_t seq;
+	char *frame;
+	int length;
+
+	if (!ipclib) {
+		pr_err("should init first!\n");
+		return -1;
+	}
+	if (type < 0 || type >= MSG_TYPE_WATCHDOG || len < 0 || len > IPC_MAX_PAYLOAD) {
+		errno = EINVAL;
+		return -1;
+	}
+	t = ipc_topic_get(ipclib, topic, 1);
+	if (!t)
+		return -1;
+
+	/* the frame is built once, in the slot all subscribers read */
+	frame = topic_write_begin(t, &seq);
+	length = ipc_build_frame(ipclib, frame, type, NULL, ptr, len);
+	topic_write_end(t, seq, length);
+	topic_notify(t, ipc_topic_wake, ipclib);
+	return 0;
+}
+
+/*
+* ipc_subscribe - receive messages published to a topic from now on
+* @topic: topic name
+*/
+int ipc_subscribe(const char *topic)
+{
+	struct topic *t;
+	int ret;
+
+	if (!ipclib) {
+		pr_err("should init first!\n");
+		return -1;
+	}
+	t = ipc_topic_get(ipclib, topic, 1);
+	if (!t)
+		return -1;
+
+	pthread_mutex_lock(&ipclib->topic_lock);
+	ret = topic_subscribe(t, ipclib->name);
+	if (!ret && topic_arm(t) < 0) {
+		/* published meanwhile, let main loop read it */
+		__atomic_store_n(&ipclib->topic_pending, 1, __ATOMIC_RELAXED);
+		ipc_wakeup(ipclib);
+	}
+	pthread_mutex_unlock(&ipclib->topic_lock);
+	return ret;
+}
+
+/*
+* ipc_unsubscribe - stop receiving messages of a topic
+* @topic: topic name
+*/
+int ipc_unsubscribe(const char *topic)
+{
+	struct topic *t;
+
+	if (!ipclib) {
+		pr_err("should init first!\n");
+		return -1;
+	}
+	t = ipc_topic_get(ipclib, topic, 0);
+	if (!t)
+		return -1;
+
+	pthread_mutex_lock(&ipclib->topic_lock);
+	topic_unsubscribe(t);
+	pthread_mutex_unlock(&ipclib->topic_lock);
+	return 0;
+}
+
+/*
+* ipc_topic_lost - messages of a topic lost because this app was slow
+* @topic: subscribed topic name
+* @lost: store the count
+*/
+int ipc_topic_lost(const char *topic, uint64_t *lost)
+{
+	struct topic *t;
+
+	if (!ipclib || !lost) {
+		errno = EINVAL;
+		return -1;
+	}
+	t = ipc_topic_get(ipclib, topic, 0);
+	if (!t)
+		return -1;
+	*lost = topic_lost(t);
+	return 0;
+}
+
+/*
+* ipc_peer_open - get a handle of the app for repeated sends
+* @name: app name
+*/
+struct ipc_peer *ipc_peer_open(char *name)
+{
+	return peer_get(name);
+}
+
+/*
+* ipc_peer_send_async - send a async message through a peer handle
+* @peer: handle returned by ipc_peer_open
+* @msg: request message
+*/
+int ipc_peer_send_async(struct ipc_peer *peer, struct ipc_msg *msg)
+{
+	char frame[MSG_QUEUE_MAX_SIZE];
+	int length;
+	int ret;
+
+	length = ipc_build_msg_frame(ipclib, frame, msg);
+	if (length < 0)
+		return -1;
+	ret = peer_send_async(peer, frame, length);
+	if (ret >= 0)
+		ipc_count(ipclib, send_async);
+	return ret;
+}
+
+/*
+* ipc_peer_send_buf - send a variable length message through a peer handle
+* @peer: handle returned by ipc_peer_open
+* @type: message type
+* @ptr: payload
+* @len: payload length, up to IPC_MAX_PAYLOAD
+*/
+int ipc_peer_send_buf(struct ipc_peer *peer, int type, const void *ptr, int len)
+{
+	char frame[MSG_QUEUE_MAX_SIZE];
+	int length;
+	int ret;
+
+	length = ipc_build_frame(ipclib, frame, type, NULL, ptr, len);
+	if (length < 0)
+		return -1;
+	ret = peer_send_async(peer, frame, length);
+	if (ret >= 0)
+		ipc_count(ipclib, send_async);
+	return ret;
+}
+
+/*
+* ipc_peer_send_sync - send a sync message through a peer handle
+* @peer: handle returned by ipc_peer_open
+* @msg: request message
+* @reply: reply which need to send
+*/
+int ipc_peer_send_sync(struct ipc_peer *peer, struct ipc_msg *msg,
+						struct ipc_reply *reply)
+{
+	return ipc_send_sync(ipclib, peer, msg, reply);
+}
+
+/*
+* ipc_peer_close - release a peer handle
+* @peer: handle returned by ipc_peer_open
+*/
+void ipc_peer_close(struct ipc_peer *peer)
+{
+	peer_put(peer);
+}
+
+/*
+* ipc_peer_stat - ipc_queue_stat through a peer handle
+* @peer: handle returned by ipc_peer_open
+* @st: filled with the state
+*/
+int ipc_peer_stat(struct ipc_peer *peer, struct ipc_queue_stat *st)
+{
+	if (!peer || !st) {
+		errno = EINVAL;
+		return -1;
+	}
+	return peer_queue_stat(peer, st);
+}
+
+/*
+* ipc_queue_stat - get the flow control state of an app's queue
+* @name: app name
+* @st: filled with the state
+*/
+int ipc_queue_stat(char *name, struct ipc_queue_stat *st)
+{
+	struct ipc_peer *peer;
+	int ret;
+
+	if (!name || !st) {
+		errno = EINVAL;
+		return -1;
+	}
+	peer = peer_get(name);
+	if (!peer)
+		return -1;
+	ret = peer_queue_stat(peer, st);
+	peer_put(peer);
+	return ret;
+}
+
+/*
+ * ipc_mq_limit - read a limit of POSIX queues
+ * @name: file in /proc/sys/fs/mqueue
+ *
+ * Returns the limit, -1 if it can't be read.
+ */
+static long ipc_mq_limit(const char *name)
+{
+	char path[64];
+	long limit = -1;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), IPC_MQUEUE_PROC "%s", name);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	if (fscanf(fp, "%ld", &limit) != 1)
+		limit = -1;
+	fclose(fp);
+	return limit;
+}
+
+/*
+* ipc_queue_attr - set depth and message size of endpoints created later
+* @maxmsg: queue depth or ring slots, 0 for the default
+* @msgsize: max frame size, 0 for MSG_QUEUE_MAX_SIZE
+*/
+int ipc_queue_attr(int maxmsg, int msgsize)
+{
+	if (maxmsg < 0 || maxmsg > IPC_QUEUE_MAXMSG_MAX ||
+			(msgsize && (msgsize < IPC_QUEUE_MSGSIZE_MIN ||
+			msgsize > MSG_QUEUE_MAX_SIZE))) {
+		pr_err("invalid queue attr, maxmsg:%d msgsize:%d\n", maxmsg, msgsize);
+		errno = EINVAL;
+		return -1;
+	}
+	ipc_queue_maxmsg = maxmsg;
+	ipc_queue_msgsize = msgsize;
+	return 0;
+}
+
+/*
+* ipc_mq_attr_check - check queue attributes against the system limits
+*
+* Unprivileged apps fail to create a queue beyond the limits, tell
+* which one instead of a bare EINVAL.
+*/
+static int ipc_mq_attr_check(int maxmsg, int msgsize)
+{
+	long limit;
+
+	limit = ipc_mq_limit("msg_max");
+	if (limit > 0 && maxmsg > limit) {
+		pr_err("maxmsg %d over " IPC_MQUEUE_PROC "msg_max %ld\n", maxmsg, limit);
+		errno = EINVAL;
+		return -1;
+	}
+	limit = ipc_mq_limit("msgsize_max");
+	if (limit > 0 && msgsize > limit) {
+		pr_err("msgsize %d over " IPC_MQUEUE_PROC "msgsize_max %ld\n", msgsize, limit);
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+* ipc_send_reply - send a reply for a sync message
+* @msg: request message
+* @reply: reply which need to send
+*
+* This function will set reply->type equal (msg->type + MSG_TYPE_REPLY_BASE)
+*/
+int ipc_send_reply(struct ipc_msg *msg, struct ipc_reply *reply)
+{
+	struct ipc_packet *packet = (struct ipc_packet *)msg;
+	char payload[sizeof(int32_t) + MSG_CONTENT_SIZE];
+	char frame[MSG_QUEUE_MAX_SIZE];
+	struct ipc_hdr *hdr = (struct ipc_hdr *)frame;
+	int32_t result = reply->result;
+	struct ipc_ctx *ipc;
+	int length;
+
+	/*
+	* a copied message, or one whose handler returned, has no packet
+	* behind it, the reply can't be matched by the sender then
+	*/
+	ipc = ipc_msg_ctx(msg);
+	if (!ipc) {
+		pr_err("reply to type:%d not sent from its handler\n", msg->type);
+		packet = NULL;
+		ipc = ipclib;
+	}
+
+	/**
+	* set reply->type, should start from MSG_TYPE_REPLY_BASE
+	*/
+	reply->type = msg->type + MSG_TYPE_REPLY_BASE;
+
+	/*
+	* reply payload is the result and used part of content
+	*/
+	memcpy(payload, &result, sizeof(result));
+	memcpy(payload + sizeof(result), reply->content, MSG_CONTENT_SIZE);
+	length = ipc_build_frame(ipc, frame, reply->type, NULL, payload,
+			sizeof(result) + ipc_content_len(reply->content, MSG_CONTENT_SIZE));
+	if (length < 0)
+		return -1;
+	if (packet) {
+		hdr->seq = packet->hdr.seq;
+		/* reply goes back with the priority of the request */
+		hdr->flags |= packet->hdr.flags & IPC_HDR_PRIO_MASK;
+	}
+
+	/*
+	* get source app name from request message
+	*/
+	return ipc_send_frame(msg->source, frame, length);
+}
+
+/*
+* ipc_shmbuf_init - create the shared memory pool of this endpoint
+* @count: buffer count
+* @size: size of each buffer
+*/
+int ipc_shmbuf_init(int count, int size)
+{
+	struct ipc_ctx *ipc = ipclib;
+
+	if (!ipc) {
+		pr_err("should init first!\n");
+		return -1;
+	}
+	if (count <= 0 || size <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ipc->pool) {
+		pr_info("shm pool already inited\n");
+		return 0;
+	}
+	ipc->pool = shmbuf_pool_create(ipc->id, count, size);
+	if (!ipc->pool)
+		return -1;
+	if (ipc->reg_id)
+		registry_set_caps(ipc->registry, ipc->reg_id, IPC_CAP_SHMBUF);
+	return 0;
+}
+
+/*
+* ipc_shmbuf_alloc - get a buffer from the shared memory pool
+* @len: bytes needed
+*/
+void *ipc_shmbuf_alloc(int len)
+{
+	if (!ipclib || !ipclib->pool) {
+		pr_err("shm pool didn't init\n");
+		return NULL;
+	}
+	return shmbuf_alloc(ipclib->pool, len);
+}
+
+/*
+* ipc_shmbuf_free - give back a buffer got by ipc_shmbuf_alloc
+* @buf: buffer point
+*/
+void ipc_shmbuf_free(void *buf)
+{
+	if (ipclib && ipclib->pool && buf)
+		shmbuf_free(ipclib->pool, buf);
+}
+
+/*
+* ipc_send_shmbuf - send a shared memory buffer without copying it
+* @name: app name
+* @type: message type
+* @buf: buffer got by ipc_shmbuf_alloc
+* @len: valid bytes in buffer
+*
+* Only a descriptor is sent, the receiver holds a reference on the
+* buffer until its msg_handler returns.
+*/
+int ipc_send_shmbuf(char *name, int type, void *buf, int len)
+{
+	struct ipc_ctx *ipc = ipclib;
+	char frame[sizeof(struct ipc_hdr) + sizeof(struct shmbuf_desc) + IPC_STAMP_SIZE];
+	struct shmbuf_desc desc;
+	int length;
+	int ret;
+
+	if (!ipc || !ipc->pool) {
+		pr_err("shm pool didn't init\n");
+		return -1;
+	}
+	if (shmbuf_ref(ipc->pool, buf, len, &desc) < 0) {
+		pr_err("invalid shm buffer\n");
+		return -1;
+	}
+	length = ipc_build_frame(ipc, frame, type, NULL, &desc, sizeof(desc));
+	if (length < 0) {
+		shmbuf_free(ipc->pool, buf);
+		return -1;
+	}
+	((struct ipc_hdr *)frame)->flags |= IPC_HDR_SHMBUF;
+	ret = ipc_send_frame_async(name, frame, length, 0);
+	if (ret < 0)
+		shmbuf_free(ipc->pool, buf);
+	else
+		ipc_count(ipc, send_async);
+	return ret;
+}
+
+/*
+* ipc_rx_buf - buffer the next frame is received into
+* @ipc: ipclib structure point
+*
+* Frames are received straight into a pooled packet which is handed
+* to looper as is, ipc->buf is only used if the pool is exhausted.
+*/
+static char *ipc_rx_buf(struct ipc_ctx *ipc)
+{
+	if (!ipc->rx)
+		ipc->rx = (struct ipc_packet *)msgpool_alloc(&ipc_packet_pool);
+	return ipc->rx ? ipc->rx->data : ipc->buf;
+}
+
+/**
+* ipc_receive_msg - receive a frame into ipc_rx_buf().
+* @ipc: ipclib structure point
+* @frame: store the buffer the frame was received into
+*
+* ipc_rx_buf() may return another buffer once the pool has room
+* again, so the caller must use the one stored in frame.
+*/
+static int ipc_receive_msg(struct ipc_ctx *ipc, char **frame)
+{
+	int bytes_read = -1;
+	struct timespec expire_time;
+	uint64_t now, next;
+	int timeout_ms;
+	char *buf;
+
+	while(!ipc->exit) {
+		/*
+		* wake up every 500ms to check exit, or earlier for the
+		* next async call timeout
+		*/
+		now = ipc_now_ns();
+		next = ipc_expire_calls(ipc, now);
+		timeout_ms = IPC_RECV_TIMEOUT_MS;
+		if (next && next - now < (uint64_t)timeout_ms * 1000000ULL)
+			timeout_ms = (next - now + 999999) / 1000000;
+		__atomic_store_n(&ipc->wait_deadline,
+				now + (uint64_t)timeout_ms * 1000000ULL, __ATOMIC_RELAXED);
+
+		buf = ipc_rx_buf(ipc);
+		*frame = buf;
+		if (ipc->ring) {
+			bytes_read = ring_pop(ipc->ring, buf, MSG_QUEUE_MAX_SIZE, timeout_ms);
+			if (bytes_read < 0) {
+				if (errno == ETIMEDOUT || errno == EMSGSIZE)
+					continue;
+				pr_err("ring_pop failed, %s\n", strerror(errno));
+				return -1;
+			} else if (bytes_read > 0)
+				break;
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &expire_time);
+		expire_time.tv_nsec += timeout_ms * 1000000L;
+		expire_time.tv_sec += expire_time.tv_nsec / 1000000000;
+		expire_time.tv_nsec = expire_time.tv_nsec % 1000000000;
+		bytes_read = mq_timedreceive(ipc->mqd, buf, MSG_QUEUE_MAX_SIZE, NULL,
+				&expire_time);
+		if (bytes_read < 0) {
+			if (errno == EINTR || errno == ETIMEDOUT)
+				continue;
+			else {
+				pr_err("mq_timedreceive failed, %s\n", strerror(errno));
+				return -1;
+			}
+		} else if (bytes_read > 0)
+			break;
+	}
+	return bytes_read;
+}
+
+/**
+* ipc_batch_flush - hand received packets to looper in one go.
+* @ipc: ipclib structure point
+*/
+static void ipc_batch_flush(struct ipc_ctx *ipc)
+{
+	int count = ipc->batch_count;
+	int bucket = 0;
+
+	struct ipc_packet *packet;
+	uint64_t now;
+	int i;
+
+	if (!count)
+		return;
+	ipc->batch_count = 0;
+	if (__atomic_load_n(&ipc_latency_on, __ATOMIC_RELAXED)) {
+		now = ipc_now_ns();
+		for (i = 0; i < count; i++) {
+			packet = (struct ipc_packet *)ipc->batch[i];
+			if (!packet->recv_ns)
+				continue;
+			packet->post_ns = now;
+			ipc_latency_record(ipc, packet->hdr.type, IPC_HOP_DISPATCH,
+					packet->recv_ns, now);
+		}
+	}
+	__atomic_add_fetch(&ipc->inflight, count, __ATOMIC_RELAXED);
+	ipc->looper->dispatch_batch(ipc->looper, ipc->batch, count);
+
+	while ((2 << bucket) <= count && bucket < IPC_STATS_BATCH_BUCKETS - 1)
+		bucket++;
+	ipc->stats.batch_hist[bucket]++;
+	ipc->stats.recv_batches++;
+	if (count > ipc->stats.batch_max)
+		ipc->stats.batch_max = count;
+}
+
+/**
+* ipc_drain_msg - handle frames already queued without blocking.
+* @ipc: ipclib structure point
+*
+* Called after a blocking receive returns, so a burst is picked up
+* with one wakeup and handed to looper as one batch.
+*/
+static void ipc_drain_msg(struct ipc_ctx *ipc)
+{
+	struct timespec expired = {0, 0};
+	struct mq_attr attr;
+	int count = IPC_RECV_BATCH_MAX - 1;
+	int length;
+	char *buf;
+
+	if (!ipc->ring) {
+		if (mq_getattr(ipc->mqd, &attr) < 0)
+			return;
+		if (attr.mq_curmsgs < count)
+			count = attr.mq_curmsgs;
+	}
+
+	while (count-- > 0 && !ipc->exit) {
+		buf = ipc_rx_buf(ipc);
+		if (ipc->ring)
+			length = ring_pop(ipc->ring, buf, MSG_QUEUE_MAX_SIZE, 0);
+		else
+			length = mq_timedreceive(ipc->mqd, buf,
+					MSG_QUEUE_MAX_SIZE, NULL, &expired);
+		if (length < 0) {
+			if (errno == EMSGSIZE || errno == EINTR)
+				continue;
+			break;
+		}
+		ipc->stats.recv_frames++;
+		ipc_dispatcher(ipc, buf, length);
+	}
+}
+
+/*
+* ipc_topic_throttle - check the looper backlog before reading topics
+* @ipc: ipclib structure point
+*
+* Returns 1 if topics should not be read now, ipc_free_msg_cb wakes
+* up main loop when the backlog went down.
+*/
+static int ipc_topic_throttle(struct ipc_ctx *ipc)
+{
+	if (__atomic_load_n(&ipc->inflight, __ATOMIC_RELAXED) < IPC_TOPIC_BACKLOG)
+		return 0;
+	__atomic_store_n(&ipc->topic_throttled, 1, __ATOMIC_SEQ_CST);
+	/* looper may have caught up before it could see the flag */
+	if (__atomic_load_n(&ipc->inflight, __ATOMIC_SEQ_CST) > IPC_TOPIC_BACKLOG / 2 ||
+			!__atomic_exchange_n(&ipc->topic_throttled, 0, __ATOMIC_SEQ_CST))
+		return 1;
+	return 0;
+}
+
+/**
+* ipc_topic_poll - handle messages of subscribed topics.
+* @ipc: ipclib structure point
+*
+* Each topic is read until it's empty and armed, so publishers notify
+* this endpoint again, or until IPC_RECV_BATCH_MAX messages were read
+* and the main loop is woken up to come back after other work.
+*
+* Topics are not read while the looper is behind by IPC_TOPIC_BACKLOG
+* packets, messages wait in the topic rings instead of the heap, and
+* a subscriber too slow for the ring loses the oldest ones.
+*/
+static void ipc_topic_poll(struct ipc_ctx *ipc)
+{
+	struct topic *t;
+	int budget, length, more = 0;
+	char *buf;
+
+	__atomic_store_n(&ipc->topic_pending, 0, __ATOMIC_RELAXED);
+	if (ipc_topic_throttle(ipc))
+		return;
+	pthread_mutex_lock(&ipc->topic_lock);
+	list_for_each_node_entry(t, &ipc->topics, node) {
+		if (t->sub < 0)
+			continue;
+		for (budget = IPC_RECV_BATCH_MAX; budget > 0; budget--) {
+			buf = ipc_rx_buf(ipc);
+			length = topic_read(t, buf);
+			if (length < 0) {
+				if (topic_arm(t) < 0)
+					continue;
+				break;
+			}
+			ipc->stats.recv_frames++;
+			ipc_dispatcher(ipc, buf, length);
+		}
+		if (!budget)
+			more = 1;
+	}
+	pthread_mutex_unlock(&ipc->topic_lock);
+
+	if (more) {
+		__atomic_store_n(&ipc->topic_pending, 1, __ATOMIC_RELAXED);
+		ipc_wakeup(ipc);
+	}
+}
+
+/**
+* ipc_poll_msg - handle queued frames after epoll reports them.
+* @ipc: ipclib structure point
+*
+* At most IPC_RECV_BATCH_MAX frames are taken in one round, epoll
+* is level triggered and reports the rest again. Returns 1 if the
+* round was full and more frames may be queued.
+*/
+static int ipc_poll_msg(struct ipc_ctx *ipc)
+{
+	struct timespec expired = {0, 0};
+	int count = IPC_RECV_BATCH_MAX;
+	int length;
+	char *buf;
+
+	while (count-- > 0 && !ipc->exit) {
+		buf = ipc_rx_buf(ipc);
+		if (ipc->ring)
+			length = ring_pop(ipc->ring, buf, MSG_QUEUE_MAX_SIZE, 0);
+		else
+			length = mq_timedreceive(ipc->mqd, buf,
+					MSG_QUEUE_MAX_SIZE, NULL, &expired);
+		if (length < 0) {
+			if (errno == EMSGSIZE || errno == EINTR)
+				continue;
+			break;
+		}
+		ipc->stats.recv_frames++;
+		ipc_dispatcher(ipc, buf, length);
+	}
+	if (__atomic_load_n(&ipc->topic_pending, __ATOMIC_RELAXED))
+		ipc_topic_poll(ipc);
+	ipc_batch_flush(ipc);
+	return count < 0;
+}
+
+/**
+* ipc_handle_signal - run the signal handler for every pending signal.
+*/
+static void ipc_handle_signal(void)
+{
+	struct signalfd_siginfo info;
+
+	while (read(ipc_sigfd, &info, sizeof(info)) == sizeof(info)) {
+		pr_debug("signalfd received signal:%d\n", info.ssi_signo);
+		ipc_sigfunc(info.ssi_signo);
+	}
+}
+
+/**
+* ipc_handle_event - handle a ready fd of the main loop.
+* @ipc: ipclib structure point
+* @tag: IPC_EV_* event
+*
+* Returns 1 if frames are ready to be received.
+*/
+static int ipc_handle_event(struct ipc_ctx *ipc, int tag)
+{
+	eventfd_t value;
+
+	switch (tag) {
+	case IPC_EV_QUEUE:
+		return 1;
+	case IPC_EV_WAKEUP:
+		eventfd_read(ipc->evfd, &value);
+		break;
+	case IPC_EV_TIMER:
+		timer_wheel_process(ipc->wheel);
+		break;
+	case IPC_EV_SIGNAL:
+		ipc_handle_signal();
+		break;
+	}
+	return 0;
+}
+
+/**
+* ipc_event_fd - fd watched for an IPC_EV_* event, -1 if not used
+*/
+static int ipc_event_fd(struct ipc_ctx *ipc, int tag)
+{
+	switch (tag) {
+	case IPC_EV_QUEUE:
+		return ipc->qfd;
+	case IPC_EV_WAKEUP:
+		return ipc->evfd;
+	case IPC_EV_TIMER:
+		return timer_wheel_fd(ipc->wheel);
+	case IPC_EV_SIGNAL:
+		return ipc->primary ? ipc_sigfd : -1;
+	}
+	return -1;
+}
+
+/**
+* ipc_epoll_loop - main loop of an IPC_INIT_EPOLL endpoint.
+* @ipc: ipclib structure point
+*
+* Sleeps until a frame, timer, signal or wakeup arrives, or the next
+* async call expires. Nothing is polled, ipc_stop_loop wakes it up.
+*/
+static void ipc_epoll_loop(struct ipc_ctx *ipc)
+{
+	struct epoll_event events[IPC_EPOLL_EVENTS];
+	uint64_t now, next;
+	int timeout, count, ready, i;
+
+	while (!ipc->exit) {
+		now = ipc_now_ns();
+		next = ipc_expire_calls(ipc, now);
+		timeout = next ? (next - now + 999999) / 1000000 : -1;
+		__atomic_store_n(&ipc->wait_deadline, next ? next : UINT64_MAX,
+				__ATOMIC_RELAXED);
+
+		/* frames pushed before the doorbell is armed don't ring it */
+		if (ipc->ring && ring_doorbell_arm(ipc->ring) < 0)
+			timeout = 0;
+		count = epoll_wait(ipc->epfd, events, IPC_EPOLL_EVENTS, timeout);
+		if (ipc->ring)
+			ring_doorbell_disarm(ipc->ring);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_err("epoll_wait failed, %s\n", strerror(errno));
+			return;
+		}
+
+		ready = ipc->ring != NULL || __atomic_load_n(&ipc->topic_pending, __ATOMIC_RELAXED);
+		for (i = 0; i < count; i++)
+			ready |= ipc_handle_event(ipc, events[i].data.u32);
+		if (ready)
+			ipc_poll_msg(ipc);
+	}
+}
+
+/**
+* ipc_uring_arm - queue a poll of a main loop fd.
+* @ipc: ipclib structure point
+* @tag: IPC_EV_* event
+*
+* The queue is polled one shot and armed again once it is drained,
+* a multishot poll would post a completion for every frame sent.
+* The other fds are multishot.
+*/
+static int ipc_uring_arm(struct ipc_ctx *ipc, int tag)
+{
+	int fd = ipc_event_fd(ipc, tag);
+
+	if (fd < 0)
+		return 0;
+	return uring_poll(ipc->uring, fd, POLLIN, tag != IPC_EV_QUEUE, tag);
+}
+
+/**
+* ipc_uring_timeout - make sure a timeout fires at the next deadline.
+* @ipc: ipclib structure point
+* @next: monotonic deadline in ns
+*
+* Timeouts already queued for a later deadline are left to fire,
+* they only cost a spurious wakeup.
+*/
+static void ipc_uring_timeout(struct ipc_ctx *ipc, uint64_t next)
+{
+	if (next >= ipc->uring_deadline)
+		return;
+	ipc->uring_ts.tv_sec = next / 1000000000ULL;
+	ipc->uring_ts.tv_nsec = next % 1000000000ULL;
+	ipc->uring_timeout_seq++;
+	if (uring_timeout(ipc->uring, &ipc->uring_ts, 1, IPC_EV_TIMEOUT |
+				(ipc->uring_timeout_seq << IPC_EV_TAG_BITS)) < 0)
+		return;
+	ipc->uring_deadline = next;
+}
+
+/**
+* ipc_uring_loop - main loop of an IPC_INIT_URING endpoint.
+* @ipc: ipclib structure point
+*
+* Same as ipc_epoll_loop, but the fds are watched by io_uring polls
+* and async call deadlines by io_uring timeouts. All completions of a
+* wakeup are reaped from shared memory after one io_uring_enter.
+*
+* Returns 0 when stopped, -1 if the kernel can't run it and the caller
+* should fall back to epoll.
+*/
+static int ipc_uring_loop(struct ipc_ctx *ipc)
+{
+	struct io_uring_cqe *cqe;
+	uint64_t now, next, data;
+	int wait, ready, more = 0;
+	int tag, res, flags, queue_armed = 1;
+
+	for (tag = 0; tag < IPC_EV_COUNT; tag++) {
+		if (ipc_uring_arm(ipc, tag) < 0)
+			return -1;
+	}
+	ipc->uring_deadline = UINT64_MAX;
+
+	while (!ipc->exit) {
+		now = ipc_now_ns();
+		next = ipc_expire_calls(ipc, now);
+		__atomic_store_n(&ipc->wait_deadline, next ? next : UINT64_MAX,
+				__ATOMIC_RELAXED);
+		if (next)
+			ipc_uring_timeout(ipc, next);
+
+		/* queue is not polled until drained, don't sleep on its frames */
+		wait = !more;
+		if (ipc->ring && ring_doorbell_arm(ipc->ring) < 0)
+			wait = 0;
+		res = uring_enter(ipc->uring, wait);
+		if (ipc->ring)
+			ring_doorbell_disarm(ipc->ring);
+		if (res < 0 && errno != EINTR) {
+			pr_err("io_uring_enter failed, %s\n", strerror(errno));
+			return -1;
+		}
+
+		ready = more || ipc->ring != NULL || __atomic_load_n(&ipc->topic_pending, __ATOMIC_RELAXED);
+		while ((cqe = uring_peek_cqe(ipc->uring))) {
+			data = cqe->user_data;
+			res = cqe->res;
+			flags = cqe->flags;
+			uring_cqe_seen(ipc->uring);
+
+			tag = data & ((1 << IPC_EV_TAG_BITS) - 1);
+			if (tag == IPC_EV_TIMEOUT) {
+				if ((data >> IPC_EV_TAG_BITS) == ipc->uring_timeout_seq)
+					ipc->uring_deadline = UINT64_MAX;
+				continue;
+			}
+			if (res < 0) {
+				/* multishot poll is 5.13, older kernels reject it */
+				pr_info("io_uring poll fail, %s, fall back to epoll\n",
+						strerror(-res));
+				return -1;
+			}
+			if (tag == IPC_EV_QUEUE)
+				queue_armed = 0;
+			else if (!(flags & IORING_CQE_F_MORE))
+				ipc_uring_arm(ipc, tag);
+			ready |= ipc_handle_event(ipc, tag);
+		}
+		more = ready ? ipc_poll_msg(ipc) : 0;
+		/* submitted with the next wait, completes at once if not empty */
+		if (!more && !queue_armed && !ipc_uring_arm(ipc, IPC_EV_QUEUE))
+			queue_armed = 1;
+	}
+	return 0;
+}
+
+/**
+* ipc_handle_reply - handle message reply.
+* @ipc: ipclib structure point
+* @seq: sequence number of the request
+* @reply: ipc message reply point
+*
+* Wake up the caller which is waiting for this sequence number,
+* late replies of timed out calls are dropped.
+*/
+static void ipc_handle_reply(struct ipc_ctx *ipc, uint32_t seq, struct ipc_reply *reply)
+{
+	struct list_node *head = &ipc->calls[seq % IPC_CALL_HASH_SIZE];
+	struct ipc_call *call;
+
+	pthread_mutex_lock(&ipc->lock);
+	list_for_each_node_entry(call, head, node) {
+		if (call->seq == seq && call->type == reply->type && !call->done) {
+			memcpy(&call->reply, reply, sizeof(struct ipc_reply));
+			if (call->callback) {
+				ipc_call_finish(ipc, call, 0);
+				pthread_mutex_unlock(&ipc->lock);
+				return;
+			}
+			call->done = 1;
+			pthread_cond_signal(&call->cond);
+			pthread_mutex_unlock(&ipc->lock);
+			return;
+		}
+	}
+	pthread_mutex_unlock(&ipc->lock);
+	pr_info("drop reply type:%d seq:%u, no caller waiting\n", reply->type, seq);
+}
+
+/**
+* ipc_unpack_batch - dispatch every frame of a batch.
+* @ipc: ipclib structure point
+* @payload: frames packed by sender, each 4 bytes aligned
+* @length: payload length
+*/
+static void ipc_unpack_batch(struct ipc_ctx *ipc, char *payload, int length)
+{
+	struct ipc_hdr *hdr;
+	int size;
+
+	while (length >= (int)sizeof(*hdr)) {
+		hdr = (struct ipc_hdr *)payload;
+		size = ipc_frame_size(hdr);
+		if (size > length || (hdr->flags & IPC_HDR_BATCH)) {
+			pr_err("bad batch dropped\n");
+			return;
+		}
+		ipc_dispatcher(ipc, payload, size);
+		size = (size + 3) & ~3;
+		payload += size;
+		length -= size;
+	}
+}
+
+/*
+ * ipc_source_name - resolve the endpoint id of a frame to its app name
+ *
+ * source is left empty if the app is gone, a reply would fail to
+ * find it anyway.
+ */
+static void ipc_source_name(struct ipc_ctx *ipc, uint32_t id, char *source)
+{
+	struct registry_entry entry;
+
+	if (ipc->registry && registry_get(ipc->registry, id, &entry) == 0)
+		snprintf(source, MSG_QUEUE_NAME_SIZE, "/%.*s",
+				MSG_QUEUE_NAME_SIZE - 2, entry.name);
+}
+
+/**
+* ipc_dispatcher - handle and post message.
+* @ipc: ipclib structure point
+* @frame: received frame
+* @length: frame length
+*/
+static void ipc_dispatcher(struct ipc_ctx *ipc, char *frame, int length)
+{
+	struct ipc_hdr *hdr = (struct ipc_hdr *)frame;
+	struct ipc_handler_entry *entry;
+	ipc_handler_cb handler;
+	struct ipc_packet *packet;
+	struct shmbuf_desc desc;
+	struct ipc_reply reply;
+	uint64_t start;
+	char *payload;
+	int flags;
+	int size;
+
+	if (length < sizeof(*hdr) || length != ipc_frame_size(hdr)) {
+		pr_err("bad frame dropped, length:%d\n", length);
+		return;
+	}
+	payload = frame + sizeof(*hdr) + hdr->srclen;
+
+	if (hdr->flags & IPC_HDR_BATCH) {
+		ipc_unpack_batch(ipc, payload, hdr->len);
+		return;
+	}
+
+	/*
+	* wakeup message is only used to interrupt receive wait
+	*/
+	if (hdr->type == MSG_TYPE_WAKEUP)
+		return;
+
+	/*
+	* a subscribed topic got messages, read after this round, the
+	* frame may be inside a batch in the receive buffer
+	*/
+	if (hdr->type == MSG_TYPE_TOPIC) {
+		__atomic_store_n(&ipc->topic_pending, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	/*
+	* reply message don't need to post, handle it here.
+	*/
+	if (hdr->type >= MSG_TYPE_REPLY_BASE) {
+		memset(&reply, 0, sizeof(reply));
+		reply.type = hdr->type;
+		if (hdr->len >= sizeof(int32_t)) {
+			memcpy(&reply.result, payload, sizeof(int32_t));
+			size = hdr->len - sizeof(int32_t);
+			memcpy(reply.content, payload + sizeof(int32_t),
+					size < MSG_CONTENT_SIZE ? size : MSG_CONTENT_SIZE);
+		}
+		ipc_count(ipc, recv_reply);
+		ipc_handle_reply(ipc, hdr->seq, &reply);
 		return;
 	}
 
 	/**
 	* messages except IPC_MSG_REPLY should be posted to
 	* looper thread to handle.
+	*
+	* A frame received into the spare packet is handed over as is,
+	* others (batched frames, local watchdog) are copied into one.
+	*/
+	if (ipc->rx && frame == ipc->rx->data) {
+		packet = ipc->rx;
+		ipc->rx = NULL;
+	} else {
+		packet = (struct ipc_packet *)msgpool_alloc(&ipc_packet_pool);
+		if (!packet) {
+			pr_err("ipc msg malloc fail\n");
+			/* the sender's buffer is released by nobody else */
+			if ((hdr->flags & IPC_HDR_SHMBUF) && hdr->len == sizeof(desc)) {
+				memcpy(&desc, payload, sizeof(desc));
+				shmbuf_drop(&desc);
+			}
+			return;
+		}
+		memcpy(packet->data, frame, length);
+		frame = packet->data;
+		payload = frame + sizeof(*hdr) + hdr->srclen;
+	}
+	memset(packet, 0, offsetof(struct ipc_packet, data));
+	memcpy(&packet->hdr, hdr, sizeof(*hdr));
+	packet->ipc = ipc;
+	packet->magic = IPC_PACKET_MAGIC;
+	packet->msg.type = hdr->type;
+	if (hdr->flags & IPC_HDR_SOURCE)
+		snprintf(packet->msg.source, MSG_QUEUE_NAME_SIZE, "/%.*s",
+				hdr->srclen, frame + sizeof(*hdr));
+	else if (hdr->flags & IPC_HDR_SOURCE_ID)
+		ipc_source_name(ipc, hdr->source, packet->msg.source);
+
+	if (hdr->flags & IPC_HDR_SHMBUF) {
+		/*
+		* payload stays in sender's pool, released in ipc_free_msg_cb.
+		* A malformed descriptor can't be trusted, the buffer it
+		* refers to stays referenced until the sender restarts.
+		*/
+		if (hdr->len != sizeof(packet->desc)) {
+			pr_err("bad shm descriptor dropped\n");
+			msgpool_free(&ipc_packet_pool, packet);
+			return;
+		}
+		memcpy(&packet->desc, payload, sizeof(packet->desc));
+		payload = shmbuf_map(&packet->desc, &packet->pool);
+		if (!payload) {
+			msgpool_free(&ipc_packet_pool, packet);
+			return;
+		}
+		packet->length = packet->desc.length;
+	} else {
+		packet->length = hdr->len;
+	}
+
+	memcpy(packet->msg.content, payload,
+			packet->length < MSG_CONTENT_SIZE ? packet->length : MSG_CONTENT_SIZE);
+	packet->payload = payload;
+
+	/*
+	* internal messages like the watchdog are neither counted nor
+	* measured
+	*/
+	if (hdr->type < MSG_TYPE_WATCHDOG)
+		ipc_count(ipc, recv_request);
+	if (hdr->type < MSG_TYPE_WATCHDOG &&
+			__atomic_load_n(&ipc_latency_on, __ATOMIC_RELAXED)) {
+		packet->recv_ns = ipc_now_ns();
+		if (hdr->flags & IPC_HDR_STAMP) {
+			memcpy(&packet->sent_ns, frame + length - IPC_STAMP_SIZE,
+					IPC_STAMP_SIZE);
+			ipc_latency_record(ipc, hdr->type, IPC_HOP_TRANSIT,
+					packet->sent_ns, packet->recv_ns);
+		}
+	}
+
+	/*
+	* flags are stored before the handler, so they are read after it,
+	* and again if the handler was replaced in between
 	*/
-	data = (struct ipc_msg *)malloc(sizeof(*data));
-	if (!data) {
-		pr_err("ipc msg malloc fail\n");
+	entry = &ipc->handlers[hdr->type];
+	do {
+		handler = __atomic_load_n(&entry->handler, __ATOMIC_ACQUIRE);
+		flags = __atomic_load_n(&entry->flags, __ATOMIC_ACQUIRE);
+	} while (handler != __atomic_load_n(&entry->handler, __ATOMIC_ACQUIRE));
+	if (handler && (flags & IPC_HANDLER_INLINE)) {
+		start = packet->recv_ns ? ipc_now_ns() : 0;
+		handler(&packet->msg);
+		if (start)
+			ipc_latency_handled(packet, start, 0);
+		ipc_packet_free(packet);
 		return;
 	}
-	memcpy(data, (void *)msg, sizeof(struct ipc_msg));
-	ipc->looper->dispatch(ipc->looper, (void *)data);
+	ipc->batch[ipc->batch_count++] = packet;
+	if (ipc->batch_count == IPC_RECV_BATCH_MAX)
+		ipc_batch_flush(ipc);
+}
+
+/*
+* ipc_msg_payload - get the payload of a received message
+* @msg: message handed to msg_handler
+* @len: store payload length
+*/
+void *ipc_msg_payload(struct ipc_msg *msg, int *len)
+{
+	struct ipc_packet *packet = (struct ipc_packet *)msg;
+
+	if (len)
+		*len = packet->length;
+	return packet->payload;
+}
+
+/*
+* ipc_msg_hdr - get the frame header of a received message
+* @msg: message handed to msg_handler
+*/
+const struct ipc_hdr *ipc_msg_hdr(struct ipc_msg *msg)
+{
+	return &((struct ipc_packet *)msg)->hdr;
 }
 
 /**
 * ipc_free_msg_cb - message free callback used by looper.
-* @data: message point which malloced in ipc_dispatcher()
+* @data: message point which allocated in ipc_dispatcher()
 *
 * This callback should set to looper, so looper will free message
 * memory after using it.
 */
 static void ipc_free_msg_cb(void *data)
 {
-	if (data)
-		free(data);
+	struct ipc_packet *packet = (struct ipc_packet *)data;
+	struct ipc_ctx *ipc;
+
+	if (!packet)
+		return;
+	ipc = packet->ipc;
+	ipc_packet_free(packet);
+
+	/* backlog is low enough again, read throttled topics */
+	if (__atomic_sub_fetch(&ipc->inflight, 1, __ATOMIC_RELAXED) <= IPC_TOPIC_BACKLOG / 2 &&
+			__atomic_load_n(&ipc->topic_throttled, __ATOMIC_RELAXED) &&
+			__atomic_exchange_n(&ipc->topic_throttled, 0, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&ipc->topic_pending, 1, __ATOMIC_RELAXED);
+		ipc_wakeup(ipc);
+	}
+}
+
+/*
+* ipc_packet_free - release a packet and its shared memory buffer
+*/
+static void ipc_packet_free(struct ipc_packet *packet)
+{
+	packet->magic = 0;
+	if (packet->pool)
+		shmbuf_release(packet->pool, &packet->desc);
+	msgpool_free(&ipc_packet_pool, packet);
+}
+
+/*
+* ipc_msg_handler - looper handler of received messages
+* @data: message point which allocated in ipc_dispatcher()
+*
+* Runs the handler registered for the type, or the handler of
+* ipc_init for types without one.
+*/
+static void ipc_msg_handler(void *data)
+{
+	struct ipc_packet *packet = (struct ipc_packet *)data;
+	struct ipc_ctx *ipc = packet->ipc;
+	ipc_handler_cb handler;
+	uint64_t start;
+
+	handler = __atomic_load_n(&ipc->handlers[packet->hdr.type].handler,
+			__ATOMIC_ACQUIRE);
+	start = packet->recv_ns ? ipc_now_ns() : 0;
+	if (handler)
+		handler(&packet->msg);
+	else if (ipc->handler)
+		ipc->handler(data);
+	else
+		pr_err("no handler for message type:%d\n", packet->msg.type);
+	if (start)
+		ipc_latency_handled(packet, start, 1);
+}
+
+/*
+* ipc_register_handler - handle a range of message types with a handler
+* @first: first type, 0 .. MSG_TYPE_REPLY_BASE - 1
+* @last: last type, equal to first for one type
+* @handler: NULL removes a registration
+* @flags: IPC_HANDLER_* flags
+*/
+int ipc_register_handler(int first, int last, ipc_handler_cb handler, int flags)
+{
+	return ipc_ctx_register_handler(ipclib, first, last, handler, flags);
+}
+
+/*
+* ipc_ctx_register_handler - ipc_register_handler of a context
+*/
+int ipc_ctx_register_handler(struct ipc_ctx *ctx, int first, int last,
+				ipc_handler_cb handler, int flags)
+{
+	struct ipc_handler_entry *entry;
+	int type;
+
+	if (!ctx) {
+		pr_err("should init first!\n");
+		return -1;
+	}
+	if (first < 0 || last < first || last >= MSG_TYPE_REPLY_BASE) {
+		pr_err("invalid handler types:%d-%d\n", first, last);
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (type = first; type <= last; type++) {
+		entry = &ctx->handlers[type];
+		/*
+		* clear the handler first, so a reader never runs a new
+		* handler with the flags of the old one, ipc_dispatcher
+		* reads them in the reverse order
+		*/
+		__atomic_store_n(&entry->handler, NULL, __ATOMIC_RELEASE);
+		__atomic_store_n(&entry->flags, handler ? flags : 0, __ATOMIC_RELEASE);
+		__atomic_store_n(&entry->handler, handler, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+/*
+* ipc_msg_prio - looper priority of a received message
+* @data: message point which allocated in ipc_dispatcher()
+*/
+static int ipc_msg_prio(void *data)
+{
+	struct ipc_packet *packet = (struct ipc_packet *)data;
+
+	return IPC_HDR_GET_PRIO(packet->hdr.flags);
+}
+
+/*
+* ipc_msg_entity - looper entity embedded in a received message
+*/
+static struct msg_entity *ipc_msg_entity(void *data)
+{
+	return &((struct ipc_packet *)data)->entity;
+}
+
+static void ipc_packet_pool_init(void)
+{
+	msgpool_init(&ipc_packet_pool, "ipc packet", sizeof(struct ipc_packet),
+			IPC_PACKET_CACHE, IPC_PACKET_FREE_MAX);
+}
+
+/*
+* ipc_msg_tag - message type logged when its handler stalls
+*/
+static uint32_t ipc_msg_tag(void *data)
+{
+	struct ipc_packet *packet = (struct ipc_packet *)data;
+
+	return packet->msg.type;
 }
 
 /**
@@ -479,19 +2563,41 @@ static void ipc_free_msg_cb(void *data)
 */
 void ipc_main_loop(void)
 {
-	struct ipc_msg *msg;
+	ipc_ctx_run(ipclib);
+}
 
-	if (!ipclib) {
+/*
+* ipc_ctx_run - receive and dispatch messages of a context
+* @ctx: context
+*/
+void ipc_ctx_run(struct ipc_ctx *ctx)
+{
+	char *frame;
+	int length;
+
+	if (!ctx) {
 		pr_err("should init first!\n");
 		return;
 	}
-	if (ipc_watchdog_start() < 0) {
+	if (ctx->primary && ipc_watchdog_start() < 0) {
 		pr_err("watchdog start fail!\n");
 		return;
 	}
 
-	while (ipc_receive_msg(ipclib, &msg) > 0){
-		ipc_dispatcher(ipclib, msg);
+	if (ctx->epfd >= 0) {
+		if (ctx->uring && !ipc_uring_loop(ctx))
+			return;
+		ipc_epoll_loop(ctx);
+		return;
+	}
+
+	while ((length = ipc_receive_msg(ctx, &frame)) > 0){
+		ctx->stats.recv_frames++;
+		ipc_dispatcher(ctx, frame, length);
+		ipc_drain_msg(ctx);
+		if (__atomic_load_n(&ctx->topic_pending, __ATOMIC_RELAXED))
+			ipc_topic_poll(ctx);
+		ipc_batch_flush(ctx);
 	}
 
 	/**
@@ -504,61 +2610,391 @@ void ipc_main_loop(void)
 */
 void ipc_stop_loop(void)
 {
-	if (!ipclib) {
+	ipc_ctx_stop(ipclib);
+}
+
+/*
+* ipc_ctx_stop - make ipc_ctx_run return
+* @ctx: context
+*/
+void ipc_ctx_stop(struct ipc_ctx *ctx)
+{
+	if (!ctx) {
 		pr_err("should init first!\n");
 		return;
 	}
-	ipclib->exit = 1;
+	ctx->exit = 1;
+	if (ctx->evfd >= 0)
+		ipc_wakeup(ctx);
 }
 
+/*
+* ipc_default_ctx - the context of ipc_init, NULL before it
+*/
+struct ipc_ctx *ipc_default_ctx(void)
+{
+	return ipclib;
+}
 
 /*
-* ipc_init - ipclib initialize
-* Applications should call this function before using ipc_mainloop and ipc_deinit
+* ipc_msg_ctx - the context which received a message
+* @msg: message handed to a handler
+*/
+struct ipc_ctx *ipc_msg_ctx(struct ipc_msg *msg)
+{
+	struct ipc_packet *packet = (struct ipc_packet *)msg;
+
+	if (__atomic_load_n(&packet->magic, __ATOMIC_RELAXED) != IPC_PACKET_MAGIC)
+		return NULL;
+	return packet->ipc;
+}
+
+/*
+* ipc_epoll_add - watch a fd in the epoll main loop
+* @ipc: ipclib structure point
+* @fd: fd to watch for input
+* @tag: IPC_EV_* event
+*/
+static int ipc_epoll_add(struct ipc_ctx *ipc, int fd, int tag)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = tag;
+	if (epoll_ctl(ipc->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		pr_err("epoll_ctl fail, %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+* ipc_epoll_init - create epoll, wakeup eventfd and timer wheel
+* @ipc: ipclib structure point, queue or ring must be created
+*/
+static int ipc_epoll_init(struct ipc_ctx *ipc)
+{
+	int tag, fd;
+
+	ipc->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ipc->epfd < 0) {
+		pr_err("epoll_create fail, %s\n", strerror(errno));
+		return -1;
+	}
+	ipc->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ipc->evfd < 0) {
+		pr_err("eventfd fail, %s\n", strerror(errno));
+		return -1;
+	}
+	ipc->wheel = timer_wheel_create(TIMER_WHEEL_TICK_US, TIMER_WHEEL_SLACK_US);
+	if (!ipc->wheel)
+		return -1;
+
+	/* a ring has no fd, producers ring its doorbell queue instead */
+	ipc->qfd = ipc->ring ? ring_doorbell(ipc->ring) : ipc->mqd;
+	if (ipc->qfd < 0)
+		return -1;
+	for (tag = 0; tag < IPC_EV_COUNT; tag++) {
+		fd = ipc_event_fd(ipc, tag);
+		if (fd >= 0 && ipc_epoll_add(ipc, fd, tag) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+* ipc_uring_init - set up io_uring for the main loop
+* @ipc: ipclib structure point, epoll must be inited
 *
-* @name: app name
-* @handler: data handle callback in looper thread
+* Epoll stays ready as fall back when the kernel lacks io_uring.
 */
-int ipc_init(char *name, msg_handler handler)
+static void ipc_uring_init(struct ipc_ctx *ipc)
+{
+	ipc->uring = (struct uring *)malloc(sizeof(struct uring));
+	if (!ipc->uring) {
+		pr_err("io_uring malloc fail\n");
+		return;
+	}
+	if (uring_init(ipc->uring, IPC_URING_ENTRIES) < 0) {
+		pr_info("io_uring not available, %s, use epoll\n", strerror(errno));
+		free(ipc->uring);
+		ipc->uring = NULL;
+	}
+}
+
+/*
+* ipc_timer_wheel - timer wheel processed by the epoll main loop
+*/
+struct timer_wheel *ipc_timer_wheel(void)
 {
-	struct ipc_lib *ipc;
+	return ipclib ? ipclib->wheel : NULL;
+}
 
+/*
+* ipc_signal_init - handle signals in the epoll main loop
+* @func: called in main loop thread with the signal number
+*/
+int ipc_signal_init(sigfunc func)
+{
 	if (ipclib) {
-		pr_info("ipclib already inited\n");
-		return 0;
+		pr_err("should be called before ipc_init\n");
+		return -1;
+	}
+	if (ipc_sigfd < 0) {
+		ipc_sigfd = set_signal_fd();
+		if (ipc_sigfd < 0)
+			return -1;
+	}
+	ipc_sigfunc = func;
+	return 0;
+}
+
+
+/*
+* ipc_ctx_get_shared - take a reference of the process wide state
+*
+* The first context opens the registry, the cache of peers follows
+* it. Returns the registry, NULL if it's not available.
+*/
+static struct registry *ipc_ctx_get_shared(void)
+{
+	struct registry *reg;
+
+	pthread_mutex_lock(&ipc_ctx_lock);
+	if (!ipc_ctx_count++) {
+		ipc_registry = registry_open();
+		if (ipc_registry) {
+			registry_prune(ipc_registry);
+			peer_registry_set(ipc_registry);
+		}
+	}
+	reg = ipc_registry;
+	pthread_mutex_unlock(&ipc_ctx_lock);
+	return reg;
+}
+
+/*
+* ipc_ctx_put_shared - drop the reference of ipc_ctx_get_shared
+*
+* The last context closes cached peers and shm pools.
+*/
+static void ipc_ctx_put_shared(void)
+{
+	pthread_mutex_lock(&ipc_ctx_lock);
+	if (!--ipc_ctx_count) {
+		stall_monitor_stop();
+		peer_table_clear();
+		peer_registry_set(NULL);
+		registry_close(ipc_registry);
+		ipc_registry = NULL;
+		shmbuf_cache_clear();
 	}
+	pthread_mutex_unlock(&ipc_ctx_lock);
+}
+
+/*
+* ipc_ctx_init - create the endpoint of a context and start its looper
+* @name: app name
+* @looper: looper or looper pool which handles messages
+* @flags: IPC_INIT_* options
+* @primary: 1 for the default context
+*/
+static struct ipc_ctx *ipc_ctx_init(char *name, struct looper *looper, int flags,
+				int primary)
+{
+	char path[RING_NAME_SIZE];
+	pthread_mutexattr_t attr;
+	int i, ret;
+
+	struct ipc_ctx *ipc;
 
-	ipc = (struct ipc_lib *) malloc(sizeof(struct ipc_lib));
+	ipc = (struct ipc_ctx *) malloc(sizeof(struct ipc_ctx));
 	if (!ipc)
 		err_exit("malloc fail!\n");
 
-	memset(ipc, 0, sizeof(struct ipc_lib));
+	memset(ipc, 0, sizeof(struct ipc_ctx));
+	pthread_once(&ipc_packet_once, ipc_packet_pool_init);
+	ipc->flags = flags;
+	ipc->primary = primary;
+	ipc->epfd = -1;
+	ipc->evfd = -1;
+	ipc->qfd = -1;
+	ipc->id = peer_hash(name);
 	pthread_mutex_init(&ipc->lock, NULL);
-	pthread_cond_init(&ipc->condition, NULL);
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&ipc->topic_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	INIT_LIST_NODE(&ipc->topics);
+	for (i = 0; i < IPC_CALL_HASH_SIZE; i++)
+		INIT_LIST_NODE(&ipc->calls[i]);
+	INIT_LIST_NODE(&ipc->timeouts);
 
 	/* fill msg queue path*/
 	snprintf(ipc->name, MSG_QUEUE_NAME_SIZE, "/%s", name);
-	pr_info("create posix message queue at:%s\n", ipc->name);
+	snprintf(path, RING_NAME_SIZE, "/%s.ring", name);
+
+	ipc->msgsize = ipc_queue_msgsize ? ipc_queue_msgsize : MSG_QUEUE_MAX_SIZE;
+	if (flags & IPC_INIT_RING) {
+		/* remove queue left by an old mqueue endpoint with the same name */
+		mq_unlink(ipc->name);
+		ipc->mqd = (mqd_t)-1;
+		ipc->ring = ring_create(path, ipc_queue_maxmsg ? ipc_queue_maxmsg :
+				RING_DEFAULT_SLOTS, ipc->msgsize);
+		if (!ipc->ring)
+			err_exit("create ring fail!\n");
+		ipc->maxmsg = ipc->ring->hdr->slots;
+	} else {
+		shm_unlink(path);
+		pr_info("create posix message queue at:%s\n", ipc->name);
+
+		/* create msg queue */
+		ipc->maxmsg = ipc_queue_maxmsg ? ipc_queue_maxmsg : IPC_QUEUE_MAXMSG;
+		if (ipc_mq_attr_check(ipc->maxmsg, ipc->msgsize) < 0)
+			err_exit("message queue attr over system limit!\n");
+		ipc->mqd = mq_rw_create(ipc->name, ipc->maxmsg, ipc->msgsize);
+		if (ipc->mqd < 0)
+			err_exit("create message queue fail!\n");
+	}
 
-	/* create msg queue */
-	ipc->mqd = mq_rw_create(ipc->name, MSG_QUEUE_MAX_SIZE);
-	if (ipc->mqd < 0)
-		err_exit("create message queue fail!\n");
+	if ((flags & (IPC_INIT_EPOLL | IPC_INIT_URING)) && ipc_epoll_init(ipc) < 0)
+		err_exit("epoll main loop init fail!\n");
+	if (flags & IPC_INIT_URING)
+		ipc_uring_init(ipc);
 
-	/* create looper */
-	ipc->looper = looper_create(handler, ipc_free_msg_cb, name);
-	if (ipc->looper < 0)
-		err_exit("create looper fail!\n");
+	/*
+	 * Register once the transport exists. Without the registry the
+	 * endpoint still works, senders fall back to probe its transport.
+	 */
+	ipc->registry = ipc_ctx_get_shared();
+	if (ipc->registry) {
+		ret = registry_register(ipc->registry, name,
+				ipc->ring ? REGISTRY_RING : REGISTRY_MQUEUE, flags);
+		if (ret > 0) {
+			ipc->reg_id = ret;
+			ipc->id = ret;
+		}
+	}
+
+	/* registered handlers go first, then the handler of looper */
+	ipc->handlers = (struct ipc_handler_entry *)calloc(MSG_TYPE_REPLY_BASE,
+			sizeof(struct ipc_handler_entry));
+	if (!ipc->handlers)
+		err_exit("handler table malloc fail!\n");
+	ipc->latency = (struct hist **)calloc(MSG_TYPE_REPLY_BASE, sizeof(struct hist *));
+	if (!ipc->latency)
+		err_exit("latency table malloc fail!\n");
+	ipc->handler = looper->loop_cb;
+	looper->loop_cb = ipc_msg_handler;
+
+	/* messages are freed by ipclib after handler returns */
+	looper->free_cb = ipc_free_msg_cb;
+	looper->prio_cb = ipc_msg_prio;
+	looper->tag_cb = ipc_msg_tag;
+	looper->entity_cb = ipc_msg_entity;
+	ipc->looper = looper;
 
 	/* start looper to handle message in looper thread */
 	if (ipc->looper->start(ipc->looper) < 0)
 		err_exit("looper start fail!\n");
+	return ipc;
+}
+
+/*
+* ipc_init_looper - ipclib initialize with a looper created by application
+* Applications should call this function before using ipc_mainloop and ipc_deinit
+*
+* @name: app name
+* @looper: looper or looper pool which handles messages
+* @flags: IPC_INIT_* options
+*/
+int ipc_init_looper(char *name, struct looper *looper, int flags)
+{
+	if (ipclib) {
+		pr_info("ipclib already inited\n");
+		return 0;
+	}
+	if (looper->loop_cb == ipc_msg_handler) {
+		pr_err("looper already used by a context\n");
+		errno = EBUSY;
+		return -1;
+	}
 
 	/* set ipc to global point variable ipclib */
-	ipclib = ipc;
+	ipclib = ipc_ctx_init(name, looper, flags, 1);
 	return 0;
 }
 
+/*
+* ipc_init_ex - ipclib initialize with endpoint options
+* Applications should call this function before using ipc_mainloop and ipc_deinit
+*
+* @name: app name
+* @handler: data handle callback in looper thread
+* @flags: IPC_INIT_* options
+*/
+int ipc_init_ex(char *name, msg_handler handler, int flags)
+{
+	struct looper *looper;
+
+	if (ipclib) {
+		pr_info("ipclib already inited\n");
+		return 0;
+	}
+
+	/* create looper */
+	looper = looper_create(handler, ipc_free_msg_cb, name);
+	if (!looper)
+		err_exit("create looper fail!\n");
+	return ipc_init_looper(name, looper, flags);
+}
+
+/*
+* ipc_init - ipclib initialize with POSIX message queue transport
+*
+* @name: app name
+* @handler: data handle callback in looper thread
+*/
+int ipc_init(char *name, msg_handler handler)
+{
+	return ipc_init_ex(name, handler, 0);
+}
+
+/*
+* ipc_ctx_create - create an endpoint context
+* @name: app name of the context
+* @handler: data handle callback in looper thread of the context
+* @flags: IPC_INIT_* flags
+*/
+struct ipc_ctx *ipc_ctx_create(char *name, msg_handler handler, int flags)
+{
+	struct looper *looper;
+
+	looper = looper_create(handler, ipc_free_msg_cb, name);
+	if (!looper)
+		err_exit("create looper fail!\n");
+	return ipc_ctx_init(name, looper, flags, 0);
+}
+
+/*
+* ipc_ctx_create_looper - create an endpoint context with a looper
+* created by application
+* @name: app name of the context
+* @looper: looper handling messages
+* @flags: IPC_INIT_* flags
+*/
+struct ipc_ctx *ipc_ctx_create_looper(char *name, struct looper *looper, int flags)
+{
+	/* its handler would be replaced by our own */
+	if (looper->loop_cb == ipc_msg_handler) {
+		pr_err("looper already used by a context\n");
+		errno = EBUSY;
+		return NULL;
+	}
+	return ipc_ctx_init(name, looper, flags, 0);
+}
+
 /*
 * ipc_deinit - ipclib de-initialize
 * Applications should call this function when exit
@@ -567,14 +3003,68 @@ void ipc_deinit(void)
 {
 	if (!ipclib) {
 		pr_info("ipclib doesn't need to deinit\n");
+		return;
 	}
 	/* remove timers */
 	ipc_watchdog_remove();
-	/* destory looper */
-	looper_destory(ipclib->looper);
-	/* delete msg queue */
-	mq_unlink(ipclib->name);
-	/* free ipclib  */
-	free(ipclib);
+	ipc_ctx_destroy(ipclib);
 	ipclib = NULL;
 }
+
+/*
+* ipc_ctx_destroy - stop a context and remove its endpoint
+* @ctx: context, its main loop must have returned
+*/
+void ipc_ctx_destroy(struct ipc_ctx *ctx)
+{
+	struct ipc_ctx *ipc = ctx;
+	struct topic *t;
+	int i;
+
+	if (!ipc)
+		return;
+	/* senders learn at once that this app is gone */
+	if (ipc->reg_id)
+		registry_unregister(ipc->registry, ipc->reg_id);
+	if (ipc->uring) {
+		uring_exit(ipc->uring);
+		free(ipc->uring);
+	}
+	if (ipc->epfd >= 0) {
+		timer_wheel_destroy(ipc->wheel);
+		close(ipc->evfd);
+		close(ipc->epfd);
+	}
+	/* destory looper */
+	looper_destory(ipc->looper);
+	ipc_cancel_calls(ipc);
+	if (ipc->heartbeat) {
+		heartbeat_unregister(ipc->heartbeat, ipc->heartbeat_slot);
+		heartbeat_close(ipc->heartbeat);
+		ipc->heartbeat = NULL;
+	}
+	msgpool_free(&ipc_packet_pool, ipc->rx);
+	free(ipc->handlers);
+	for (i = 0; i < MSG_TYPE_REPLY_BASE; i++)
+		free(ipc->latency[i]);
+	free(ipc->latency);
+	/* unsubscribe and unmap topics */
+	while (!list_is_empty(&ipc->topics)) {
+		t = list_node_entry(ipc->topics.next, struct topic, node);
+		list_node_del(&t->node);
+		topic_close(t);
+	}
+	shmbuf_pool_destroy(ipc->pool);
+	/* delete msg queue or ring */
+	if (ipc->ring) {
+		ring_destroy(ipc->ring);
+	} else {
+		mq_close(ipc->mqd);
+		mq_unlink(ipc->name);
+	}
+	pthread_mutex_destroy(&ipc->lock);
+	pthread_mutex_destroy(&ipc->topic_lock);
+	free(ipc);
+	/* close cached peers and shm pools with the last context */
+	ipc_ctx_put_shared();
+}
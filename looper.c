@@ -33,41 +33,358 @@
 #include <errno.h>
 #include <string.h>
 #include "looper.h"
+#include "futex.h"
+#include "msgpool.h"
 #include "debug.h"
 
-static void *looper_loop(void *private)
+/* messages a level may run before waiting lower levels get a turn */
+#define LOOPER_PRIO_WEIGHT(level) (1U << ((level) * 2))
+/* max messages moved from the lock-free inbox at a time */
+#define LOOPER_DRAIN_MAX 64
+/* entities a thread caches, and kept free for all loopers */
+#define LOOPER_ENTITY_CACHE 64
+#define LOOPER_ENTITY_FREE_MAX 4096
+
+static struct msgpool looper_entity_pool;
+static pthread_once_t looper_entity_once = PTHREAD_ONCE_INIT;
+
+static void looper_entity_pool_init(void)
+{
+	msgpool_init(&looper_entity_pool, "looper entity", sizeof(struct msg_entity),
+			LOOPER_ENTITY_CACHE, LOOPER_ENTITY_FREE_MAX);
+}
+
+static void looper_runq_init(struct looper_runq *q)
+{
+	int i;
+
+	for (i = 0; i < LOOPER_PRIO_LEVELS; i++) {
+		INIT_LIST_NODE(&q->level[i]);
+		q->credit[i] = LOOPER_PRIO_WEIGHT(i);
+	}
+	q->mask = 0;
+	q->credit_mask = (1U << LOOPER_PRIO_LEVELS) - 1;
+	q->count = 0;
+}
+
+static void looper_runq_add(struct looper_runq *q, struct msg_entity *msg)
+{
+	list_node_add_tail(&msg->node, &q->level[msg->prio]);
+	q->mask |= 1U << msg->prio;
+	q->count++;
+}
+
+/*
+* looper_runq_top - highest level which is not empty, -1 if none
+*/
+static int looper_runq_top(uint32_t mask)
+{
+	return mask ? 31 - __builtin_clz(mask) : -1;
+}
+
+/*
+* looper_runq_take - take next message by priority and credit
+*/
+static struct msg_entity *looper_runq_take(struct looper_runq *q)
+{
+	struct msg_entity *msg;
+	uint32_t ready;
+	int level, i;
+
+	if (!q->mask)
+		return NULL;
+
+	ready = q->mask & q->credit_mask;
+	if (!ready) {
+		/* every waiting level used its credit, start a new round */
+		for (i = 0; i < LOOPER_PRIO_LEVELS; i++)
+			q->credit[i] = LOOPER_PRIO_WEIGHT(i);
+		q->credit_mask = (1U << LOOPER_PRIO_LEVELS) - 1;
+		ready = q->mask;
+	}
+	level = looper_runq_top(ready);
+	if (--q->credit[level] == 0)
+		q->credit_mask &= ~(1U << level);
+
+	msg = list_node_entry(q->level[level].next, struct msg_entity, node);
+	list_node_del(&msg->node);
+	if (list_is_empty(&q->level[level]))
+		q->mask &= ~(1U << level);
+	q->count--;
+	return msg;
+}
+
+/*
+* looper_runq_drain - move messages from a lock-free inbox to run queue
+*/
+static void looper_runq_drain(struct looper_runq *q, struct mpsc_queue *inbox)
+{
+	struct mpsc_node *node;
+	int count = LOOPER_DRAIN_MAX;
+
+	while (count-- > 0 && (node = mpsc_pop(inbox)) != NULL)
+		looper_runq_add(q, list_node_entry(node, struct msg_entity, qnode));
+}
+
+static uint64_t looper_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+* looper_timer_before - heap order, earlier deadline first, then
+* earlier id so timers due at the same time keep their order
+*/
+static bool looper_timer_before(struct msg_entity *a, struct msg_entity *b)
+{
+	if (a->deadline != b->deadline)
+		return a->deadline < b->deadline;
+	return a->timer_id < b->timer_id;
+}
+
+static void looper_timer_sift_up(struct msg_entity **heap, int i)
+{
+	struct msg_entity *msg = heap[i];
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!looper_timer_before(msg, heap[parent]))
+			break;
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = msg;
+}
+
+static void looper_timer_sift_down(struct msg_entity **heap, int count, int i)
+{
+	struct msg_entity *msg = heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < count) {
+		if (child + 1 < count && looper_timer_before(heap[child + 1], heap[child]))
+			child++;
+		if (!looper_timer_before(heap[child], msg))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = msg;
+}
+
+/*
+* looper_timer_remove - remove timers[i] from the heap, lock held
+*/
+static void looper_timer_remove(struct looper *looper, int i)
+{
+	struct msg_entity **heap = looper->timers;
+	int count = --looper->timer_count;
+
+	if (i < count) {
+		heap[i] = heap[count];
+		looper_timer_sift_down(heap, count, i);
+		looper_timer_sift_up(heap, i);
+	}
+	__atomic_store_n(&looper->next_deadline,
+			count ? heap[0]->deadline : UINT64_MAX, __ATOMIC_SEQ_CST);
+}
+
+/*
+* looper_timer_expire - take delayed messages which are due, lock held
+* @looper: looper
+* @now: monotonic time in ns
+* @msg: store due entities in deadline order
+* @max: size of msg
+*/
+static int looper_timer_expire(struct looper *looper, uint64_t now,
+					struct msg_entity **msg, int max)
+{
+	int n = 0;
+
+	while (n < max && looper->timer_count && looper->timers[0]->deadline <= now) {
+		msg[n++] = looper->timers[0];
+		looper_timer_remove(looper, 0);
+	}
+	return n;
+}
+
+/*
+* looper_timer_due - check if a delayed message is due without lock
+*/
+static bool looper_timer_due(struct looper *looper)
+{
+	uint64_t deadline = __atomic_load_n(&looper->next_deadline, __ATOMIC_SEQ_CST);
+
+	return deadline != UINT64_MAX && deadline <= looper_now_ns();
+}
+
+/*
+* looper_timer_wait - relative time until next delayed message
+*
+* Returns NULL if there is no delayed message.
+*/
+static struct timespec *looper_timer_wait(struct looper *looper, struct timespec *ts)
+{
+	uint64_t deadline = __atomic_load_n(&looper->next_deadline, __ATOMIC_SEQ_CST);
+	uint64_t now;
+
+	if (deadline == UINT64_MAX)
+		return NULL;
+	now = looper_now_ns();
+	deadline = deadline > now ? deadline - now : 0;
+	ts->tv_sec = deadline / 1000000000ULL;
+	ts->tv_nsec = deadline % 1000000000ULL;
+	return ts;
+}
+
+/*
+* looper_take_due - move due delayed messages to a run queue
+*/
+static void looper_take_due(struct looper *looper, struct looper_runq *q)
+{
+	struct msg_entity *msg[LOOPER_DRAIN_MAX];
+	int i, n;
+
+	if (!looper_timer_due(looper))
+		return;
+	pthread_mutex_lock(&looper->lock);
+	n = looper_timer_expire(looper, looper_now_ns(), msg, LOOPER_DRAIN_MAX);
+	pthread_mutex_unlock(&looper->lock);
+	for (i = 0; i < n; i++)
+		looper_runq_add(q, msg[i]);
+}
+
+/*
+* looper_take_locked - wait for next message from the mutex list
+*
+* Returns NULL when the looper is stopped.
+*/
+static struct msg_entity *looper_take_locked(struct looper *looper)
 {
-	struct looper *looper = (struct looper *)private;
 	struct list_node *head = &looper->head;
-	struct list_node *node;
+	struct msg_entity *due[LOOPER_DRAIN_MAX];
 	struct msg_entity *msg;
+	struct timespec ts;
+	uint64_t deadline;
+	bool running;
+	int i, n;
 
-	pr_info("looper start, name: %s\n", looper->name);
-	while(looper->running){
-		pthread_mutex_lock(&looper->lock);
-		if (list_is_empty(head)){
+	pthread_mutex_lock(&looper->lock);
+	for (;;) {
+		if (looper->timer_count) {
+			n = looper_timer_expire(looper, looper_now_ns(), due, LOOPER_DRAIN_MAX);
+			for (i = 0; i < n; i++) {
+				due[i]->msg_id = looper->msg_id++;
+				looper_runq_add(&looper->runq, due[i]);
+			}
+		}
+		while (!list_is_empty(head)) {
+			msg = list_node_entry(head->next, struct msg_entity, node);
+			list_node_del(&msg->node);
+			looper_runq_add(&looper->runq, msg);
+		}
+		if (!looper->running || looper->runq.count)
+			break;
+		/*
+		* There are three conditions to get waken up:
+		* first, list state changed from empty to nonempty
+		* second, a delayed message is due or an earlier one is added
+		* third, someone calls looper_stop to stop the looper
+		* So, needs to re-check "running" state every time.
+		*/
+		if (looper->timer_count) {
+			deadline = looper->timers[0]->deadline;
+			ts.tv_sec = deadline / 1000000000ULL;
+			ts.tv_nsec = deadline % 1000000000ULL;
+			pthread_cond_timedwait(&looper->condition, &looper->lock, &ts);
+		} else {
 			pthread_cond_wait(&looper->condition, &looper->lock);
-			pthread_mutex_unlock(&looper->lock);
-			/*
-			* There are two conditions to get here:
-			* first, list state changed from empty to nonempty
-			* second, someone calls looper_stop to stop the looper
-			* So, needs to re-check "running" state when thread is
-			* waken up, "continue" will do this job.
-			*/
+		}
+	}
+	running = looper->running;
+	pthread_mutex_unlock(&looper->lock);
+
+	return running ? looper_runq_take(&looper->runq) : NULL;
+}
+
+/*
+* looper_take_lockfree - wait for next message from the lock-free queue
+*
+* Producers check "sleeping" after their push is complete, so setting
+* it and retrying the queue once is enough to never miss a wakeup.
+*/
+static struct msg_entity *looper_take_lockfree(struct looper *looper)
+{
+	struct msg_entity *msg;
+	struct timespec ts;
+
+	while (__atomic_load_n(&looper->running, __ATOMIC_ACQUIRE)) {
+		looper_take_due(looper, &looper->runq);
+		looper_runq_drain(&looper->runq, &looper->queue);
+		if (looper->runq.count) {
+			msg = looper_runq_take(&looper->runq);
+			msg->msg_id = looper->msg_id++;
+			return msg;
+		}
+		__atomic_store_n(&looper->sleeping, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		looper_runq_drain(&looper->runq, &looper->queue);
+		if (looper->runq.count || looper_timer_due(looper) ||
+				!__atomic_load_n(&looper->running, __ATOMIC_SEQ_CST)) {
+			__atomic_store_n(&looper->sleeping, 0, __ATOMIC_RELAXED);
 			continue;
 		}
-		node = head->next;
-		msg = list_node_entry(node, struct msg_entity, node);
-		list_node_del(node);
-		pr_debug("handler, msg id = %d\n", msg->msg_id);
-		pthread_mutex_unlock(&looper->lock);
+		futex_wait(&looper->sleeping, 1, looper_timer_wait(looper, &ts), 0);
+	}
+	return NULL;
+}
+
+/*
+* looper_run_entity - handle one message and free its entity
+*/
+static void looper_run_entity(struct looper *looper, struct stall_slot *stall,
+					struct msg_entity *msg)
+{
+	/* an embedded entity is gone once free_cb released its data */
+	bool embedded = msg->embedded;
+
+	if (msg->func) {
+		stall_enter(stall, 0);
+		msg->func(msg->data);
+	} else {
+		stall_enter(stall, looper->tag_cb ? looper->tag_cb(msg->data) : 0);
 		if (looper->loop_cb)
 			looper->loop_cb(msg->data);
 		if (looper->free_cb)
 			looper->free_cb(msg->data);
-		free(msg);
 	}
+	stall_leave(stall);
+	if (!embedded)
+		msgpool_free(&looper_entity_pool, msg);
+}
+
+static void *looper_loop(void *private)
+{
+	struct looper *looper = (struct looper *)private;
+	struct msg_entity *msg;
+
+	pr_info("looper start, name: %s\n", looper->name);
+	stall_register(&looper->stall, looper->name);
+	for (;;) {
+		if (looper->flags & LOOPER_F_LOCKFREE)
+			msg = looper_take_lockfree(looper);
+		else
+			msg = looper_take_locked(looper);
+		if (!msg)
+			break;
+		pr_debug("handler, msg id = %d\n", msg->msg_id);
+		looper_run_entity(looper, &looper->stall, msg);
+	}
+	stall_unregister(&looper->stall);
 
 	return NULL;
 }
@@ -96,15 +413,60 @@ out:
 	return ret;
 }
 
+static void looper_free_entity(struct looper *looper, struct msg_entity *msg)
+{
+	bool embedded = msg->embedded;
+
+	if (looper->free_cb && !msg->func)
+		looper->free_cb(msg->data);
+	if (!embedded)
+		msgpool_free(&looper_entity_pool, msg);
+}
+
+/*
+* looper_clear_timers - free delayed messages, lock held
+*/
+static void looper_clear_timers(struct looper *looper)
+{
+	struct msg_entity *msg;
+
+	while (looper->timer_count) {
+		msg = looper->timers[0];
+		looper_timer_remove(looper, 0);
+		looper_free_entity(looper, msg);
+	}
+}
+
+/*
+* looper_clear - free messages left in an inbox and a run queue
+*/
+static void looper_clear(struct looper *looper, struct mpsc_queue *inbox,
+					struct looper_runq *q)
+{
+	struct msg_entity *msg;
+
+	do {
+		looper_runq_drain(q, inbox);
+		while ((msg = looper_runq_take(q)) != NULL)
+			looper_free_entity(looper, msg);
+	} while (q->count);
+}
+
 static int looper_stop(struct looper *looper)
 {
+	struct msg_entity *msg;
+
 	if(!looper->running){
 		pr_err("looper is already stoped, name = %s!\n", looper->name);
 		return -1;
 	}
 
-	looper->running = false;
+	pthread_mutex_lock(&looper->lock);
+	__atomic_store_n(&looper->running, false, __ATOMIC_SEQ_CST);
 	pthread_cond_signal(&looper->condition);
+	pthread_mutex_unlock(&looper->lock);
+	if (__atomic_exchange_n(&looper->sleeping, 0, __ATOMIC_SEQ_CST))
+		futex_wake(&looper->sleeping, 1, 0);
 	pthread_join(looper->tid, NULL);
 
 	/*
@@ -112,90 +474,698 @@ static int looper_stop(struct looper *looper)
 	* be cleaned carefully.
 	*/
 	pthread_mutex_lock(&looper->lock);
-	if(list_is_empty(&looper->head) == false){
-		struct list_node *node;
-		struct msg_entity *msg;
-		list_for_each_node(node, &looper->head) {
-			msg = list_node_entry(node, struct msg_entity, node);
-			list_node_del(node);
-			if (looper->free_cb)
-				looper->free_cb(msg->data);
-			free(msg);
-			msg = NULL;
-		}
+	while (!list_is_empty(&looper->head)) {
+		msg = list_node_entry(looper->head.next, struct msg_entity, node);
+		list_node_del(&msg->node);
+		looper_free_entity(looper, msg);
 	}
+	looper_clear(looper, &looper->queue, &looper->runq);
+	looper_clear_timers(looper);
 	pthread_mutex_unlock(&looper->lock);
 	return 0;
 }
 
-static void looper_dispatch(struct looper *looper, void *data)
+/*
+* looper_queue - link allocated entities to the looper
+* @looper: looper
+* @msg: entities to add in order
+* @count: number of entities
+*
+* The looper thread is woken up at most once for the whole array.
+*/
+static void looper_queue(struct looper *looper, struct msg_entity **msg, int count)
 {
-	struct msg_entity *msg;
+	int i;
 
-	if(NULL == looper){
+	if (looper->flags & LOOPER_F_LOCKFREE) {
+		for (i = 0; i < count; i++)
+			mpsc_push(&looper->queue, &msg[i]->qnode);
+		if (__atomic_load_n(&looper->sleeping, __ATOMIC_SEQ_CST) &&
+				__atomic_exchange_n(&looper->sleeping, 0, __ATOMIC_SEQ_CST))
+			futex_wake(&looper->sleeping, 1, 0);
 		return;
 	}
 
 	pthread_mutex_lock(&looper->lock);
-	msg = (struct msg_entity *)malloc(sizeof(struct msg_entity));
-	if (msg == NULL){
-		pr_err("malloc failed, %s!\n", strerror(errno));
-		if(data && looper->free_cb)
-		    looper->free_cb(data);
-		pthread_mutex_unlock(&looper->lock);
-		return;
-	}
-	msg->msg_id = looper->msg_id++;
-	msg->data = data;
-	INIT_LIST_NODE(&msg->node);
 	/*
 	* If list is empty, looper thread is sleeping wait for signal,
 	* so should wake it up first and don't be worried for the next
 	* while check for list state, because looper won't get the lock
 	* which is held by dispatch thread now.
 	*/
-	if(list_is_empty(&looper->head))
+	if (list_is_empty(&looper->head))
 		pthread_cond_signal(&looper->condition);
-	list_node_add_tail(&msg->node, &looper->head);
-	pr_debug("dispatch, msg id = %d\n", msg->msg_id);
+	for (i = 0; i < count; i++) {
+		msg[i]->msg_id = looper->msg_id++;
+		list_node_add_tail(&msg[i]->node, &looper->head);
+		pr_debug("dispatch, msg id = %d\n", msg[i]->msg_id);
+	}
 	pthread_mutex_unlock(&looper->lock);
+}
 
+/*
+* looper_entity_alloc - get a message entity out of any lock
+*
+* The entity embedded in data is used if the looper has entity_cb,
+* else one comes from the entity pool. Dispatched data is freed
+* with free_cb if allocation fails.
+*/
+static struct msg_entity *looper_entity_alloc(struct looper *looper,
+					msg_handler func, void *data)
+{
+	struct msg_entity *msg;
+	bool embedded = !func && looper->entity_cb;
+	int prio = 0;
 
+	if (embedded)
+		msg = looper->entity_cb(data);
+	else
+		msg = (struct msg_entity *)msgpool_alloc(&looper_entity_pool);
+	if (msg == NULL){
+		pr_err("malloc failed, %s!\n", strerror(errno));
+		if(data && looper->free_cb && !func)
+		    looper->free_cb(data);
+		return NULL;
+	}
+	if (!func && looper->prio_cb) {
+		prio = looper->prio_cb(data);
+		if (prio < 0)
+			prio = 0;
+		else if (prio > LOOPER_PRIO_MAX)
+			prio = LOOPER_PRIO_MAX;
+	}
+	msg->msg_id = 0;
+	msg->prio = prio;
+	msg->embedded = embedded;
+	msg->timer_id = 0;
+	msg->deadline = 0;
+	msg->func = func;
+	msg->data = data;
+	INIT_LIST_NODE(&msg->node);
+	return msg;
 }
 
-struct looper *looper_create(msg_handler loop_cb, msg_free free_cb, const char *name)
+static void looper_enqueue(struct looper *looper, msg_handler func, void *data)
 {
-	struct looper *looper;
+	struct msg_entity *msg;
 
-	looper = malloc(sizeof(struct looper));
 	if(NULL == looper){
-		pr_err("create looper fail, %s\n", strerror(errno));
-		return NULL;
+		return;
+	}
+
+	msg = looper_entity_alloc(looper, func, data);
+	if (msg)
+		looper_queue(looper, &msg, 1);
+}
+
+static void looper_dispatch_batch(struct looper *looper, void **data, int count)
+{
+	struct msg_entity *msg[LOOPER_DRAIN_MAX];
+	int i, n;
+
+	if (NULL == looper || count <= 0)
+		return;
+
+	/* queued LOOPER_DRAIN_MAX at a time, the stack use is bounded */
+	while (count > 0) {
+		n = 0;
+		for (i = 0; i < count && i < LOOPER_DRAIN_MAX; i++) {
+			msg[n] = looper_entity_alloc(looper, NULL, data[i]);
+			if (msg[n])
+				n++;
+		}
+		if (n)
+			looper_queue(looper, msg, n);
+		data += i;
+		count -= i;
 	}
+}
 
+static void looper_dispatch(struct looper *looper, void *data)
+{
+	looper_enqueue(looper, NULL, data);
+}
+
+static void looper_post(struct looper *looper, msg_handler func, void *data)
+{
+	looper_enqueue(looper, func, data);
+}
+
+static void looper_pool_wake_timer(struct looper *looper);
+
+/*
+* looper_wake_timer - wake up the looper thread for an earlier deadline
+*/
+static void looper_wake_timer(struct looper *looper)
+{
+	if (looper->flags & LOOPER_F_POOL) {
+		looper_pool_wake_timer(looper);
+	} else if (looper->flags & LOOPER_F_LOCKFREE) {
+		if (__atomic_exchange_n(&looper->sleeping, 0, __ATOMIC_SEQ_CST))
+			futex_wake(&looper->sleeping, 1, 0);
+	} else {
+		pthread_mutex_lock(&looper->lock);
+		pthread_cond_signal(&looper->condition);
+		pthread_mutex_unlock(&looper->lock);
+	}
+}
+
+/*
+* looper_add_timer - add a delayed message to the heap
+* @looper: looper
+* @data: data handed to loop_cb
+* @deadline: monotonic time in ns
+*/
+static int looper_add_timer(struct looper *looper, void *data, uint64_t deadline)
+{
+	struct msg_entity **timers;
+	struct msg_entity *msg;
+	bool first;
+	int size;
+	int id;
+
+	if (NULL == looper) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	msg = looper_entity_alloc(looper, NULL, data);
+	if (!msg)
+		return -1;
+	msg->deadline = deadline;
+
+	pthread_mutex_lock(&looper->lock);
+	if (looper->timer_count == looper->timer_size) {
+		size = looper->timer_size ? looper->timer_size * 2 : 16;
+		timers = realloc(looper->timers, size * sizeof(*timers));
+		if (!timers) {
+			pthread_mutex_unlock(&looper->lock);
+			pr_err("timer heap grow failed, %s!\n", strerror(errno));
+			looper_free_entity(looper, msg);
+			errno = ENOMEM;
+			return -1;
+		}
+		looper->timers = timers;
+		looper->timer_size = size;
+	}
+	looper->timer_seq = looper->timer_seq % INT32_MAX + 1;
+	id = msg->timer_id = looper->timer_seq;
+	looper->timers[looper->timer_count] = msg;
+	looper_timer_sift_up(looper->timers, looper->timer_count++);
+	first = looper->timers[0] == msg;
+	if (first)
+		__atomic_store_n(&looper->next_deadline, deadline, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&looper->lock);
+
+	/* looper thread sleeps until the old first deadline, wake it up */
+	if (first)
+		looper_wake_timer(looper);
+	return id;
+}
+
+int looper_dispatch_delayed(struct looper *looper, void *data, uint64_t delay_us)
+{
+	return looper_add_timer(looper, data, looper_now_ns() + delay_us * 1000ULL);
+}
+
+int looper_dispatch_at(struct looper *looper, void *data, const struct timespec *when)
+{
+	if (NULL == when) {
+		errno = EINVAL;
+		return -1;
+	}
+	return looper_add_timer(looper, data,
+			(uint64_t)when->tv_sec * 1000000000ULL + when->tv_nsec);
+}
+
+int looper_cancel(struct looper *looper, int id)
+{
+	struct msg_entity *msg = NULL;
+	int i;
+
+	if (NULL == looper || id <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&looper->lock);
+	for (i = 0; i < looper->timer_count; i++) {
+		if (looper->timers[i]->timer_id == id) {
+			msg = looper->timers[i];
+			looper_timer_remove(looper, i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&looper->lock);
+
+	if (!msg) {
+		errno = ENOENT;
+		return -1;
+	}
+	looper_free_entity(looper, msg);
+	return 0;
+}
+
+/*
+* looper_init - init fields shared by looper and looper pool
+*/
+static void looper_init(struct looper *looper, msg_handler loop_cb,
+					msg_free free_cb, const char *name, int flags)
+{
+	pthread_condattr_t attr;
+
+	pthread_once(&looper_entity_once, looper_entity_pool_init);
 	snprintf(looper->name, sizeof(looper->name), "%s", (name ? name : "default"));
 	pthread_mutex_init(&looper->lock, NULL);
-	pthread_cond_init(&looper->condition, NULL);
+	/* delayed messages are timed on the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&looper->condition, &attr);
+	pthread_condattr_destroy(&attr);
 	INIT_LIST_NODE(&looper->head);
+	mpsc_init(&looper->queue);
+	looper_runq_init(&looper->runq);
+	looper->prio_cb = NULL;
+	looper->tag_cb = NULL;
+	looper->entity_cb = NULL;
+	looper->timers = NULL;
+	looper->timer_count = 0;
+	looper->timer_size = 0;
+	looper->timer_seq = 0;
+	looper->next_deadline = UINT64_MAX;
+	looper->sleeping = 0;
+	looper->flags = flags;
 	looper->loop_cb = loop_cb;
 	looper->free_cb = free_cb;
 	looper->start = looper_start;
 	looper->stop = looper_stop;
 	looper->dispatch = looper_dispatch;
+	looper->post = looper_post;
+	looper->dispatch_batch = looper_dispatch_batch;
 	looper->running = false;
 	looper->msg_id = 0;
+}
+
+static void looper_pool_destroy(struct looper *looper);
+
+struct looper *looper_create_flags(msg_handler loop_cb, msg_free free_cb,
+					const char *name, int flags)
+{
+	struct looper *looper;
+
+	looper = malloc(sizeof(struct looper));
+	if(NULL == looper){
+		pr_err("create looper fail, %s\n", strerror(errno));
+		return NULL;
+	}
+	looper_init(looper, loop_cb, free_cb, name, flags);
 
 	return looper;
 }
 
+struct looper *looper_create(msg_handler loop_cb, msg_free free_cb, const char *name)
+{
+	return looper_create_flags(loop_cb, free_cb, name, 0);
+}
+
 void looper_destory(struct looper *looper)
 {
 	if (NULL == looper)
 		return;
+	if (looper->flags & LOOPER_F_POOL) {
+		looper_pool_destroy(looper);
+		return;
+	}
 
 	looper_stop(looper);
 	pthread_mutex_destroy(&looper->lock);
 	pthread_cond_destroy(&looper->condition);
+	free(looper->timers);
 	free(looper);
 }
 
+#define LOOPER_STEAL_INTERVAL 16
+
+/*
+* looper_worker - one thread of a looper pool
+*
+* Keyed messages are pushed to the worker queue, the worker sleeps
+* on "sleeping" when both its queue and the unordered list are empty.
+*/
+struct looper_worker {
+	struct looper_pool *pool;
+	pthread_t tid;
+	int index;
+	/* own messages handled since last look at unordered list */
+	int streak;
+	struct mpsc_queue queue;
+	struct looper_runq runq;
+	uint32_t sleeping;
+	struct stall_slot stall;
+};
+
+/*
+* looper_pool - a looper backed by several worker threads
+*
+* looper must be the first member, the pool is used through the
+* normal looper operations. looper.runq and looper.lock hold the
+* unordered messages which any idle worker can take, shared_mask
+* mirrors looper.runq.mask to check it without the lock.
+*/
+struct looper_pool {
+	struct looper looper;
+	looper_key_fn key;
+	int threads;
+	uint32_t shared_mask;
+	uint32_t next_wake;
+	struct looper_worker *workers;
+};
+
+/*
+* looper_pool_steal - take an unordered message, never blocks
+*/
+static struct msg_entity *looper_pool_steal(struct looper_pool *pool)
+{
+	struct msg_entity *msg;
+
+	pthread_mutex_lock(&pool->looper.lock);
+	msg = looper_runq_take(&pool->looper.runq);
+	__atomic_store_n(&pool->shared_mask, pool->looper.runq.mask, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pool->looper.lock);
+	return msg;
+}
+
+static void looper_pool_take_due(struct looper_pool *pool);
+
+/*
+* looper_worker_take - wait for next message of a pool worker
+*
+* Own queue goes first so keyed messages are not delayed by a long
+* unordered list, unless the unordered list has a higher priority.
+* Every LOOPER_STEAL_INTERVAL messages the unordered list is checked
+* first so it can't be starved. Returns NULL when the pool is stopped.
+*/
+static struct msg_entity *looper_worker_take(struct looper_worker *worker)
+{
+	struct looper_pool *pool = worker->pool;
+	struct msg_entity *msg;
+	struct timespec ts;
+	uint32_t shared;
+
+	while (__atomic_load_n(&pool->looper.running, __ATOMIC_ACQUIRE)) {
+		looper_pool_take_due(pool);
+		looper_runq_drain(&worker->runq, &worker->queue);
+		shared = __atomic_load_n(&pool->shared_mask, __ATOMIC_RELAXED);
+		if (shared && (worker->streak >= LOOPER_STEAL_INTERVAL ||
+				looper_runq_top(worker->runq.mask) < looper_runq_top(shared))) {
+			msg = looper_pool_steal(pool);
+			if (msg) {
+				worker->streak = 0;
+				return msg;
+			}
+		}
+		if (worker->runq.count) {
+			worker->streak++;
+			return looper_runq_take(&worker->runq);
+		}
+
+		__atomic_store_n(&worker->sleeping, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		looper_runq_drain(&worker->runq, &worker->queue);
+		if (worker->runq.count || looper_timer_due(&pool->looper) ||
+				__atomic_load_n(&pool->shared_mask, __ATOMIC_SEQ_CST) ||
+				!__atomic_load_n(&pool->looper.running, __ATOMIC_SEQ_CST)) {
+			__atomic_store_n(&worker->sleeping, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		/* every idle worker sleeps until next delayed message is due */
+		futex_wait(&worker->sleeping, 1, looper_timer_wait(&pool->looper, &ts), 0);
+	}
+	return NULL;
+}
+
+static void *looper_worker_loop(void *private)
+{
+	struct looper_worker *worker = (struct looper_worker *)private;
+	struct looper *looper = &worker->pool->looper;
+	struct msg_entity *msg;
+
+	pr_info("looper worker %d start, name: %s\n", worker->index, looper->name);
+	stall_register(&worker->stall, looper->name);
+	while ((msg = looper_worker_take(worker)) != NULL)
+		looper_run_entity(looper, &worker->stall, msg);
+	stall_unregister(&worker->stall);
+
+	return NULL;
+}
+
+/*
+* looper_worker_wake - wake up a worker if it is sleeping
+*/
+static bool looper_worker_wake(struct looper_worker *worker)
+{
+	if (__atomic_load_n(&worker->sleeping, __ATOMIC_SEQ_CST) &&
+			__atomic_exchange_n(&worker->sleeping, 0, __ATOMIC_SEQ_CST)) {
+		futex_wake(&worker->sleeping, 1, 0);
+		return true;
+	}
+	return false;
+}
+
+/*
+* looper_pool_wake_idle - wake up to count sleeping workers for
+* unordered messages, busy workers find them after their message.
+*/
+static void looper_pool_wake_idle(struct looper_pool *pool, int count)
+{
+	int start, i;
+
+	start = __atomic_fetch_add(&pool->next_wake, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < pool->threads && count > 0; i++) {
+		if (looper_worker_wake(&pool->workers[(start + i) % pool->threads]))
+			count--;
+	}
+}
+
+/*
+* looper_pool_queue - route allocated entities to workers
+* @pool: looper pool
+* @msg: entities in dispatch order
+* @count: number of entities, up to LOOPER_DRAIN_MAX
+*
+* Entities with the same key go to the same worker in order,
+* entities without a key (or posted functions) are unordered.
+*/
+static void looper_pool_queue(struct looper_pool *pool, struct msg_entity **msg, int count)
+{
+	/* workers got an entity, waking one twice does no harm */
+	int touched[LOOPER_DRAIN_MAX];
+	int ntouched = 0;
+	int unordered = 0;
+	int key, i;
+
+	for (i = 0; i < count; i++) {
+		key = LOOPER_KEY_ANY;
+		if (!msg[i]->func && pool->key)
+			key = pool->key(msg[i]->data);
+		if (key < 0) {
+			unordered++;
+			continue;
+		}
+		key = (unsigned int)key % pool->threads;
+		mpsc_push(&pool->workers[key].queue, &msg[i]->qnode);
+		if (!ntouched || touched[ntouched - 1] != key)
+			touched[ntouched++] = key;
+		msg[i] = NULL;
+	}
+
+	if (unordered) {
+		pthread_mutex_lock(&pool->looper.lock);
+		for (i = 0; i < count; i++) {
+			if (msg[i])
+				looper_runq_add(&pool->looper.runq, msg[i]);
+		}
+		__atomic_store_n(&pool->shared_mask, pool->looper.runq.mask, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&pool->looper.lock);
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < ntouched; i++)
+		looper_worker_wake(&pool->workers[touched[i]]);
+	if (unordered)
+		looper_pool_wake_idle(pool, unordered);
+}
+
+/*
+* looper_pool_take_due - route due delayed messages to workers
+*/
+static void looper_pool_take_due(struct looper_pool *pool)
+{
+	struct msg_entity *msg[LOOPER_DRAIN_MAX];
+	int n;
+
+	if (!looper_timer_due(&pool->looper))
+		return;
+	pthread_mutex_lock(&pool->looper.lock);
+	n = looper_timer_expire(&pool->looper, looper_now_ns(), msg, LOOPER_DRAIN_MAX);
+	pthread_mutex_unlock(&pool->looper.lock);
+	if (n)
+		looper_pool_queue(pool, msg, n);
+}
+
+static void looper_pool_wake_timer(struct looper *looper)
+{
+	looper_pool_wake_idle((struct looper_pool *)looper, 1);
+}
+
+static void looper_pool_dispatch_batch(struct looper *looper, void **data, int count)
+{
+	struct msg_entity *msg[LOOPER_DRAIN_MAX];
+	int i, n;
+
+	if (NULL == looper || count <= 0)
+		return;
+
+	while (count > 0) {
+		n = 0;
+		for (i = 0; i < count && i < LOOPER_DRAIN_MAX; i++) {
+			msg[n] = looper_entity_alloc(looper, NULL, data[i]);
+			if (msg[n])
+				n++;
+		}
+		if (n)
+			looper_pool_queue((struct looper_pool *)looper, msg, n);
+		data += i;
+		count -= i;
+	}
+}
+
+static void looper_pool_dispatch(struct looper *looper, void *data)
+{
+	looper_pool_dispatch_batch(looper, &data, 1);
+}
+
+static void looper_pool_post(struct looper *looper, msg_handler func, void *data)
+{
+	struct msg_entity *msg;
+
+	if (NULL == looper)
+		return;
+
+	msg = looper_entity_alloc(looper, func, data);
+	if (msg)
+		looper_pool_queue((struct looper_pool *)looper, &msg, 1);
+}
+
+static void looper_pool_join(struct looper_pool *pool, int threads)
+{
+	int i;
+
+	__atomic_store_n(&pool->looper.running, false, __ATOMIC_SEQ_CST);
+	for (i = 0; i < threads; i++) {
+		__atomic_store_n(&pool->workers[i].sleeping, 0, __ATOMIC_SEQ_CST);
+		futex_wake(&pool->workers[i].sleeping, 1, 0);
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(pool->workers[i].tid, NULL);
+}
+
+static int looper_pool_start(struct looper *looper)
+{
+	struct looper_pool *pool = (struct looper_pool *)looper;
+	int ret = 0;
+	int i;
+
+	pthread_mutex_lock(&looper->lock);
+	if (looper->running) {
+		pr_err("looper is already running, name =%s!\n", looper->name);
+		pthread_mutex_unlock(&looper->lock);
+		return -1;
+	}
+	looper->running = true;
+	pthread_mutex_unlock(&looper->lock);
+
+	for (i = 0; i < pool->threads; i++) {
+		ret = pthread_create(&pool->workers[i].tid, NULL,
+				looper_worker_loop, &pool->workers[i]);
+		if (ret) {
+			pr_err("pthread create fail!, %s\n", strerror(ret));
+			looper_pool_join(pool, i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int looper_pool_stop(struct looper *looper)
+{
+	struct looper_pool *pool = (struct looper_pool *)looper;
+	int i;
+
+	if (!looper->running) {
+		pr_err("looper is already stoped, name = %s!\n", looper->name);
+		return -1;
+	}
+	looper_pool_join(pool, pool->threads);
+
+	for (i = 0; i < pool->threads; i++)
+		looper_clear(looper, &pool->workers[i].queue, &pool->workers[i].runq);
+	pthread_mutex_lock(&looper->lock);
+	looper_clear(looper, &looper->queue, &looper->runq);
+	looper_clear_timers(looper);
+	pool->shared_mask = 0;
+	pthread_mutex_unlock(&looper->lock);
+	return 0;
+}
+
+struct looper *looper_pool_create(msg_handler loop_cb, msg_free free_cb,
+					const char *name, int threads, looper_key_fn key)
+{
+	struct looper_pool *pool;
+	int i;
+
+	if (threads <= 0) {
+		pr_err("invalid looper pool threads:%d\n", threads);
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof(struct looper_pool));
+	if (pool)
+		pool->workers = calloc(threads, sizeof(struct looper_worker));
+	if (!pool || !pool->workers) {
+		pr_err("create looper pool fail, %s\n", strerror(errno));
+		free(pool);
+		return NULL;
+	}
+
+	pool->key = key;
+	pool->threads = threads;
+	for (i = 0; i < threads; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].index = i;
+		mpsc_init(&pool->workers[i].queue);
+		looper_runq_init(&pool->workers[i].runq);
+	}
+
+	looper_init(&pool->looper, loop_cb, free_cb, name, LOOPER_F_POOL);
+	pool->looper.start = looper_pool_start;
+	pool->looper.stop = looper_pool_stop;
+	pool->looper.dispatch = looper_pool_dispatch;
+	pool->looper.post = looper_pool_post;
+	pool->looper.dispatch_batch = looper_pool_dispatch_batch;
+
+	return &pool->looper;
+}
+
+static void looper_pool_destroy(struct looper *looper)
+{
+	struct looper_pool *pool = (struct looper_pool *)looper;
+
+	if (looper->running)
+		looper_pool_stop(looper);
+	pthread_mutex_destroy(&looper->lock);
+	pthread_cond_destroy(&looper->condition);
+	free(looper->timers);
+	free(pool->workers);
+	free(pool);
+}
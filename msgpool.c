@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LOG_TAG "msgpool"
+//#define LOG_DEBUG
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include "debug.h"
+#include "msgpool.h"
+
+/*
+ * msgpool_cache - objects owned by one thread
+ */
+struct msgpool_cache {
+	struct msgpool *pool;
+	void *head;
+	uint32_t count;
+};
+
+static inline void *msgpool_next(void *obj)
+{
+	return *(void **)obj;
+}
+
+static inline void msgpool_link(void *obj, void *next)
+{
+	*(void **)obj = next;
+}
+
+/*
+ * msgpool_put_shared - move count objects of a cache to the shared list
+ */
+static void msgpool_put_shared(struct msgpool *pool, struct msgpool_cache *cache,
+					uint32_t count)
+{
+	void *obj, *heap = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->flushes++;
+	while (count-- && cache->head) {
+		obj = cache->head;
+		cache->head = msgpool_next(obj);
+		cache->count--;
+		if (pool->free_count < pool->free_max) {
+			msgpool_link(obj, pool->free_list);
+			pool->free_list = obj;
+			pool->free_count++;
+		} else {
+			msgpool_link(obj, heap);
+			heap = obj;
+			pool->heap_frees++;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	while (heap) {
+		obj = heap;
+		heap = msgpool_next(obj);
+		free(obj);
+	}
+}
+
+static void msgpool_cache_exit(void *data)
+{
+	struct msgpool_cache *cache = (struct msgpool_cache *)data;
+
+	msgpool_put_shared(cache->pool, cache, cache->count);
+	free(cache);
+}
+
+int msgpool_init(struct msgpool *pool, const char *name, size_t size,
+			uint32_t cache_max, uint32_t free_max)
+{
+	int ret;
+
+	memset(pool, 0, sizeof(*pool));
+	snprintf(pool->name, sizeof(pool->name), "%s", name);
+	pool->size = size < sizeof(void *) ? sizeof(void *) : size;
+	pool->cache_max = cache_max < 2 ? 2 : cache_max;
+	pool->free_max = free_max;
+	pthread_mutex_init(&pool->lock, NULL);
+	ret = pthread_key_create(&pool->key, msgpool_cache_exit);
+	if (ret) {
+		pr_err("%s key create fail, %s\n", pool->name, strerror(ret));
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+static struct msgpool_cache *msgpool_cache(struct msgpool *pool)
+{
+	struct msgpool_cache *cache;
+
+	cache = (struct msgpool_cache *)pthread_getspecific(pool->key);
+	if (cache)
+		return cache;
+	cache = (struct msgpool_cache *)calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+	cache->pool = pool;
+	pthread_setspecific(pool->key, cache);
+	return cache;
+}
+
+void *msgpool_alloc(struct msgpool *pool)
+{
+	struct msgpool_cache *cache = msgpool_cache(pool);
+	uint32_t count;
+	void *obj;
+
+	if (!cache)
+		return malloc(pool->size);
+
+	if (!cache->head) {
+		pthread_mutex_lock(&pool->lock);
+		pool->refills++;
+		for (count = pool->cache_max / 2; count && pool->free_list; count--) {
+			obj = pool->free_list;
+			pool->free_list = msgpool_next(obj);
+			pool->free_count--;
+			msgpool_link(obj, cache->head);
+			cache->head = obj;
+			cache->count++;
+		}
+		if (!cache->head)
+			pool->heap_allocs++;
+		pthread_mutex_unlock(&pool->lock);
+		if (!cache->head)
+			return malloc(pool->size);
+	}
+
+	obj = cache->head;
+	cache->head = msgpool_next(obj);
+	cache->count--;
+	return obj;
+}
+
+void msgpool_free(struct msgpool *pool, void *obj)
+{
+	struct msgpool_cache *cache;
+
+	if (!obj)
+		return;
+	cache = msgpool_cache(pool);
+	if (!cache) {
+		free(obj);
+		return;
+	}
+	msgpool_link(obj, cache->head);
+	cache->head = obj;
+	if (++cache->count > pool->cache_max)
+		msgpool_put_shared(pool, cache, pool->cache_max / 2);
+}
+
+void msgpool_flush(struct msgpool *pool)
+{
+	struct msgpool_cache *cache;
+
+	cache = (struct msgpool_cache *)pthread_getspecific(pool->key);
+	if (cache && cache->count)
+		msgpool_put_shared(pool, cache, cache->count);
+}
@@ -0,0 +1,1329 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LOG_TAG "peer"
+//#define LOG_DEBUG
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <mqueue.h>
+#include "debug.h"
+#include "ipc.h"
+#include "peer.h"
+#include "msgpool.h"
+#include "shmbuf.h"
+
+mqd_t mq_rw_create(char *name, int maxmsg, int maxsize)
+{
+	mqd_t mq;
+	struct mq_attr attr, cur;
+
+	attr.mq_flags = 0;       /* BLOCK */
+	attr.mq_maxmsg = maxmsg;    /* msg count */
+	attr.mq_msgsize = maxsize;  /* msg queue size in bytes */
+	attr.mq_curmsgs = 0; /* current msg count in queue */
+
+	mq = mq_open(name, O_CREAT | O_RDWR, 0644, &attr);
+	if (mq == (mqd_t) -1) {
+		pr_err("mq_open failed, %s\n", strerror(errno));
+		return mq;
+	}
+	/*
+	 * A queue left by an earlier instance keeps its attributes,
+	 * create it again if they changed.
+	 */
+	if (mq_getattr(mq, &cur) == 0 &&
+			(cur.mq_maxmsg != maxmsg || cur.mq_msgsize != maxsize)) {
+		pr_info("recreate msg queue %s, maxmsg:%d msgsize:%d\n",
+				name, maxmsg, maxsize);
+		mq_close(mq);
+		mq_unlink(name);
+		mq = mq_open(name, O_CREAT | O_RDWR, 0644, &attr);
+		if (mq == (mqd_t) -1) {
+			pr_err("mq_open failed, %s\n", strerror(errno));
+			return mq;
+		}
+	}
+	pr_info("msg queue mqd:%d\n", mq);
+	return mq;
+}
+
+mqd_t mq_rd_open(char *name)
+{
+	mqd_t mq;
+
+	mq = mq_open(name, O_RDONLY);
+	if (mq == (mqd_t) -1) {
+		pr_err("mq_open failed, %s\n", strerror(errno));
+	}
+	return mq;
+}
+
+mqd_t mq_wr_open(char *name)
+{
+	mqd_t mq;
+
+	mq = mq_open(name, O_WRONLY);
+	if (mq == (mqd_t) -1) {
+		pr_debug("mq_open failed, %s\n", strerror(errno));
+	}
+	return mq;
+}
+
+int mq_recv_msg(mqd_t mq, char *buf, int maxsize)
+{
+	int bytes_read;
+
+again:
+	bytes_read = mq_receive(mq, buf, maxsize, NULL);
+    if (bytes_read < 0) {
+		if (errno == EINTR)
+			goto again;
+		else {
+			pr_err("mq_receive failed, %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	return bytes_read;
+}
+
+
+int mq_send_msg(mqd_t mq, char *buf, int length, unsigned int prio)
+{
+	int bytes_read;
+
+again:
+	bytes_read = mq_send(mq, buf, length, prio);
+	if (bytes_read < 0) {
+		if (errno == EINTR)
+			goto again;
+		else {
+			pr_err("mq_send failed, %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	return bytes_read;
+}
+
+int mq_try_send(mqd_t mqd, void *buf, int length, unsigned int prio)
+{
+	/* an expired timeout makes a full queue fail at once */
+	struct timespec expired = { 0, 0 };
+
+	while (mq_timedsend(mqd, (void *)buf, length, prio, &expired) < 0) {
+		if (errno == EINTR)
+			continue;
+		if (errno == ETIMEDOUT)
+			errno = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+int mq_send_msg_timeout(mqd_t mqd, void *buf, int length, unsigned int prio)
+{
+	int bytes_read;
+	int count = 0;
+	struct timespec expire_time;
+
+	do {
+		clock_gettime(CLOCK_REALTIME, &expire_time);
+		expire_time.tv_nsec += 300000000; //300ms
+		expire_time.tv_sec += expire_time.tv_nsec / 1000000000;
+		expire_time.tv_nsec = expire_time.tv_nsec % 1000000000;
+		bytes_read = mq_timedsend(mqd, (void *)buf, length, prio, &expire_time);
+		if (bytes_read < 0) {
+			if (errno == EINTR || errno == ETIMEDOUT)
+				continue;
+			else {
+				pr_err("mq_timedsend failed, %s\n", strerror(errno));
+				return -1;
+			}
+		} else if (bytes_read == 0) /* success return 0 */
+			break;
+	} while (count++ < 10);
+
+	return bytes_read;
+}
+
+int ring_send_msg_timeout(struct ring *ring, void *buf, int length)
+{
+	int count = 0;
+
+	/*
+	 * Same 3 seconds budget as mq_send_msg_timeout when ring is full
+	 */
+	while (ring_push(ring, buf, length) < 0) {
+		if (errno != EAGAIN || count++ >= 3000) {
+			pr_err("ring_push failed, %s\n", strerror(errno));
+			return -1;
+		}
+		usleep(1000);
+	}
+	return 0;
+}
+
+
+static struct list_node peer_hash_table[PEER_HASH_SIZE];
+static LIST_NODE(peer_lru);
+/* peers removed from the table but still referenced, linked by lru */
+static LIST_NODE(peer_dead);
+static int peer_count;
+static int peer_table_inited;
+/* service registry of the endpoints, NULL if not available */
+static struct registry *peer_registry;
+/*
+ * held as reader from a registry lookup until the id it got is stored
+ * in the peer, as writer to replace the registry
+ */
+static pthread_rwlock_t peer_registry_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t peer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * peers with pending batches, in deadline order since all batches
+ * use the same linger time
+ */
+static LIST_NODE(batch_list);
+static pthread_mutex_t batch_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_cond;
+static pthread_t batch_tid;
+static int batch_running;
+static uint64_t batch_linger_ns;
+
+/*
+ * frame queued for the outbound thread
+ */
+struct peer_frame {
+	struct list_node node;
+	int length;
+	char data[MSG_QUEUE_MAX_SIZE];
+};
+
+/*
+ * peers with queued frames, a peer whose queue was full goes back
+ * to the tail and waits for its retry time
+ */
+static LIST_NODE(out_list);
+static pthread_mutex_t out_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t out_cond;
+static pthread_t out_tid;
+static int out_running;
+/* peer the outbound thread took off the list, signaled when done */
+static struct ipc_peer *out_busy;
+static pthread_cond_t out_idle = PTHREAD_COND_INITIALIZER;
+static uint32_t out_depth;
+static struct msgpool peer_frame_pool;
+static int peer_frame_pool_inited;
+
+static uint64_t peer_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint32_t peer_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (uint8_t)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * peer_forget_id - stop asking the registry about a peer, peer_lock held
+ */
+static void peer_forget_id(struct ipc_peer *peer)
+{
+	pthread_rwlock_wrlock(&peer->lock);
+	peer->id = 0;
+	pthread_rwlock_unlock(&peer->lock);
+}
+
+void peer_registry_set(struct registry *reg)
+{
+	struct ipc_peer *peer;
+
+	pthread_rwlock_wrlock(&peer_registry_lock);
+	__atomic_store_n(&peer_registry, reg, __ATOMIC_RELEASE);
+	if (!reg) {
+		/*
+		 * ids are only used with peer->lock held, once they are
+		 * cleared nobody touches the old registry anymore
+		 */
+		pthread_mutex_lock(&peer_lock);
+		list_for_each_node_entry(peer, &peer_lru, lru)
+			peer_forget_id(peer);
+		list_for_each_node_entry(peer, &peer_dead, lru)
+			peer_forget_id(peer);
+		pthread_mutex_unlock(&peer_lock);
+	}
+	pthread_rwlock_unlock(&peer_registry_lock);
+}
+
+/*
+ * peer_transport_open - open ring or message queue of an app
+ *
+ * The registry tells which transport the app has, and an app which
+ * unregistered is known gone without a syscall. Apps missing in the
+ * registry are probed, ring first, since a stale ring is ignored by
+ * ring_open and an endpoint removes the other transport when created.
+ * attr gets the depth and message size of the queue or ring.
+ */
+static int peer_transport_open(const char *name, mqd_t *mqd, struct ring **ring,
+								ino_t *ino, uint32_t *id, uint32_t *gen,
+								struct mq_attr *attr)
+{
+	struct registry *reg = __atomic_load_n(&peer_registry, __ATOMIC_ACQUIRE);
+	struct registry_entry entry;
+	char path[RING_NAME_SIZE];
+	int transport = -1;
+	struct stat st;
+	int ret;
+
+	attr->mq_maxmsg = 0;
+	attr->mq_msgsize = MSG_QUEUE_MAX_SIZE;
+	*mqd = (mqd_t)-1;
+	*ring = NULL;
+	*id = 0;
+	*gen = 0;
+
+	if (reg) {
+		ret = registry_lookup(reg, name, &entry);
+		if (ret < 0 && errno == ESRCH)
+			return -1;
+		if (ret > 0) {
+			*id = ret;
+			*gen = entry.gen;
+			transport = entry.transport;
+		}
+	}
+
+	if (transport != REGISTRY_MQUEUE) {
+		snprintf(path, RING_NAME_SIZE, "/%s.ring", name);
+		*ring = ring_open(path);
+		if (*ring) {
+			*ino = (*ring)->ino;
+			attr->mq_maxmsg = (*ring)->hdr->slots;
+			attr->mq_msgsize = (*ring)->hdr->slot_size;
+			return 0;
+		}
+		if (transport == REGISTRY_RING) {
+			*id = 0;
+			return -1;
+		}
+	}
+
+	snprintf(path, RING_NAME_SIZE, "/%s", name);
+	*mqd = mq_wr_open(path);
+	if (*mqd == (mqd_t)-1) {
+		*id = 0;
+		return -1;
+	}
+	*ino = fstat(*mqd, &st) < 0 ? 0 : st.st_ino;
+	if (mq_getattr(*mqd, attr) < 0) {
+		attr->mq_maxmsg = 0;
+		attr->mq_msgsize = MSG_QUEUE_MAX_SIZE;
+	}
+	return 0;
+}
+
+static void peer_transport_close(mqd_t mqd, struct ring *ring)
+{
+	if (ring)
+		ring_close(ring);
+	if (mqd != (mqd_t)-1)
+		mq_close(mqd);
+}
+
+static void peer_free(struct ipc_peer *peer)
+{
+	struct peer_frame *frame;
+
+	while (!list_is_empty(&peer->out_frames)) {
+		frame = list_node_entry(peer->out_frames.next, struct peer_frame, node);
+		list_node_del(&frame->node);
+		msgpool_free(&peer_frame_pool, frame);
+	}
+	peer_transport_close(peer->mqd, peer->ring);
+	pthread_rwlock_destroy(&peer->lock);
+	pthread_mutex_destroy(&peer->batch_lock);
+	pthread_mutex_destroy(&peer->out_lock);
+	free(peer->batch);
+	free(peer);
+}
+
+/*
+ * peer_unlink - remove peer from the table, peer_lock must be held
+ *
+ * Peer is freed at once if nobody uses it, or by the last peer_put.
+ */
+static void peer_unlink(struct ipc_peer *peer)
+{
+	list_node_del(&peer->hnode);
+	list_node_del(&peer->lru);
+	peer_count--;
+	peer->dead = 1;
+	if (peer->refcnt == 0)
+		peer_free(peer);
+	else
+		list_node_add(&peer->lru, &peer_dead);
+}
+
+/*
+ * peer_evict - evict least recently used peers which are not in use
+ */
+static void peer_evict(void)
+{
+	struct ipc_peer *peer;
+	struct list_node *node = peer_lru.prev;
+
+	while (peer_count >= PEER_TABLE_MAX && node != &peer_lru) {
+		peer = list_node_entry(node, struct ipc_peer, lru);
+		node = node->prev;
+		if (peer->refcnt == 0) {
+			pr_debug("evict peer:%s\n", peer->name);
+			peer_unlink(peer);
+		}
+	}
+}
+
+static struct ipc_peer *peer_lookup(const char *name, uint32_t hash)
+{
+	struct list_node *head = &peer_hash_table[hash % PEER_HASH_SIZE];
+	struct ipc_peer *peer;
+
+	list_for_each_node_entry(peer, head, hnode) {
+		if (peer->hash == hash && !strcmp(peer->name, name))
+			return peer;
+	}
+	return NULL;
+}
+
+struct ipc_peer *peer_get(const char *name)
+{
+	struct ipc_peer *peer, *old;
+	struct mq_attr attr;
+	uint32_t hash;
+	int i;
+
+	if (name[0] == '/')
+		name++;
+	hash = peer_hash(name);
+
+	pthread_mutex_lock(&peer_lock);
+	if (!peer_table_inited) {
+		for (i = 0; i < PEER_HASH_SIZE; i++)
+			INIT_LIST_NODE(&peer_hash_table[i]);
+		peer_table_inited = 1;
+	}
+	peer = peer_lookup(name, hash);
+	if (peer) {
+		peer->refcnt++;
+		list_node_del(&peer->lru);
+		list_node_add(&peer->lru, &peer_lru);
+		pthread_mutex_unlock(&peer_lock);
+		return peer;
+	}
+	pthread_mutex_unlock(&peer_lock);
+
+	/*
+	 * Open transport without holding the table lock
+	 */
+	peer = (struct ipc_peer *)malloc(sizeof(*peer));
+	if (!peer) {
+		pr_err("peer malloc fail\n");
+		return NULL;
+	}
+	memset(peer, 0, sizeof(*peer));
+	snprintf(peer->name, PEER_NAME_SIZE, "%s", name);
+	peer->hash = hash;
+	peer->refcnt = 1;
+	peer->check_ns = peer_now_ns() + PEER_CHECK_INTERVAL_NS;
+	pthread_rwlock_init(&peer->lock, NULL);
+	pthread_mutex_init(&peer->batch_lock, NULL);
+	INIT_LIST_NODE(&peer->bnode);
+	pthread_mutex_init(&peer->out_lock, NULL);
+	INIT_LIST_NODE(&peer->out_frames);
+	INIT_LIST_NODE(&peer->onode);
+	pthread_rwlock_rdlock(&peer_registry_lock);
+	if (peer_transport_open(peer->name, &peer->mqd, &peer->ring, &peer->ino,
+				&peer->id, &peer->gen, &attr) < 0) {
+		pthread_rwlock_unlock(&peer_registry_lock);
+		pr_err("peer %s open fail, %s\n", name, strerror(errno));
+		peer_free(peer);
+		return NULL;
+	}
+	peer->maxmsg = attr.mq_maxmsg;
+	peer->msgsize = attr.mq_msgsize;
+
+	pthread_mutex_lock(&peer_lock);
+	old = peer_lookup(name, hash);
+	if (old) {
+		/* someone else opened it meanwhile */
+		old->refcnt++;
+		pthread_mutex_unlock(&peer_lock);
+		pthread_rwlock_unlock(&peer_registry_lock);
+		peer_free(peer);
+		return old;
+	}
+	peer_evict();
+	list_node_add(&peer->hnode, &peer_hash_table[hash % PEER_HASH_SIZE]);
+	list_node_add(&peer->lru, &peer_lru);
+	peer_count++;
+	pthread_mutex_unlock(&peer_lock);
+	pthread_rwlock_unlock(&peer_registry_lock);
+	return peer;
+}
+
+void peer_put(struct ipc_peer *peer)
+{
+	if (!peer)
+		return;
+
+	pthread_mutex_lock(&peer_lock);
+	if (--peer->refcnt == 0 && peer->dead) {
+		list_node_del(&peer->lru);
+		peer_free(peer);
+	}
+	pthread_mutex_unlock(&peer_lock);
+}
+
+/*
+ * peer_is_stale - check if cached transport still is the app's one
+ *
+ * Asks the registry if the app has it, else uses a stat on the shm /
+ * mqueue file system when possible, or falls back to reopen the queue
+ * and compare inode.
+ */
+static int peer_is_stale(struct ipc_peer *peer)
+{
+	struct registry *reg = __atomic_load_n(&peer_registry, __ATOMIC_ACQUIRE);
+	char path[RING_NAME_SIZE + 16];
+	struct stat st;
+	mqd_t mqd;
+	int stale;
+
+	if (peer->id && reg)
+		return !registry_alive(reg, peer->id, peer->gen);
+	if (peer->ring) {
+		if (__atomic_load_n(&peer->ring->hdr->closed, __ATOMIC_ACQUIRE))
+			return 1;
+		snprintf(path, sizeof(path), "/dev/shm/%s.ring", peer->name);
+		return stat(path, &st) < 0 || st.st_ino != peer->ino;
+	}
+
+	snprintf(path, sizeof(path), "/dev/mqueue/%s", peer->name);
+	if (stat(path, &st) == 0)
+		return st.st_ino != peer->ino;
+
+	snprintf(path, sizeof(path), "/%s", peer->name);
+	mqd = mq_wr_open(path);
+	if (mqd == (mqd_t)-1)
+		return 1;
+	stale = fstat(mqd, &st) < 0 || st.st_ino != peer->ino;
+	mq_close(mqd);
+	return stale;
+}
+
+/*
+ * peer_reopen - replace the cached transport with a fresh one
+ */
+static int peer_reopen(struct ipc_peer *peer)
+{
+	struct mq_attr attr;
+	struct ring *ring;
+	uint32_t id, gen;
+	mqd_t mqd;
+	ino_t ino;
+	int ret;
+
+	pthread_rwlock_rdlock(&peer_registry_lock);
+	ret = peer_transport_open(peer->name, &mqd, &ring, &ino, &id, &gen, &attr);
+	pthread_rwlock_wrlock(&peer->lock);
+	peer_transport_close(peer->mqd, peer->ring);
+	peer->mqd = mqd;
+	peer->ring = ring;
+	peer->ino = ret < 0 ? 0 : ino;
+	peer->id = id;
+	peer->gen = gen;
+	peer->maxmsg = attr.mq_maxmsg;
+	__atomic_store_n(&peer->msgsize, attr.mq_msgsize, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&peer->lock);
+	pthread_rwlock_unlock(&peer_registry_lock);
+	pr_info("peer %s reopened, ret:%d\n", peer->name, ret);
+	return ret;
+}
+
+static void peer_validate(struct ipc_peer *peer, int force)
+{
+	uint64_t now = peer_now_ns();
+	uint64_t check = __atomic_load_n(&peer->check_ns, __ATOMIC_RELAXED);
+	int stale;
+
+	if (!force && now < check)
+		return;
+	/* only one sender does the check */
+	if (!__atomic_compare_exchange_n(&peer->check_ns, &check,
+				now + PEER_CHECK_INTERVAL_NS, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED) && !force)
+		return;
+
+	pthread_rwlock_rdlock(&peer->lock);
+	stale = force || peer_is_stale(peer);
+	pthread_rwlock_unlock(&peer->lock);
+	if (stale)
+		peer_reopen(peer);
+}
+
+/*
+ * peer_note_full - count a send which found the peer queue full
+ *
+ * The registry keeps a count of all senders, so the receiver sees
+ * its senders being held up. peer->lock must be held as reader.
+ */
+static void peer_note_full(struct ipc_peer *peer)
+{
+	struct registry *reg = __atomic_load_n(&peer_registry, __ATOMIC_ACQUIRE);
+
+	__atomic_add_fetch(&peer->full, 1, __ATOMIC_RELAXED);
+	if (peer->id && reg)
+		registry_note_full(reg, peer->id);
+}
+
+/*
+ * peer_do_send - send a frame with the transport of the peer
+ * @nonblock: fail with EAGAIN if the queue is full, else wait for
+ *	      room up to 3 seconds
+ */
+static int peer_do_send(struct ipc_peer *peer, void *buf, int length, int nonblock)
+{
+	struct ipc_hdr *hdr = (struct ipc_hdr *)buf;
+	unsigned int prio = IPC_HDR_GET_PRIO(hdr->flags);
+	struct registry *reg;
+	int ret;
+
+	pthread_rwlock_rdlock(&peer->lock);
+	reg = __atomic_load_n(&peer_registry, __ATOMIC_ACQUIRE);
+	if (peer->id && reg && !registry_alive(reg, peer->id, peer->gen)) {
+		/* the registry tells the app exited or restarted */
+		errno = EPIPE;
+		ret = -1;
+	} else if (peer->ring) {
+		ret = ring_push(peer->ring, buf, length);
+		if (ret < 0 && errno == EAGAIN) {
+			peer_note_full(peer);
+			if (!nonblock)
+				ret = ring_send_msg_timeout(peer->ring, buf, length);
+		}
+	} else if (peer->mqd != (mqd_t)-1) {
+		ret = mq_try_send(peer->mqd, buf, length, prio);
+		if (ret < 0 && errno == EAGAIN) {
+			peer_note_full(peer);
+			if (!nonblock)
+				ret = mq_send_msg_timeout(peer->mqd, buf, length, prio);
+		}
+	} else {
+		errno = ENOENT;
+		ret = -1;
+	}
+	pthread_rwlock_unlock(&peer->lock);
+	return ret;
+}
+
+static int peer_transmit(struct ipc_peer *peer, void *buf, int length, int nonblock)
+{
+	int ret;
+
+	peer_validate(peer, 0);
+	ret = peer_do_send(peer, buf, length, nonblock);
+	if (ret < 0 && (errno == EPIPE || errno == EBADF || errno == ENOENT)) {
+		/*
+		 * peer went away or has been recreated, retry once
+		 */
+		peer_validate(peer, 1);
+		ret = peer_do_send(peer, buf, length, nonblock);
+	}
+	return ret;
+}
+
+/*
+ * peer_frames_lost - drop the shared memory references of lost frames
+ * @data: frames, each 4 bytes aligned
+ * @length: bytes of all frames
+ *
+ * Senders were told batched and queued frames are sent, nobody else
+ * gives back the buffers they refer to.
+ */
+static void peer_frames_lost(char *data, int length)
+{
+	struct ipc_hdr *hdr;
+	struct shmbuf_desc desc;
+	int size;
+
+	while (length >= (int)sizeof(*hdr)) {
+		hdr = (struct ipc_hdr *)data;
+		size = sizeof(*hdr) + hdr->srclen + hdr->len +
+			((hdr->flags & IPC_HDR_STAMP) ? IPC_STAMP_SIZE : 0);
+		if (size > length)
+			return;
+		if ((hdr->flags & IPC_HDR_SHMBUF) && hdr->len == sizeof(desc)) {
+			memcpy(&desc, data + sizeof(*hdr) + hdr->srclen, sizeof(desc));
+			shmbuf_drop(&desc);
+		}
+		size = (size + 3) & ~3;
+		data += size;
+		length -= size;
+	}
+}
+
+/*
+ * peer_flush_locked - send the pending batch, batch_lock must be held
+ * @nonblock: keep the batch and fail with EAGAIN if the queue is full
+ *
+ * A batch of one frame is sent as the plain frame.
+ */
+static int peer_flush_locked(struct ipc_peer *peer, int nonblock)
+{
+	struct ipc_hdr *hdr = (struct ipc_hdr *)peer->batch;
+	int ret;
+
+	if (!peer->batch_count)
+		return 0;
+
+	if (peer->batch_count == 1) {
+		ret = peer_transmit(peer, peer->batch + sizeof(*hdr), peer->batch_first,
+				nonblock);
+	} else {
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->type = MSG_TYPE_BATCH;
+		hdr->flags = IPC_HDR_BATCH;
+		hdr->len = peer->batch_len - sizeof(*hdr);
+		ret = peer_transmit(peer, peer->batch, peer->batch_len, nonblock);
+	}
+	if (ret < 0 && nonblock && errno == EAGAIN)
+		return ret;
+	if (ret < 0) {
+		pr_err("peer %s batch of %d frames lost\n", peer->name, peer->batch_count);
+		peer_frames_lost(peer->batch + sizeof(*hdr), peer->batch_len - sizeof(*hdr));
+	}
+	peer->batch_len = sizeof(*hdr);
+	peer->batch_count = 0;
+	return ret;
+}
+
+/*
+ * peer_out_remove - free the first count queued frames
+ * @lost: frames were not sent
+ */
+static void peer_out_remove(struct ipc_peer *peer, int count, int lost)
+{
+	struct peer_frame *frame;
+
+	pthread_mutex_lock(&peer->out_lock);
+	while (count-- > 0 && peer->out_count) {
+		frame = list_node_entry(peer->out_frames.next, struct peer_frame, node);
+		list_node_del(&frame->node);
+		__atomic_store_n(&peer->out_count, peer->out_count - 1, __ATOMIC_RELAXED);
+		if (lost)
+			peer_frames_lost(frame->data, frame->length);
+		msgpool_free(&peer_frame_pool, frame);
+	}
+	pthread_mutex_unlock(&peer->out_lock);
+}
+
+/*
+ * peer_out_send - send the frames queued for the peer, batch_lock
+ * must be held
+ * @nonblock: stop with EAGAIN at a full queue, else wait for room
+ * @burst: most messages to send, 0 for no limit
+ *
+ * Frames are removed only by the holder of batch_lock, so they are
+ * read without out_lock once found. Frames queued together are
+ * packed into one message, prioritized ones are sent alone to keep
+ * their priority. Returns 0 when no frame is left, 1 if the burst
+ * was used up, -1 with errno EAGAIN if the queue is full.
+ */
+static int peer_out_send(struct ipc_peer *peer, int nonblock, int burst)
+{
+	char buf[MSG_QUEUE_MAX_SIZE] __attribute__((aligned(8)));
+	struct ipc_hdr *hdr = (struct ipc_hdr *)buf;
+	int msgsize = __atomic_load_n(&peer->msgsize, __ATOMIC_RELAXED);
+	struct peer_frame *first, *frame;
+	struct list_node *node;
+	int len, count, aligned, ret;
+	int sent = 0;
+
+	/* a pending batch holds older frames */
+	if (peer_flush_locked(peer, nonblock) < 0 && nonblock && errno == EAGAIN)
+		return -1;
+
+	for (;;) {
+		pthread_mutex_lock(&peer->out_lock);
+		if (!peer->out_count || (burst && sent >= burst)) {
+			ret = peer->out_count ? 1 : 0;
+			pthread_mutex_unlock(&peer->out_lock);
+			return ret;
+		}
+		first = list_node_entry(peer->out_frames.next, struct peer_frame, node);
+		len = sizeof(*hdr);
+		count = 0;
+		list_for_each_node(node, &peer->out_frames) {
+			frame = list_node_entry(node, struct peer_frame, node);
+			aligned = (frame->length + 3) & ~3;
+			if (IPC_HDR_GET_PRIO(((struct ipc_hdr *)frame->data)->flags)) {
+				if (!count)
+					count = 1;
+				break;
+			}
+			if (len + aligned > msgsize)
+				break;
+			memcpy(buf + len, frame->data, frame->length);
+			memset(buf + len + frame->length, 0, aligned - frame->length);
+			len += aligned;
+			count++;
+		}
+		pthread_mutex_unlock(&peer->out_lock);
+
+		if (count <= 1) {
+			/* a frame too big for a batch fails in transmit */
+			count = 1;
+			ret = peer_transmit(peer, first->data, first->length, nonblock);
+		} else {
+			memset(hdr, 0, sizeof(*hdr));
+			hdr->type = MSG_TYPE_BATCH;
+			hdr->flags = IPC_HDR_BATCH;
+			hdr->len = len - sizeof(*hdr);
+			ret = peer_transmit(peer, buf, len, nonblock);
+		}
+		if (ret < 0 && nonblock && errno == EAGAIN)
+			return -1;
+		if (ret < 0)
+			pr_err("peer %s %d queued frames lost, %s\n", peer->name, count,
+					strerror(errno));
+		peer_out_remove(peer, count, ret < 0);
+		sent++;
+	}
+}
+
+/*
+ * peer_out_queue - queue a frame for the outbound thread
+ */
+static int peer_out_queue(struct ipc_peer *peer, void *buf, int length)
+{
+	uint32_t depth = __atomic_load_n(&out_depth, __ATOMIC_RELAXED);
+	struct peer_frame *frame;
+
+	/* fail now, nobody would hear of the frame lost later */
+	if (length > MSG_QUEUE_MAX_SIZE ||
+			length > (int)__atomic_load_n(&peer->msgsize, __ATOMIC_RELAXED)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	pthread_mutex_lock(&peer->out_lock);
+	if (peer->out_count >= depth) {
+		pthread_mutex_unlock(&peer->out_lock);
+		pthread_rwlock_rdlock(&peer->lock);
+		peer_note_full(peer);
+		pthread_rwlock_unlock(&peer->lock);
+		errno = EAGAIN;
+		return -1;
+	}
+	frame = (struct peer_frame *)msgpool_alloc(&peer_frame_pool);
+	if (!frame) {
+		pthread_mutex_unlock(&peer->out_lock);
+		pr_err("peer frame alloc fail\n");
+		errno = ENOMEM;
+		return -1;
+	}
+	frame->length = length;
+	memcpy(frame->data, buf, length);
+	list_node_add_tail(&frame->node, &peer->out_frames);
+	__atomic_store_n(&peer->out_count, peer->out_count + 1, __ATOMIC_RELAXED);
+
+	/*
+	 * queue the peer to the outbound thread, it holds a reference
+	 * until all frames are sent
+	 */
+	pthread_mutex_lock(&out_list_lock);
+	if (!peer->oqueued) {
+		peer->oqueued = 1;
+		peer->retry = 0;
+		pthread_mutex_lock(&peer_lock);
+		peer->refcnt++;
+		pthread_mutex_unlock(&peer_lock);
+		list_node_add_tail(&peer->onode, &out_list);
+		pthread_cond_signal(&out_cond);
+	}
+	pthread_mutex_unlock(&out_list_lock);
+	pthread_mutex_unlock(&peer->out_lock);
+	return 0;
+}
+
+/*
+ * peer_out_done - put a peer taken from the outbound list back, or
+ * drop its reference if no frame is left
+ * @retry: time to try the peer again, 0 for now
+ */
+static void peer_out_done(struct ipc_peer *peer, uint64_t retry)
+{
+	pthread_mutex_lock(&peer->out_lock);
+	pthread_mutex_lock(&out_list_lock);
+	if (peer->out_count) {
+		peer->retry = retry;
+		list_node_add_tail(&peer->onode, &out_list);
+		if (out_running)
+			pthread_cond_signal(&out_cond);
+		pthread_mutex_unlock(&out_list_lock);
+		pthread_mutex_unlock(&peer->out_lock);
+		return;
+	}
+	peer->oqueued = 0;
+	pthread_mutex_unlock(&out_list_lock);
+	pthread_mutex_unlock(&peer->out_lock);
+	peer_put(peer);
+}
+
+/*
+ * peer_out_pop - take a peer off the outbound list, out_list_lock held
+ */
+static void peer_out_pop(struct ipc_peer *peer)
+{
+	list_node_del(&peer->onode);
+	INIT_LIST_NODE(&peer->onode);
+}
+
+/*
+ * peer_fit - drop the latency stamp of a frame too big for the peer
+ *
+ * The stamp is optional, a frame which fits the peer queue without
+ * it is sent unmeasured. Returns the length to send.
+ */
+static int peer_fit(struct ipc_peer *peer, void *buf, int length)
+{
+	struct ipc_hdr *hdr = (struct ipc_hdr *)buf;
+
+	if (length > (int)__atomic_load_n(&peer->msgsize, __ATOMIC_RELAXED) &&
+			(hdr->flags & IPC_HDR_STAMP)) {
+		hdr->flags &= ~IPC_HDR_STAMP;
+		length -= IPC_STAMP_SIZE;
+	}
+	return length;
+}
+
+int peer_send(struct ipc_peer *peer, void *buf, int length)
+{
+	int ret;
+
+	length = peer_fit(peer, buf, length);
+
+	if (!peer->batch && !__atomic_load_n(&peer->out_count, __ATOMIC_RELAXED))
+		return peer_transmit(peer, buf, length, 0);
+
+	/*
+	 * frames batched or queued before must go out first
+	 */
+	pthread_mutex_lock(&peer->batch_lock);
+	peer_out_send(peer, 0, 0);
+	ret = peer_transmit(peer, buf, length, 0);
+	pthread_mutex_unlock(&peer->batch_lock);
+	return ret;
+}
+
+int peer_try_send(struct ipc_peer *peer, void *buf, int length)
+{
+	int ret;
+
+	length = peer_fit(peer, buf, length);
+
+	if (__atomic_load_n(&out_depth, __ATOMIC_RELAXED))
+		return peer_out_queue(peer, buf, length);
+	if (!peer->batch)
+		return peer_transmit(peer, buf, length, 1);
+
+	/*
+	 * frames batched before must go out first, if they can't the
+	 * batch is left to the batch thread
+	 */
+	pthread_mutex_lock(&peer->batch_lock);
+	ret = peer_flush_locked(peer, 1);
+	if (ret == 0)
+		ret = peer_transmit(peer, buf, length, 1);
+	pthread_mutex_unlock(&peer->batch_lock);
+	return ret;
+}
+
+int peer_queue_stat(struct ipc_peer *peer, struct ipc_queue_stat *st)
+{
+	struct mq_attr attr;
+	int ret = 0;
+
+	memset(st, 0, sizeof(*st));
+	pthread_rwlock_rdlock(&peer->lock);
+	st->maxmsg = peer->maxmsg;
+	st->msgsize = peer->msgsize;
+	st->full = __atomic_load_n(&peer->full, __ATOMIC_RELAXED);
+	st->outbound = __atomic_load_n(&peer->out_count, __ATOMIC_RELAXED);
+	if (peer->ring) {
+		st->depth = ring_count(peer->ring);
+	} else if (peer->mqd != (mqd_t)-1 && mq_getattr(peer->mqd, &attr) == 0) {
+		st->depth = attr.mq_curmsgs;
+	} else {
+		errno = ENOENT;
+		ret = -1;
+	}
+	pthread_rwlock_unlock(&peer->lock);
+	return ret;
+}
+
+int peer_send_async(struct ipc_peer *peer, void *buf, int length)
+{
+	uint64_t linger = __atomic_load_n(&batch_linger_ns, __ATOMIC_RELAXED);
+	int msgsize = __atomic_load_n(&peer->msgsize, __ATOMIC_RELAXED);
+	int aligned;
+	int wake;
+
+	length = peer_fit(peer, buf, length);
+	aligned = (length + 3) & ~3;
+
+	if (__atomic_load_n(&out_depth, __ATOMIC_RELAXED))
+		return peer_out_queue(peer, buf, length);
+
+	/*
+	 * prioritized frames never wait for the linger time, a batch
+	 * must fit in one message of the peer queue
+	 */
+	if (!linger || aligned > msgsize - (int)sizeof(struct ipc_hdr) ||
+			IPC_HDR_GET_PRIO(((struct ipc_hdr *)buf)->flags))
+		return peer_send(peer, buf, length);
+
+	pthread_mutex_lock(&peer->batch_lock);
+	if (!peer->batch) {
+		peer->batch = (char *)malloc(MSG_QUEUE_MAX_SIZE);
+		if (!peer->batch) {
+			pthread_mutex_unlock(&peer->batch_lock);
+			return peer_transmit(peer, buf, length, 0);
+		}
+		peer->batch_len = sizeof(struct ipc_hdr);
+		peer->batch_count = 0;
+	}
+	/*
+	 * flush on size, frames in a batch are 4 bytes aligned. A lost
+	 * batch is logged, this frame is queued anyway.
+	 */
+	if (peer->batch_len + aligned > msgsize)
+		peer_flush_locked(peer, 0);
+	if (!peer->batch_count)
+		peer->batch_first = length;
+	memcpy(peer->batch + peer->batch_len, buf, length);
+	memset(peer->batch + peer->batch_len + length, 0, aligned - length);
+	peer->batch_len += aligned;
+	peer->batch_count++;
+
+	/*
+	 * queue the peer to be flushed by the batch thread
+	 */
+	pthread_mutex_lock(&batch_list_lock);
+	if (!peer->bqueued) {
+		wake = list_is_empty(&batch_list);
+		peer->deadline = peer_now_ns() + linger;
+		peer->bqueued = 1;
+		pthread_mutex_lock(&peer_lock);
+		peer->refcnt++;
+		pthread_mutex_unlock(&peer_lock);
+		list_node_add_tail(&peer->bnode, &batch_list);
+		if (wake)
+			pthread_cond_signal(&batch_cond);
+	}
+	pthread_mutex_unlock(&batch_list_lock);
+	pthread_mutex_unlock(&peer->batch_lock);
+	return 0;
+}
+
+/*
+ * peer_batch_pop - take the first queued peer, batch_list_lock held
+ */
+static struct ipc_peer *peer_batch_pop(void)
+{
+	struct ipc_peer *peer;
+
+	peer = list_node_entry(batch_list.next, struct ipc_peer, bnode);
+	list_node_del(&peer->bnode);
+	INIT_LIST_NODE(&peer->bnode);
+	peer->bqueued = 0;
+	return peer;
+}
+
+static void peer_batch_flush(struct ipc_peer *peer)
+{
+	pthread_mutex_lock(&peer->batch_lock);
+	peer_flush_locked(peer, 0);
+	pthread_mutex_unlock(&peer->batch_lock);
+	peer_put(peer);
+}
+
+static void *peer_batch_thread(void *arg)
+{
+	struct ipc_peer *peer;
+	struct timespec ts;
+	uint64_t now;
+
+	pthread_mutex_lock(&batch_list_lock);
+	while (batch_running) {
+		if (list_is_empty(&batch_list)) {
+			pthread_cond_wait(&batch_cond, &batch_list_lock);
+			continue;
+		}
+		peer = list_node_entry(batch_list.next, struct ipc_peer, bnode);
+		now = peer_now_ns();
+		if (peer->deadline > now) {
+			ts.tv_sec = peer->deadline / 1000000000ULL;
+			ts.tv_nsec = peer->deadline % 1000000000ULL;
+			pthread_cond_timedwait(&batch_cond, &batch_list_lock, &ts);
+			continue;
+		}
+		peer = peer_batch_pop();
+		pthread_mutex_unlock(&batch_list_lock);
+		peer_batch_flush(peer);
+		pthread_mutex_lock(&batch_list_lock);
+	}
+	pthread_mutex_unlock(&batch_list_lock);
+	return NULL;
+}
+
+/*
+ * peer_out_thread - send queued frames, round robin over the peers
+ *
+ * A peer gets PEER_OUT_BURST messages per turn. A peer whose queue
+ * is full, or which a sync sender is flushing, waits for its retry
+ * time at the tail while the others go on.
+ */
+static void *peer_out_thread(void *arg)
+{
+	struct ipc_peer *peer, *pos;
+	struct timespec ts;
+	uint64_t now, next;
+	int ret;
+
+	pthread_mutex_lock(&out_list_lock);
+	while (out_running) {
+		if (list_is_empty(&out_list)) {
+			pthread_cond_wait(&out_cond, &out_list_lock);
+			continue;
+		}
+		now = peer_now_ns();
+		next = UINT64_MAX;
+		peer = NULL;
+		list_for_each_node_entry(pos, &out_list, onode) {
+			if (pos->retry <= now) {
+				peer = pos;
+				break;
+			}
+			if (pos->retry < next)
+				next = pos->retry;
+		}
+		if (!peer) {
+			ts.tv_sec = next / 1000000000ULL;
+			ts.tv_nsec = next % 1000000000ULL;
+			pthread_cond_timedwait(&out_cond, &out_list_lock, &ts);
+			continue;
+		}
+		peer_out_pop(peer);
+		out_busy = peer;
+		pthread_mutex_unlock(&out_list_lock);
+
+		ret = -1;
+		if (pthread_mutex_trylock(&peer->batch_lock) == 0) {
+			ret = peer_out_send(peer, 1, PEER_OUT_BURST);
+			pthread_mutex_unlock(&peer->batch_lock);
+		}
+		peer_out_done(peer, ret < 0 ? peer_now_ns() + PEER_OUT_RETRY_NS : 0);
+		pthread_mutex_lock(&out_list_lock);
+		out_busy = NULL;
+		pthread_cond_broadcast(&out_idle);
+	}
+	pthread_mutex_unlock(&out_list_lock);
+	return NULL;
+}
+
+void peer_flush_all(void)
+{
+	struct ipc_peer *peer;
+
+	pthread_mutex_lock(&batch_list_lock);
+	while (!list_is_empty(&batch_list)) {
+		peer = peer_batch_pop();
+		pthread_mutex_unlock(&batch_list_lock);
+		peer_batch_flush(peer);
+		pthread_mutex_lock(&batch_list_lock);
+	}
+	pthread_mutex_unlock(&batch_list_lock);
+
+	pthread_mutex_lock(&out_list_lock);
+	for (;;) {
+		if (!list_is_empty(&out_list)) {
+			peer = list_node_entry(out_list.next, struct ipc_peer, onode);
+			peer_out_pop(peer);
+			pthread_mutex_unlock(&out_list_lock);
+			pthread_mutex_lock(&peer->batch_lock);
+			peer_out_send(peer, 0, 0);
+			pthread_mutex_unlock(&peer->batch_lock);
+			peer_out_done(peer, 0);
+			pthread_mutex_lock(&out_list_lock);
+			continue;
+		}
+		if (!out_busy)
+			break;
+		/*
+		 * the outbound thread holds a peer off the list, it puts
+		 * it back if frames are left
+		 */
+		pthread_cond_wait(&out_idle, &out_list_lock);
+	}
+	pthread_mutex_unlock(&out_list_lock);
+}
+
+int peer_outbound_enable(int depth)
+{
+	pthread_condattr_t attr;
+	int ret = 0;
+
+	pthread_mutex_lock(&out_list_lock);
+	if (!peer_frame_pool_inited) {
+		msgpool_init(&peer_frame_pool, "peer frame", sizeof(struct peer_frame),
+				32, 256);
+		peer_frame_pool_inited = 1;
+	}
+	if (depth > 0 && !out_running) {
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&out_cond, &attr);
+		pthread_condattr_destroy(&attr);
+		out_running = 1;
+		ret = pthread_create(&out_tid, NULL, peer_out_thread, NULL);
+		if (ret) {
+			pr_err("outbound thread create fail, %s\n", strerror(ret));
+			out_running = 0;
+			pthread_mutex_unlock(&out_list_lock);
+			return -1;
+		}
+	}
+	if (depth > 0) {
+		__atomic_store_n(&out_depth, depth, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&out_list_lock);
+		return 0;
+	}
+	__atomic_store_n(&out_depth, 0, __ATOMIC_RELAXED);
+	if (out_running) {
+		out_running = 0;
+		pthread_cond_signal(&out_cond);
+		pthread_mutex_unlock(&out_list_lock);
+		pthread_join(out_tid, NULL);
+		peer_flush_all();
+		pthread_cond_destroy(&out_cond);
+		return 0;
+	}
+	pthread_mutex_unlock(&out_list_lock);
+	return ret;
+}
+
+int peer_batch_enable(int linger_us)
+{
+	pthread_condattr_t attr;
+	int ret = 0;
+
+	pthread_mutex_lock(&batch_list_lock);
+	__atomic_store_n(&batch_linger_ns, (uint64_t)linger_us * 1000ULL, __ATOMIC_RELAXED);
+	if (linger_us > 0 && !batch_running) {
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&batch_cond, &attr);
+		pthread_condattr_destroy(&attr);
+		batch_running = 1;
+		ret = pthread_create(&batch_tid, NULL, peer_batch_thread, NULL);
+		if (ret) {
+			pr_err("batch thread create fail, %s\n", strerror(ret));
+			batch_running = 0;
+			batch_linger_ns = 0;
+			ret = -1;
+		}
+		pthread_mutex_unlock(&batch_list_lock);
+		return ret;
+	}
+	if (linger_us <= 0 && batch_running) {
+		batch_running = 0;
+		pthread_cond_signal(&batch_cond);
+		pthread_mutex_unlock(&batch_list_lock);
+		pthread_join(batch_tid, NULL);
+		pthread_cond_destroy(&batch_cond);
+		peer_flush_all();
+		return 0;
+	}
+	pthread_mutex_unlock(&batch_list_lock);
+	return 0;
+}
+
+void peer_invalidate(const char *name)
+{
+	struct ipc_peer *peer;
+
+	if (name[0] == '/')
+		name++;
+
+	pthread_mutex_lock(&peer_lock);
+	if (peer_table_inited) {
+		peer = peer_lookup(name, peer_hash(name));
+		if (peer)
+			peer_unlink(peer);
+	}
+	pthread_mutex_unlock(&peer_lock);
+}
+
+void peer_table_clear(void)
+{
+	struct list_node *node;
+
+	peer_outbound_enable(0);
+	peer_batch_enable(0);
+	peer_flush_all();
+
+	pthread_mutex_lock(&peer_lock);
+	while (!list_is_empty(&peer_lru)) {
+		node = peer_lru.next;
+		peer_unlink(list_node_entry(node, struct ipc_peer, lru));
+	}
+	pthread_mutex_unlock(&peer_lock);
+}
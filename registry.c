@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LOG_TAG "registry"
+//#define LOG_DEBUG
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "debug.h"
+#include "registry.h"
+
+#define REGISTRY_COPY_TRIES 1000
+
+struct registry *registry_open(void)
+{
+	struct registry *reg;
+	size_t size;
+	void *addr;
+	int fd;
+
+	size = sizeof(struct registry_header) +
+		REGISTRY_SLOTS * sizeof(struct registry_entry);
+
+	/*
+	 * Every endpoint may be the first one, a new object is zero
+	 * filled which is an empty table.
+	 */
+	fd = shm_open(REGISTRY_SHM_NAME, O_CREAT | O_RDWR, 0666);
+	if (fd < 0) {
+		pr_err("shm_open %s failed, %s\n", REGISTRY_SHM_NAME, strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(fd, size) < 0) {
+		pr_err("ftruncate failed, %s\n", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		pr_err("mmap failed, %s\n", strerror(errno));
+		return NULL;
+	}
+
+	reg = (struct registry *)malloc(sizeof(*reg));
+	if (!reg) {
+		pr_err("registry malloc fail\n");
+		munmap(addr, size);
+		return NULL;
+	}
+	reg->hdr = (struct registry_header *)addr;
+	reg->entries = (struct registry_entry *)(reg->hdr + 1);
+	reg->size = size;
+	reg->hdr->slots = REGISTRY_SLOTS;
+	__atomic_store_n(&reg->hdr->magic, REGISTRY_MAGIC, __ATOMIC_RELEASE);
+	return reg;
+}
+
+void registry_close(struct registry *reg)
+{
+	if (!reg)
+		return;
+	munmap(reg->hdr, reg->size);
+	free(reg);
+}
+
+/*
+ * registry_hash - FNV-1a hash of an app name, same as peer_hash
+ */
+static uint32_t registry_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (uint8_t)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int registry_pid_dead(pid_t pid)
+{
+	return kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+/*
+ * registry_claim - move an entry from state old to REGISTRY_INIT
+ *
+ * The claimer is the only writer of the entry until it stores
+ * another state in registry_write_end.
+ */
+static int registry_claim(struct registry_entry *entry, uint32_t old)
+{
+	return __atomic_compare_exchange_n(&entry->state, &old, REGISTRY_INIT, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void registry_write_begin(struct registry_entry *entry)
+{
+	__atomic_store_n(&entry->gen, entry->gen + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void registry_write_end(struct registry_entry *entry, uint32_t state)
+{
+	__atomic_store_n(&entry->state, state, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->gen, entry->gen + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * registry_copy - copy an entry which isn't being written
+ */
+static int registry_copy(struct registry_entry *entry, struct registry_entry *out)
+{
+	uint32_t gen;
+	int i;
+
+	for (i = 0; i < REGISTRY_COPY_TRIES; i++) {
+		gen = __atomic_load_n(&entry->gen, __ATOMIC_ACQUIRE);
+		if (!(gen & 1)) {
+			memcpy(out, entry, sizeof(*out));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&entry->gen, __ATOMIC_RELAXED) == gen &&
+					out->state != REGISTRY_INIT) {
+				out->gen = gen;
+				out->name[REGISTRY_NAME_SIZE - 1] = '\0';
+				return 0;
+			}
+		}
+		/* a writer is in the middle of a few stores */
+		sched_yield();
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+int registry_register(struct registry *reg, const char *name,
+			uint32_t transport, uint32_t caps)
+{
+	struct registry_entry *entry;
+	uint32_t hash, state, old = REGISTRY_FREE;
+	int i, index, spare;
+
+	if (name[0] == '/')
+		name++;
+	hash = registry_hash(name);
+
+	do {
+		index = -1;
+		spare = -1;
+		for (i = 0; i < REGISTRY_SLOTS; i++) {
+			entry = &reg->entries[(hash + i) % REGISTRY_SLOTS];
+			state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+			if (state == REGISTRY_FREE || state == REGISTRY_DEAD) {
+				if (spare < 0) {
+					spare = (hash + i) % REGISTRY_SLOTS;
+					old = state;
+				}
+				if (state == REGISTRY_FREE)
+					break;
+			}
+			/* take over the entry of an earlier instance */
+			if ((state == REGISTRY_USED || state == REGISTRY_DEAD) &&
+					__atomic_load_n(&entry->hash, __ATOMIC_RELAXED) == hash &&
+					!strncmp(entry->name, name, REGISTRY_NAME_SIZE)) {
+				index = (hash + i) % REGISTRY_SLOTS;
+				old = state;
+				break;
+			}
+		}
+		if (index < 0)
+			index = spare;
+		if (index < 0) {
+			pr_err("registry full\n");
+			errno = ENOSPC;
+			return -1;
+		}
+		/* lost the entry to another endpoint, look again */
+	} while (!registry_claim(&reg->entries[index], old));
+
+	entry = &reg->entries[index];
+	registry_write_begin(entry);
+	snprintf(entry->name, REGISTRY_NAME_SIZE, "%s", name);
+	entry->hash = hash;
+	entry->pid = getpid();
+	entry->transport = transport;
+	entry->caps = caps;
+	__atomic_store_n(&entry->full, 0, __ATOMIC_RELAXED);
+	registry_write_end(entry, REGISTRY_USED);
+	pr_info("registered %s, id %d\n", name, index + 1);
+	return index + 1;
+}
+
+void registry_unregister(struct registry *reg, uint32_t id)
+{
+	struct registry_entry *entry;
+
+	if (id == 0 || id > REGISTRY_SLOTS)
+		return;
+	entry = &reg->entries[id - 1];
+	if (!registry_claim(entry, REGISTRY_USED))
+		return;
+	/* the entry may have been taken over by a new instance */
+	if (entry->pid != getpid()) {
+		__atomic_store_n(&entry->state, REGISTRY_USED, __ATOMIC_RELEASE);
+		return;
+	}
+	registry_write_begin(entry);
+	entry->pid = 0;
+	registry_write_end(entry, REGISTRY_DEAD);
+}
+
+void registry_set_caps(struct registry *reg, uint32_t id, uint32_t caps)
+{
+	if (id == 0 || id > REGISTRY_SLOTS)
+		return;
+	__atomic_fetch_or(&reg->entries[id - 1].caps, caps, __ATOMIC_RELEASE);
+}
+
+int registry_lookup(struct registry *reg, const char *name,
+			struct registry_entry *entry)
+{
+	struct registry_entry *e;
+	uint32_t hash, state;
+	int i, index, dead = 0;
+
+	if (name[0] == '/')
+		name++;
+	hash = registry_hash(name);
+
+	for (i = 0; i < REGISTRY_SLOTS; i++) {
+		index = (hash + i) % REGISTRY_SLOTS;
+		e = &reg->entries[index];
+		state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+		if (state == REGISTRY_FREE)
+			break;
+		if (__atomic_load_n(&e->hash, __ATOMIC_RELAXED) != hash ||
+				registry_copy(e, entry) < 0 ||
+				strncmp(entry->name, name, REGISTRY_NAME_SIZE))
+			continue;
+		if (entry->state == REGISTRY_USED)
+			return index + 1;
+		dead = 1;
+	}
+	errno = dead ? ESRCH : ENOENT;
+	return -1;
+}
+
+int registry_get(struct registry *reg, uint32_t id, struct registry_entry *entry)
+{
+	if (id == 0 || id > REGISTRY_SLOTS ||
+			registry_copy(&reg->entries[id - 1], entry) < 0 ||
+			entry->state != REGISTRY_USED) {
+		errno = ESRCH;
+		return -1;
+	}
+	return 0;
+}
+
+int registry_prune(struct registry *reg)
+{
+	struct registry_entry *entry;
+	int i, pruned = 0;
+	pid_t pid;
+
+	for (i = 0; i < REGISTRY_SLOTS; i++) {
+		entry = &reg->entries[i];
+		if (__atomic_load_n(&entry->state, __ATOMIC_ACQUIRE) != REGISTRY_USED)
+			continue;
+		pid = __atomic_load_n(&entry->pid, __ATOMIC_RELAXED);
+		if (!registry_pid_dead(pid) || !registry_claim(entry, REGISTRY_USED))
+			continue;
+		if (entry->pid != pid) {
+			__atomic_store_n(&entry->state, REGISTRY_USED, __ATOMIC_RELEASE);
+			continue;
+		}
+		pr_info("unregister %s, exited\n", entry->name);
+		registry_write_begin(entry);
+		entry->pid = 0;
+		registry_write_end(entry, REGISTRY_DEAD);
+		pruned++;
+	}
+	return pruned;
+}
@@ -0,0 +1,414 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LOG_TAG "ring"
+//#define LOG_DEBUG
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mqueue.h>
+#include "debug.h"
+#include "futex.h"
+#include "ring.h"
+
+static inline struct ring_slot *ring_slot_at(struct ring *r, uint32_t pos)
+{
+	return (struct ring_slot *)(r->slots +
+			(size_t)(pos & (r->hdr->slots - 1)) * r->hdr->stride);
+}
+
+static struct ring *ring_map(const char *name, int fd, size_t size, int owner)
+{
+	struct ring *r;
+	struct stat st;
+	void *addr;
+
+	if (fstat(fd, &st) < 0) {
+		pr_err("fstat failed, %s\n", strerror(errno));
+		return NULL;
+	}
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		pr_err("mmap failed, %s\n", strerror(errno));
+		return NULL;
+	}
+
+	r = (struct ring *)malloc(sizeof(struct ring));
+	if (!r) {
+		pr_err("ring malloc fail\n");
+		munmap(addr, size);
+		return NULL;
+	}
+	memset(r, 0, sizeof(struct ring));
+	snprintf(r->name, RING_NAME_SIZE, "%s", name);
+	r->hdr = (struct ring_header *)addr;
+	r->slots = (char *)addr + sizeof(struct ring_header);
+	r->size = size;
+	r->ino = st.st_ino;
+	r->owner = owner;
+	r->bell = (mqd_t)-1;
+	return r;
+}
+
+struct ring *ring_create(const char *name, uint32_t slots, uint32_t slot_size)
+{
+	struct ring *r;
+	struct ring_slot *slot;
+	uint32_t count = 1;
+	uint32_t stride;
+	size_t size;
+	uint32_t i;
+	int fd;
+
+	while (count < slots)
+		count <<= 1;
+	stride = (sizeof(struct ring_slot) + slot_size + 63) & ~63;
+	size = sizeof(struct ring_header) + (size_t)count * stride;
+
+	shm_unlink(name);
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0) {
+		pr_err("shm_open %s failed, %s\n", name, strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(fd, size) < 0) {
+		pr_err("ftruncate failed, %s\n", strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	r = ring_map(name, fd, size, 1);
+	close(fd);
+	if (!r) {
+		shm_unlink(name);
+		return NULL;
+	}
+
+	r->hdr->slots = count;
+	r->hdr->slot_size = slot_size;
+	r->hdr->stride = stride;
+	r->hdr->owner = getpid();
+	for (i = 0; i < count; i++) {
+		slot = ring_slot_at(r, i);
+		slot->seq = i;
+	}
+	/*
+	 * Publish magic at last, producers check it when mapping.
+	 */
+	__atomic_store_n(&r->hdr->magic, RING_MAGIC, __ATOMIC_RELEASE);
+	pr_info("ring created at:%s, slots:%u, slot size:%u\n", name, count, slot_size);
+	return r;
+}
+
+struct ring *ring_open(const char *name)
+{
+	struct ring *r;
+	struct stat st;
+	int fd;
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct ring_header)) {
+		close(fd);
+		errno = ENOENT;
+		return NULL;
+	}
+
+	r = ring_map(name, fd, st.st_size, 0);
+	close(fd);
+	if (!r)
+		return NULL;
+
+	/*
+	 * Ring left by a dead or closed owner is treated as not exist.
+	 */
+	if (__atomic_load_n(&r->hdr->magic, __ATOMIC_ACQUIRE) != RING_MAGIC ||
+			__atomic_load_n(&r->hdr->closed, __ATOMIC_ACQUIRE) ||
+			(kill(r->hdr->owner, 0) < 0 && errno == ESRCH)) {
+		ring_close(r);
+		errno = ENOENT;
+		return NULL;
+	}
+	return r;
+}
+
+static void ring_bell_name(struct ring *r, char *name, int size)
+{
+	snprintf(name, size, "%s.bell", r->name);
+}
+
+/*
+ * ring_bell - wake up a consumer waiting on the doorbell queue
+ *
+ * A full queue means the doorbell is already ringing.
+ */
+static void ring_bell(struct ring *r)
+{
+	char name[RING_NAME_SIZE + 8];
+	char byte = 0;
+	mqd_t bell, old = (mqd_t)-1;
+
+	bell = __atomic_load_n(&r->bell, __ATOMIC_ACQUIRE);
+	if (bell == (mqd_t)-1) {
+		ring_bell_name(r, name, sizeof(name));
+		bell = mq_open(name, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+		if (bell == (mqd_t)-1) {
+			pr_err("doorbell open fail, %s\n", strerror(errno));
+			return;
+		}
+		if (!__atomic_compare_exchange_n(&r->bell, &old, bell, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			mq_close(bell);
+			bell = old;
+		}
+	}
+	if (mq_send(bell, &byte, 1, 0) < 0 && errno != EAGAIN)
+		pr_err("doorbell send fail, %s\n", strerror(errno));
+}
+
+int ring_push(struct ring *r, const void *buf, uint32_t len)
+{
+	struct ring_header *hdr = r->hdr;
+	struct ring_slot *slot;
+	uint32_t pos, seq;
+	int32_t dif;
+
+	if (__atomic_load_n(&hdr->closed, __ATOMIC_RELAXED)) {
+		errno = EPIPE;
+		return -1;
+	}
+	if (len > hdr->slot_size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	/*
+	 * Reserve a slot: the slot is free for position pos when its
+	 * sequence equals pos, the winner of the CAS on head owns it.
+	 */
+	pos = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = ring_slot_at(r, pos);
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		dif = (int32_t)(seq - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&hdr->head, &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			errno = EAGAIN;
+			return -1;
+		} else {
+			pos = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(slot->data, buf, len);
+	slot->len = len;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/*
+	 * Pairs with the fence in ring_pop: either the consumer sees the
+	 * new slot before sleeping, or we see it sleeping and wake it up.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&hdr->sleeping, __ATOMIC_RELAXED)) {
+		if (__atomic_load_n(&hdr->doorbell, __ATOMIC_ACQUIRE)) {
+			/* only the first producer rings */
+			if (__atomic_exchange_n(&hdr->sleeping, 0, __ATOMIC_RELAXED))
+				ring_bell(r);
+			return 0;
+		}
+		__atomic_add_fetch(&hdr->wake_seq, 1, __ATOMIC_RELEASE);
+		futex_wake(&hdr->wake_seq, 1, 1);
+	}
+	return 0;
+}
+
+static int ring_try_pop(struct ring *r, void *buf, uint32_t maxlen)
+{
+	struct ring_header *hdr = r->hdr;
+	struct ring_slot *slot;
+	uint32_t pos = hdr->tail;
+	uint32_t seq;
+	int len;
+
+	slot = ring_slot_at(r, pos);
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if ((int32_t)(seq - (pos + 1)) < 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	len = slot->len;
+	if (len > maxlen) {
+		/* drop the message, like mq_receive can't take it either */
+		pr_err("ring message too large, len:%d\n", len);
+		len = -1;
+		errno = EMSGSIZE;
+	} else {
+		memcpy(buf, slot->data, len);
+	}
+	__atomic_store_n(&slot->seq, pos + hdr->slots, __ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->tail, pos + 1, __ATOMIC_RELEASE);
+	return len;
+}
+
+int ring_pop(struct ring *r, void *buf, uint32_t maxlen, int timeout_ms)
+{
+	struct ring_header *hdr = r->hdr;
+	struct timespec now, deadline, wait;
+	uint32_t seq;
+	int len;
+
+	if (timeout_ms >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec = deadline.tv_nsec % 1000000000;
+	}
+
+	for (;;) {
+		len = ring_try_pop(r, buf, maxlen);
+		if (len >= 0 || errno != EAGAIN || timeout_ms == 0)
+			return len;
+
+		seq = __atomic_load_n(&hdr->wake_seq, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&hdr->sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		len = ring_try_pop(r, buf, maxlen);
+		if (len >= 0 || errno != EAGAIN) {
+			__atomic_store_n(&hdr->sleeping, 0, __ATOMIC_RELAXED);
+			return len;
+		}
+
+		if (timeout_ms >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			wait.tv_sec = deadline.tv_sec - now.tv_sec;
+			wait.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+			if (wait.tv_nsec < 0) {
+				wait.tv_sec--;
+				wait.tv_nsec += 1000000000;
+			}
+			if (wait.tv_sec < 0) {
+				__atomic_store_n(&hdr->sleeping, 0, __ATOMIC_RELAXED);
+				errno = ETIMEDOUT;
+				return -1;
+			}
+		}
+		futex_wait(&hdr->wake_seq, seq, timeout_ms >= 0 ? &wait : NULL, 1);
+		__atomic_store_n(&hdr->sleeping, 0, __ATOMIC_RELAXED);
+	}
+}
+
+mqd_t ring_doorbell(struct ring *r)
+{
+	char name[RING_NAME_SIZE + 8];
+	struct mq_attr attr;
+	mqd_t bell;
+
+	if (r->bell != (mqd_t)-1)
+		return r->bell;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.mq_maxmsg = 1;
+	attr.mq_msgsize = 1;
+	ring_bell_name(r, name, sizeof(name));
+	mq_unlink(name);
+	bell = mq_open(name, O_CREAT | O_EXCL | O_RDONLY | O_NONBLOCK | O_CLOEXEC,
+			0644, &attr);
+	if (bell == (mqd_t)-1) {
+		pr_err("doorbell create fail, %s\n", strerror(errno));
+		return bell;
+	}
+	r->bell = bell;
+	__atomic_store_n(&r->hdr->doorbell, 1, __ATOMIC_RELEASE);
+	return bell;
+}
+
+int ring_doorbell_arm(struct ring *r)
+{
+	struct ring_header *hdr = r->hdr;
+	struct ring_slot *slot;
+	char byte;
+
+	while (mq_receive(r->bell, &byte, 1, NULL) >= 0)
+		;
+
+	/* same handshake as ring_pop before futex_wait */
+	__atomic_store_n(&hdr->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	slot = ring_slot_at(r, hdr->tail);
+	if ((int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+				(hdr->tail + 1)) >= 0) {
+		__atomic_store_n(&hdr->sleeping, 0, __ATOMIC_RELAXED);
+		errno = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+void ring_doorbell_disarm(struct ring *r)
+{
+	__atomic_store_n(&r->hdr->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+void ring_close(struct ring *r)
+{
+	if (!r)
+		return;
+	if (r->bell != (mqd_t)-1)
+		mq_close(r->bell);
+	munmap(r->hdr, r->size);
+	free(r);
+}
+
+void ring_destroy(struct ring *r)
+{
+	char name[RING_NAME_SIZE + 8];
+
+	if (!r)
+		return;
+	__atomic_store_n(&r->hdr->closed, 1, __ATOMIC_RELEASE);
+	shm_unlink(r->name);
+	if (r->bell != (mqd_t)-1) {
+		ring_bell_name(r, name, sizeof(name));
+		mq_unlink(name);
+	}
+	ring_close(r);
+}
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "ipc.h"
+#include "debug.h"
+
+/*
+ * ipc_loop_bench [messages] [ring]
+ *
+ * A server is forked for each ipc_main_loop backend, the parent
+ * streams async messages to it and then makes sync calls, to compare
+ * throughput, server cpu per message and round trip time.
+ */
+
+#define BENCH_SERVER "loop_bench"
+#define BENCH_CLIENT "loop_bench_cli"
+#define BENCH_MSG_DATA 1
+#define BENCH_MSG_CALL 2
+#define BENCH_MSG_END 3
+#define BENCH_CALLS 2000
+#define BENCH_PAYLOAD 32
+
+struct bench_result {
+	uint64_t end_us;
+	uint64_t cpu_us;
+	uint64_t handled;
+	struct ipc_stats stats;
+};
+
+static int messages = 200000;
+/* server writes its result and the client reads it */
+static int result_fd;
+static uint64_t handled;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint64_t cpu_us(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec * 1000000ULL + ru.ru_utime.tv_usec +
+		ru.ru_stime.tv_sec * 1000000ULL + ru.ru_stime.tv_usec;
+}
+
+static void server_handler(void *data)
+{
+	struct ipc_msg *msg = (struct ipc_msg *)data;
+	struct ipc_reply reply;
+	struct bench_result result;
+
+	switch (msg->type) {
+	case BENCH_MSG_DATA:
+		handled++;
+		break;
+	case BENCH_MSG_CALL:
+		memset(&reply, 0, sizeof(reply));
+		ipc_send_reply(msg, &reply);
+		break;
+	case BENCH_MSG_END:
+		memset(&result, 0, sizeof(result));
+		result.end_us = now_us();
+		result.cpu_us = cpu_us();
+		result.handled = handled;
+		ipc_get_stats(&result.stats);
+		if (write(result_fd, &result, sizeof(result)) != sizeof(result))
+			pr_err("result write fail\n");
+		ipc_stop_loop();
+		break;
+	}
+}
+
+static void client_handler(void *data)
+{
+}
+
+static void run_server(int flags)
+{
+	char ready = 1;
+
+	ipc_init_ex(BENCH_SERVER, server_handler, flags);
+	if (write(result_fd, &ready, 1) != 1)
+		err_exit("ready write fail\n");
+	ipc_main_loop();
+	ipc_deinit();
+	_exit(0);
+}
+
+/*
+ * client_thread - measure the server, replies of sync calls are
+ * received by ipc_main_loop of the client process
+ */
+static void *client_thread(void *private)
+{
+	const char *name = (const char *)private;
+	char payload[BENCH_PAYLOAD];
+	struct bench_result result;
+	struct ipc_msg msg;
+	struct ipc_reply reply;
+	uint64_t start, cost, rtt;
+	int i;
+
+	/* round trips first, the server is idle and sleeps between calls */
+	memset(&msg, 0, sizeof(msg));
+	msg.type = BENCH_MSG_CALL;
+	start = now_us();
+	for (i = 0; i < BENCH_CALLS; i++) {
+		if (ipc_send_msg_sync(BENCH_SERVER, &msg, &reply) < 0)
+			err_exit("sync call fail\n");
+	}
+	rtt = now_us() - start;
+
+	memset(payload, 'x', sizeof(payload));
+	start = now_us();
+	for (i = 0; i < messages; i++) {
+		if (ipc_send_buf(BENCH_SERVER, BENCH_MSG_DATA, payload, sizeof(payload)) < 0)
+			err_exit("send fail\n");
+	}
+	ipc_send_buf(BENCH_SERVER, BENCH_MSG_END, NULL, 0);
+
+	if (read(result_fd, &result, sizeof(result)) != sizeof(result))
+		err_exit("result read fail\n");
+
+	cost = result.end_us - start;
+	printf("%-8s messages:%llu rate:%.0f msg/s server cpu:%.2fus/msg"
+			" frames/wakeup:%.1f rtt:%.1fus\n",
+			name, (unsigned long long)result.handled,
+			result.handled * 1000000.0 / (cost ? cost : 1),
+			(double)result.cpu_us / (result.handled ? result.handled : 1),
+			(double)result.stats.recv_frames /
+			(result.stats.recv_batches ? result.stats.recv_batches : 1),
+			(double)rtt / BENCH_CALLS);
+	fflush(stdout);
+	ipc_stop_loop();
+	return NULL;
+}
+
+/*
+ * run_client - measure one server, in a process of its own since
+ * an endpoint can't be inited again after fork
+ */
+static void run_client(const char *name, int fd)
+{
+	pthread_t tid;
+	char ready;
+
+	if (read(fd, &ready, 1) != 1)
+		err_exit("server start fail\n");
+	result_fd = fd;
+	ipc_init(BENCH_CLIENT, client_handler);
+	if (pthread_create(&tid, NULL, client_thread, (void *)name))
+		err_exit("pthread create fail\n");
+	ipc_main_loop();
+	pthread_join(tid, NULL);
+	ipc_deinit();
+	_exit(0);
+}
+
+static void run_bench(const char *name, int flags)
+{
+	pid_t server, client;
+	int fds[2];
+
+	if (pipe(fds) < 0)
+		err_exit("pipe fail\n");
+	server = fork();
+	if (server < 0)
+		err_exit("fork fail\n");
+	if (!server) {
+		close(fds[0]);
+		result_fd = fds[1];
+		run_server(flags);
+	}
+	client = fork();
+	if (client < 0)
+		err_exit("fork fail\n");
+	if (!client) {
+		close(fds[1]);
+		run_client(name, fds[0]);
+	}
+	close(fds[0]);
+	close(fds[1]);
+	waitpid(client, NULL, 0);
+	waitpid(server, NULL, 0);
+}
+
+int main(int argc, char *argv[])
+{
+	int ring = 0;
+
+	if (argc > 1)
+		messages = atoi(argv[1]);
+	if (argc > 2 && !strcmp(argv[2], "ring"))
+		ring = IPC_INIT_RING;
+	if (messages <= 0)
+		err_exit("usage: %s [messages] [ring]\n", argv[0]);
+
+	run_bench("default", ring);
+	run_bench("epoll", ring | IPC_INIT_EPOLL);
+	run_bench("io_uring", ring | IPC_INIT_URING);
+	return 0;
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "looper.h"
+#include "debug.h"
+
+/*
+ * looper_bench [producers] [messages per producer]
+ *
+ * Several threads dispatch into one looper, compare the mutex
+ * list with LOOPER_F_LOCKFREE.
+ */
+
+static int producers = 4;
+static int messages = 200000;
+static uint32_t handled;
+
+static void bench_handler(void *data)
+{
+	__atomic_add_fetch(&handled, 1, __ATOMIC_RELEASE);
+}
+
+static void *producer_thread(void *private)
+{
+	struct looper *looper = (struct looper *)private;
+	int i;
+
+	for (i = 0; i < messages; i++)
+		looper->dispatch(looper, NULL);
+	return NULL;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void run_bench(const char *name, int flags)
+{
+	pthread_t tid[producers];
+	struct looper *looper;
+	uint32_t total = producers * messages;
+	uint64_t start, cost;
+	int i;
+
+	looper = looper_create_flags(bench_handler, NULL, name, flags);
+	if (!looper)
+		err_exit("looper create fail\n");
+	handled = 0;
+	looper->start(looper);
+
+	start = now_us();
+	for (i = 0; i < producers; i++)
+		pthread_create(&tid[i], NULL, producer_thread, looper);
+	for (i = 0; i < producers; i++)
+		pthread_join(tid[i], NULL);
+	while (__atomic_load_n(&handled, __ATOMIC_ACQUIRE) < total)
+		usleep(100);
+	cost = now_us() - start;
+
+	printf("%-8s producers:%d messages:%u cost:%lluus rate:%.0f msg/s\n",
+			name, producers, total, (unsigned long long)cost,
+			total * 1000000.0 / (cost ? cost : 1));
+	looper_destory(looper);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		producers = atoi(argv[1]);
+	if (argc > 2)
+		messages = atoi(argv[2]);
+	if (producers <= 0 || messages <= 0)
+		err_exit("usage: %s [producers] [messages]\n", argv[0]);
+
+	run_bench("mutex", 0);
+	run_bench("lockfree", LOOPER_F_LOCKFREE);
+	return 0;
+}
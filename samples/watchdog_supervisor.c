@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "heartbeat.h"
+#include "debug.h"
+
+/*
+ * watchdog_supervisor "command" ["command" ...]
+ *
+ * Start every command, scan the shared heartbeat table, kill apps
+ * which stopped beating and start again commands which exited.
+ * Apps opt in by ipc_watchdog_init_ex(second, IPC_WATCHDOG_HEARTBEAT),
+ * they don't need a watchdog timer of their own then.
+ */
+
+#define SUPERVISOR_SCAN_MS 200
+#define SUPERVISOR_MAX_APPS 64
+#define SUPERVISOR_CMD_SIZE 512
+
+struct supervised_app {
+	char cmd[SUPERVISOR_CMD_SIZE];
+	pid_t pid;
+	int restarts;
+};
+
+static struct supervised_app apps[SUPERVISOR_MAX_APPS];
+static int app_count;
+
+static pid_t spawn_app(struct supervised_app *app)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		pr_err("fork fail, %s\n", strerror(errno));
+		return -1;
+	}
+	if (!pid) {
+		execl("/bin/sh", "sh", "-c", app->cmd, (char *)NULL);
+		_exit(127);
+	}
+	pr_info("started pid:%d, %s\n", pid, app->cmd);
+	return pid;
+}
+
+static void kill_stale(struct heartbeat_slot *slot, uint64_t age_ms, void *data)
+{
+	pr_err("%s pid:%d no heartbeat for %llums, kill it\n", slot->name,
+			slot->pid, (unsigned long long)age_ms);
+	kill(slot->pid, SIGKILL);
+}
+
+static void reap_apps(void)
+{
+	int status, i;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < app_count; i++) {
+			if (apps[i].pid != pid)
+				continue;
+			pr_info("pid:%d exited, status:0x%x, restart %s\n", pid,
+					status, apps[i].cmd);
+			apps[i].restarts++;
+			apps[i].pid = spawn_app(&apps[i]);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct heartbeat *hb;
+	int i;
+
+	if (argc < 2 || argc - 1 > SUPERVISOR_MAX_APPS)
+		err_exit("usage: %s \"command\" [\"command\" ...]\n", argv[0]);
+
+	hb = heartbeat_open();
+	if (!hb)
+		err_exit("heartbeat table open fail\n");
+
+	for (i = 1; i < argc; i++) {
+		/* exec, so the supervised pid is the app itself */
+		snprintf(apps[app_count].cmd, SUPERVISOR_CMD_SIZE, "exec %s", argv[i]);
+		apps[app_count].pid = spawn_app(&apps[app_count]);
+		app_count++;
+	}
+
+	for (;;) {
+		heartbeat_scan(hb, kill_stale, NULL);
+		reap_apps();
+		usleep(SUPERVISOR_SCAN_MS * 1000);
+	}
+
+	heartbeat_close(hb);
+	return 0;
+}
@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LOG_TAG "shmbuf"
+//#define LOG_DEBUG
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "debug.h"
+#include "shmbuf.h"
+
+static LIST_NODE(shmbuf_pools);
+static pthread_mutex_t shmbuf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void shmbuf_path(char *path, uint32_t id)
+{
+	snprintf(path, SHMBUF_NAME_SIZE, "/ipc-pool-%08x", id);
+}
+
+static inline char *shmbuf_base(struct shmbuf_pool *pool)
+{
+	return (char *)pool->hdr + pool->hdr->data_offset;
+}
+
+static struct shmbuf_pool *shmbuf_pool_map(uint32_t id, int fd, size_t size, int owner)
+{
+	struct shmbuf_pool *pool;
+	void *addr;
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		pr_err("mmap failed, %s\n", strerror(errno));
+		return NULL;
+	}
+	pool = (struct shmbuf_pool *)malloc(sizeof(*pool));
+	if (!pool) {
+		pr_err("pool malloc fail\n");
+		munmap(addr, size);
+		return NULL;
+	}
+	memset(pool, 0, sizeof(*pool));
+	pool->id = id;
+	pool->hdr = (struct shmbuf_header *)addr;
+	pool->size = size;
+	pool->owner = owner;
+	return pool;
+}
+
+struct shmbuf_pool *shmbuf_pool_create(uint32_t id, uint32_t count, uint32_t size)
+{
+	char path[SHMBUF_NAME_SIZE];
+	struct shmbuf_pool *pool;
+	struct timespec ts;
+	uint32_t data_offset;
+	size_t total;
+	int fd;
+
+	/*
+	 * descriptors address buffers with 32 bits offsets
+	 */
+	if (!count || !size || size > UINT32_MAX - 63) {
+		errno = EINVAL;
+		return NULL;
+	}
+	size = (size + 63) & ~63;
+	total = (sizeof(struct shmbuf_header) +
+			(uint64_t)count * sizeof(struct shmbuf_slot) + 4095) & ~4095ULL;
+	data_offset = total;
+	total += (uint64_t)count * size;
+	if (total > UINT32_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	shmbuf_path(path, id);
+	shm_unlink(path);
+	fd = shm_open(path, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0) {
+		pr_err("shm_open %s failed, %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(fd, total) < 0) {
+		pr_err("ftruncate failed, %s\n", strerror(errno));
+		close(fd);
+		shm_unlink(path);
+		return NULL;
+	}
+	pool = shmbuf_pool_map(id, fd, total, 1);
+	close(fd);
+	if (!pool) {
+		shm_unlink(path);
+		return NULL;
+	}
+
+	/*
+	 * Start generations from a time based seed, descriptors of a
+	 * previous pool with the same id won't match after restart.
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	pool->hdr->count = count;
+	pool->hdr->size = size;
+	pool->hdr->data_offset = data_offset;
+	pool->hdr->owner = getpid();
+	pool->hdr->next_generation = (uint32_t)(ts.tv_sec * 1000003 + ts.tv_nsec);
+	__atomic_store_n(&pool->hdr->magic, SHMBUF_MAGIC, __ATOMIC_RELEASE);
+	pr_info("shm pool created at:%s, count:%u, size:%u\n", path, count, size);
+	return pool;
+}
+
+static struct shmbuf_pool *shmbuf_pool_open(uint32_t id)
+{
+	char path[SHMBUF_NAME_SIZE];
+	struct shmbuf_pool *pool;
+	struct stat st;
+	int fd;
+
+	shmbuf_path(path, id);
+	fd = shm_open(path, O_RDWR, 0);
+	if (fd < 0) {
+		pr_err("shm_open %s failed, %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct shmbuf_header)) {
+		close(fd);
+		return NULL;
+	}
+	pool = shmbuf_pool_map(id, fd, st.st_size, 0);
+	close(fd);
+	if (pool && __atomic_load_n(&pool->hdr->magic, __ATOMIC_ACQUIRE) != SHMBUF_MAGIC) {
+		munmap(pool->hdr, pool->size);
+		free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+static void shmbuf_pool_close(struct shmbuf_pool *pool)
+{
+	munmap(pool->hdr, pool->size);
+	free(pool);
+}
+
+void shmbuf_pool_destroy(struct shmbuf_pool *pool)
+{
+	char path[SHMBUF_NAME_SIZE];
+
+	if (!pool)
+		return;
+	__atomic_store_n(&pool->hdr->closed, 1, __ATOMIC_RELEASE);
+	shmbuf_path(path, pool->id);
+	shm_unlink(path);
+	shmbuf_pool_close(pool);
+}
+
+void *shmbuf_alloc(struct shmbuf_pool *pool, uint32_t len)
+{
+	struct shmbuf_header *hdr = pool->hdr;
+	uint32_t hint = __atomic_load_n(&hdr->hint, __ATOMIC_RELAXED);
+	uint32_t i, idx, expected;
+
+	if (len > hdr->size) {
+		errno = EMSGSIZE;
+		return NULL;
+	}
+
+	for (i = 0; i < hdr->count; i++) {
+		idx = (hint + i) % hdr->count;
+		expected = 0;
+		if (__atomic_compare_exchange_n(&hdr->slot[idx].refcnt, &expected, 1,
+					0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&hdr->slot[idx].generation,
+					__atomic_add_fetch(&hdr->next_generation, 1, __ATOMIC_RELAXED),
+					__ATOMIC_RELEASE);
+			__atomic_store_n(&hdr->hint, idx + 1, __ATOMIC_RELAXED);
+			return shmbuf_base(pool) + (size_t)idx * hdr->size;
+		}
+	}
+	errno = ENOBUFS;
+	return NULL;
+}
+
+static int shmbuf_index(struct shmbuf_pool *pool, void *data)
+{
+	size_t off = (char *)data - shmbuf_base(pool);
+
+	if ((char *)data < shmbuf_base(pool) || off % pool->hdr->size ||
+			off / pool->hdr->size >= pool->hdr->count)
+		return -1;
+	return off / pool->hdr->size;
+}
+
+int shmbuf_ref(struct shmbuf_pool *pool, void *data, uint32_t len,
+				struct shmbuf_desc *desc)
+{
+	int idx = shmbuf_index(pool, data);
+
+	if (idx < 0 || len > pool->hdr->size) {
+		errno = EINVAL;
+		return -1;
+	}
+	__atomic_add_fetch(&pool->hdr->slot[idx].refcnt, 1, __ATOMIC_RELAXED);
+	desc->pool = pool->id;
+	desc->offset = pool->hdr->data_offset + (uint32_t)idx * pool->hdr->size;
+	desc->length = len;
+	desc->generation = __atomic_load_n(&pool->hdr->slot[idx].generation,
+			__ATOMIC_RELAXED);
+	return 0;
+}
+
+void shmbuf_free(struct shmbuf_pool *pool, void *data)
+{
+	int idx = shmbuf_index(pool, data);
+
+	if (idx < 0) {
+		pr_err("free invalid buffer %p\n", data);
+		return;
+	}
+	__atomic_sub_fetch(&pool->hdr->slot[idx].refcnt, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * shmbuf_check - check descriptor against a mapped pool
+ *
+ * Returns the slot index, or -1 if the descriptor is stale.
+ */
+static int shmbuf_check(struct shmbuf_pool *pool, const struct shmbuf_desc *desc)
+{
+	struct shmbuf_header *hdr = pool->hdr;
+	uint32_t idx;
+
+	if (desc->offset < hdr->data_offset ||
+			(desc->offset - hdr->data_offset) % hdr->size)
+		return -1;
+	idx = (desc->offset - hdr->data_offset) / hdr->size;
+	if (idx >= hdr->count || desc->length > hdr->size ||
+			__atomic_load_n(&hdr->slot[idx].generation, __ATOMIC_ACQUIRE) != desc->generation)
+		return -1;
+	return idx;
+}
+
+/*
+ * shmbuf_pool_retire - drop a cached mapping, shmbuf_lock must be held
+ *
+ * Buffers still used by handlers keep the mapping until released.
+ */
+static void shmbuf_pool_retire(struct shmbuf_pool *pool)
+{
+	list_node_del(&pool->node);
+	pool->stale = 1;
+	if (pool->users == 0)
+		shmbuf_pool_close(pool);
+}
+
+void *shmbuf_map(const struct shmbuf_desc *desc, struct shmbuf_pool **ppool)
+{
+	struct shmbuf_pool *pool = NULL, *tmp;
+	void *data = NULL;
+
+	pthread_mutex_lock(&shmbuf_lock);
+	list_for_each_node_entry(tmp, &shmbuf_pools, node) {
+		if (tmp->id == desc->pool) {
+			pool = tmp;
+			break;
+		}
+	}
+	/*
+	 * Pool may have been recreated by a restarted owner,
+	 * then our mapping is out of date.
+	 */
+	if (pool && (__atomic_load_n(&pool->hdr->closed, __ATOMIC_ACQUIRE) ||
+				shmbuf_check(pool, desc) < 0)) {
+		shmbuf_pool_retire(pool);
+		pool = NULL;
+	}
+	if (!pool) {
+		pool = shmbuf_pool_open(desc->pool);
+		if (pool)
+			list_node_add(&pool->node, &shmbuf_pools);
+	}
+	if (pool && shmbuf_check(pool, desc) >= 0) {
+		pool->users++;
+		data = (char *)pool->hdr + desc->offset;
+		*ppool = pool;
+	}
+	pthread_mutex_unlock(&shmbuf_lock);
+
+	if (!data)
+		pr_err("stale shm buffer, pool:%08x offset:%u\n", desc->pool, desc->offset);
+	return data;
+}
+
+void shmbuf_release(struct shmbuf_pool *pool, const struct shmbuf_desc *desc)
+{
+	int idx = shmbuf_check(pool, desc);
+
+	if (idx >= 0)
+		__atomic_sub_fetch(&pool->hdr->slot[idx].refcnt, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&shmbuf_lock);
+	if (--pool->users == 0 && pool->stale)
+		shmbuf_pool_close(pool);
+	pthread_mutex_unlock(&shmbuf_lock);
+}
+
+void shmbuf_drop(const struct shmbuf_desc *desc)
+{
+	struct shmbuf_pool *pool;
+
+	if (shmbuf_map(desc, &pool))
+		shmbuf_release(pool, desc);
+}
+
+void shmbuf_cache_clear(void)
+{
+	struct shmbuf_pool *pool;
+
+	pthread_mutex_lock(&shmbuf_lock);
+	while (!list_is_empty(&shmbuf_pools)) {
+		pool = list_node_entry(shmbuf_pools.next, struct shmbuf_pool, node);
+		shmbuf_pool_retire(pool);
+	}
+	pthread_mutex_unlock(&shmbuf_lock);
+}
@@ -6,16 +6,17 @@
 #include <errno.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sys/signalfd.h>
 #include "debug.h"
 #include "siglib.h"
 
 static sigfunc sigaction_func;
 
-static void *thread_sigfun(void *arg)
+/*
+ * signal_wait_set - signals handled by sigaction_func
+ */
+static void signal_wait_set(sigset_t *set)
 {
-	int err, signo;
-	sigset_t	waitset,mask;
-
 	/*
 	 * Two signals can't be blocked:
 	 * SIGKILL,SIGSTOP - can't block
@@ -24,28 +25,29 @@ static void *thread_sigfun(void *arg)
 	 * SIGFPE,SIGILL,SIGSEGV,SIGBUS - shouldn't block
 	 *
 	 * */
-	sigfillset(&mask);
-	sigdelset(&mask, SIGKILL);
-	sigdelset(&mask, SIGSTOP);
-	sigdelset(&mask, SIGFPE);
-	sigdelset(&mask, SIGILL);
-	sigdelset(&mask, SIGSEGV);
-	sigdelset(&mask, SIGBUS);
-	sigdelset(&mask, SIGABRT); /* NOTE: Shouldn't block, this is for watchdog */
+	sigfillset(set);
+	sigdelset(set, SIGKILL);
+	sigdelset(set, SIGSTOP);
+	sigdelset(set, SIGFPE);
+	sigdelset(set, SIGILL);
+	sigdelset(set, SIGSEGV);
+	sigdelset(set, SIGBUS);
+	sigdelset(set, SIGABRT); /* NOTE: Shouldn't block, this is for watchdog */
+}
+
+static void *thread_sigfun(void *arg)
+{
+	int err, signo;
+	sigset_t	waitset,mask;
+
+	signal_wait_set(&mask);
 	if ((err = pthread_sigmask(SIG_SETMASK, &mask, NULL)) != 0)
 		err_exit("SIG_BLOCK error\n");
 
 	/*
 	 * sigwait for other signals
 	 * */
-	sigfillset(&waitset);
-	sigdelset(&waitset, SIGKILL);
-	sigdelset(&waitset, SIGSTOP);
-	sigdelset(&waitset, SIGFPE);
-	sigdelset(&waitset, SIGILL);
-	sigdelset(&waitset, SIGSEGV);
-	sigdelset(&waitset, SIGBUS);
-	sigdelset(&waitset, SIGABRT); /* NOTE: Shouldn't block, this is for watchdog */
+	signal_wait_set(&waitset);
 	for (;;) {
 		err = sigwait(&waitset, &signo);
 		if (err != 0) {
@@ -79,6 +81,27 @@ void set_signal_thread(sigfunc func)
 		err_exit("can't create thread\n");
 }
 
+int set_signal_fd(void)
+{
+	int err, fd;
+	sigset_t	mask;
+
+	/*
+	 * Block the signals in caller, threads created later inherit it
+	 */
+	signal_wait_set(&mask);
+	if ((err = pthread_sigmask(SIG_BLOCK, &mask, NULL)) != 0) {
+		pr_err("SIG_BLOCK error, %s\n", strerror(err));
+		errno = err;
+		return -1;
+	}
+
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+		pr_err("signalfd fail, %s\n", strerror(errno));
+	return fd;
+}
+
 int set_signal(int signo, sigfunc func)
 {
 	struct sigaction act, oact;
@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LOG_TAG "stall"
+//#define LOG_DEBUG
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <sys/syscall.h>
+#include "debug.h"
+#include "stall.h"
+
+#define STALL_PERIOD_MIN_MS 10
+#define STALL_PERIOD_MAX_MS 1000
+
+static LIST_NODE(stall_slots);
+static pthread_mutex_t stall_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stall_cond;
+static pthread_once_t stall_once = PTHREAD_ONCE_INIT;
+static pthread_t stall_tid;
+static int stall_running;
+static uint64_t stall_budget_ns;
+static uint64_t stall_abort_ns;
+
+static void stall_dump_handler(int signo)
+{
+	void *frames[STALL_DUMP_FRAMES];
+	int count;
+
+	count = backtrace(frames, STALL_DUMP_FRAMES);
+	backtrace_symbols_fd(frames, count, STDOUT_FILENO);
+}
+
+static void stall_setup(void)
+{
+	pthread_condattr_t attr;
+	struct sigaction act;
+	void *frame;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&stall_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/* first backtrace loads libgcc, don't let it happen in the handler */
+	backtrace(&frame, 1);
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = stall_dump_handler;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = SA_RESTART;
+	if (sigaction(STALL_DUMP_SIGNAL, &act, NULL) < 0)
+		pr_err("sigaction fail, %s\n", strerror(errno));
+}
+
+void stall_register(struct stall_slot *slot, const char *name)
+{
+	sigset_t mask;
+
+	/* the handler itself is only installed by stall_monitor_start */
+	sigemptyset(&mask);
+	sigaddset(&mask, STALL_DUMP_SIGNAL);
+	pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+
+	slot->name = name;
+	slot->tid = syscall(SYS_gettid);
+	slot->tag = 0;
+	slot->since = 0;
+	slot->reported = 0;
+	pthread_mutex_lock(&stall_lock);
+	list_node_add(&slot->node, &stall_slots);
+	pthread_mutex_unlock(&stall_lock);
+}
+
+void stall_unregister(struct stall_slot *slot)
+{
+	pthread_mutex_lock(&stall_lock);
+	list_node_del(&slot->node);
+	pthread_mutex_unlock(&stall_lock);
+}
+
+/*
+ * stall_check - check one slot, stall_lock must be held
+ */
+static void stall_check(struct stall_slot *slot, uint64_t now)
+{
+	uint64_t since, age;
+	uint32_t tag;
+
+	since = __atomic_load_n(&slot->since, __ATOMIC_ACQUIRE);
+	if (!since || now < since || now - since < stall_budget_ns)
+		return;
+	tag = __atomic_load_n(&slot->tag, __ATOMIC_RELAXED);
+	/* tag may belong to the next handler if this one just returned */
+	if (__atomic_load_n(&slot->since, __ATOMIC_ACQUIRE) != since)
+		return;
+
+	age = (now - since) / 1000000;
+	if (slot->reported != since) {
+		slot->reported = since;
+		pr_err("%s tid:%d handler tag:%u running for %llums, stack:\n",
+				slot->name, slot->tid, tag, (unsigned long long)age);
+		syscall(SYS_tgkill, getpid(), slot->tid, STALL_DUMP_SIGNAL);
+	}
+	if (stall_abort_ns && now - since >= stall_abort_ns) {
+		pr_err("%s tid:%d handler tag:%u stuck for %llums, abort!\n",
+				slot->name, slot->tid, tag, (unsigned long long)age);
+		abort();
+	}
+}
+
+static void *stall_monitor(void *arg)
+{
+	struct stall_slot *slot;
+	struct timespec ts;
+	uint64_t period_ms, now;
+
+	period_ms = stall_budget_ns / 1000000 / 4;
+	if (period_ms < STALL_PERIOD_MIN_MS)
+		period_ms = STALL_PERIOD_MIN_MS;
+	if (period_ms > STALL_PERIOD_MAX_MS)
+		period_ms = STALL_PERIOD_MAX_MS;
+
+	pthread_mutex_lock(&stall_lock);
+	while (stall_running) {
+		now = stall_now_ns();
+		list_for_each_node_entry(slot, &stall_slots, node)
+			stall_check(slot, now);
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec += period_ms * 1000000;
+		ts.tv_sec += ts.tv_nsec / 1000000000;
+		ts.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&stall_cond, &stall_lock, &ts);
+	}
+	pthread_mutex_unlock(&stall_lock);
+	return NULL;
+}
+
+int stall_monitor_start(uint32_t budget_ms, uint32_t abort_ms)
+{
+	int ret;
+
+	if (!budget_ms || (abort_ms && abort_ms < budget_ms)) {
+		pr_err("invalid stall budget:%ums abort:%ums\n", budget_ms, abort_ms);
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_once(&stall_once, stall_setup);
+
+	pthread_mutex_lock(&stall_lock);
+	if (stall_running) {
+		pthread_mutex_unlock(&stall_lock);
+		pr_err("stall monitor is already running\n");
+		errno = EBUSY;
+		return -1;
+	}
+	stall_budget_ns = budget_ms * 1000000ULL;
+	stall_abort_ns = abort_ms * 1000000ULL;
+	stall_running = 1;
+	ret = pthread_create(&stall_tid, NULL, stall_monitor, NULL);
+	if (ret) {
+		stall_running = 0;
+		pthread_mutex_unlock(&stall_lock);
+		pr_err("pthread create fail!, %s\n", strerror(ret));
+		errno = ret;
+		return -1;
+	}
+	pthread_mutex_unlock(&stall_lock);
+	pr_info("stall monitor budget:%ums abort:%ums\n", budget_ms, abort_ms);
+	return 0;
+}
+
+void stall_monitor_stop(void)
+{
+	pthread_mutex_lock(&stall_lock);
+	if (!stall_running) {
+		pthread_mutex_unlock(&stall_lock);
+		return;
+	}
+	stall_running = 0;
+	pthread_cond_signal(&stall_cond);
+	pthread_mutex_unlock(&stall_lock);
+	pthread_join(stall_tid, NULL);
+}
@@ -27,91 +27,53 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
-#include <signal.h>
-#include <time.h>
+#include <errno.h>
 #include <string.h>
 #include "debug.h"
 #include "timer.h"
 
-typedef void (*sigev_function) (union sigval);
-
-int timer_init(struct timer_wrapper *t, timer_cb func, void *data)
+int timer_init_wheel(struct timer_wrapper *t, struct timer_wheel *wheel,
+			timer_cb func, void *data)
 {
-
-    /* Create the timer */
-	memset(&t->sev, 0, sizeof(struct sigevent));
-    t->sev.sigev_notify = SIGEV_THREAD;
-	t->sev.sigev_notify_function = (sigev_function) func;
-	t->sev.sigev_value.sival_ptr = data;
-	t->sev.sigev_notify_attributes = NULL;//&attr;
-
-    if (timer_create(CLOCK_REALTIME, &t->sev, &t->timerid) == -1) {
-        pr_err("timer_create fail\n");
+	if (!wheel) {
+		pr_err("timer wheel create fail\n");
 		return -1;
 	}
+	wheel_timer_init(&t->timer, wheel, func, data, NULL);
 	t->created = 1;
-
-    pr_info("timer ID is 0x%lx\n", (long) t->timerid);
 	return 0;
 }
 
+int timer_init(struct timer_wrapper *t, timer_cb func, void *data)
+{
+	return timer_init_wheel(t, timer_wheel_default(), func, data);
+}
+
 int timer_start(struct timer_wrapper *t, uint64_t usec, uint32_t oneshot)
 {
-    /* Start the timer */
-    t->its.it_value.tv_sec = usec / 1000000;
-    t->its.it_value.tv_nsec = (usec % 1000000) * 1000;
-	/*
-	 * timer only run once
-	 */
-	if (oneshot) {
-    	t->its.it_interval.tv_sec = 0;
-    	t->its.it_interval.tv_nsec = 0;
-	} else {
-	/*
-	 * periodic timer
-	 */
-		t->its.it_interval.tv_sec = t->its.it_value.tv_sec;
-		t->its.it_interval.tv_nsec = t->its.it_value.tv_nsec;
+	if (!t->created) {
+		pr_err("timer_start before timer_init\n");
+		errno = EINVAL;
+		return -1;
 	}
-
 	/*
-	 * second arg: 0 means relative timeout
-	 * second arg: TIMER_ABSTIME absolute timeout
-	 *
-	 * Here use relative time
+	 * oneshot timer only run once, periodic timer runs every usec
 	 */
-	if (timer_settime(t->timerid, 0, &t->its /*new value*/, NULL /*old value*/) == -1) {
-		pr_err("timer_settime fail\n");
-		return -1;
-	}
-
-	return 0;
+	return wheel_timer_start(&t->timer, usec, oneshot ? 0 : usec);
 }
 
 int timer_stop(struct timer_wrapper *t)
 {
-    t->its.it_value.tv_sec = 0;
-    t->its.it_value.tv_nsec = 0;
-    t->its.it_interval.tv_sec = 0;
-    t->its.it_interval.tv_nsec = 0;
-
-	/*
-	 * second arg: 0 means relative timeout
-	 * second arg: TIMER_ABSTIME absolute timeout
-	 *
-	 * Here use relative time
-	 */
-	if (timer_settime(t->timerid, 0, &t->its /*new value*/, NULL /*old value*/) == -1) {
-		pr_err("timer_settime fail\n");
+	if (!t->created) {
+		errno = EINVAL;
 		return -1;
 	}
-
-	return 0;
+	return wheel_timer_stop(&t->timer);
 }
 
 void timer_remove(struct timer_wrapper *t)
 {
 	if (t->created)
-		timer_delete(t->timerid);
+		wheel_timer_stop(&t->timer);
 	memset(t, 0, sizeof(struct timer_wrapper));
 }
@@ -0,0 +1,425 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LOG_TAG "timer"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include "debug.h"
+#include "timer_wheel.h"
+
+/* callbacks collected under lock and run after it is released */
+#define TIMER_WHEEL_FIRE_MAX 64
+
+struct timer_fire {
+	msg_handler func;
+	void *data;
+	struct looper *looper;
+};
+
+static uint64_t timer_wheel_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t timer_wheel_now_tick(struct timer_wheel *wheel)
+{
+	return (timer_wheel_now_ns() - wheel->base_ns) / wheel->tick_ns;
+}
+
+/*
+ * timer_wheel_add - link a timer to the slot of its expiry, lock held
+ */
+static void timer_wheel_add(struct timer_wheel *wheel, struct wheel_timer *t)
+{
+	uint64_t expires = t->expires;
+	uint64_t delta;
+	int level;
+
+	if (expires < wheel->curr)
+		expires = wheel->curr;
+	delta = expires - wheel->curr;
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+		if (delta < (1ULL << ((level + 1) * TIMER_WHEEL_BITS)))
+			break;
+	}
+	if (delta >= (1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)))
+		expires = wheel->curr + (1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1;
+
+	t->level = level;
+	t->slot = (expires >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+	list_node_add_tail(&t->node, &wheel->slots[level][t->slot]);
+	wheel->mask[level] |= 1ULL << t->slot;
+	t->pending = 1;
+	wheel->count++;
+}
+
+/*
+ * timer_wheel_del - unlink a pending timer, lock held
+ */
+static void timer_wheel_del(struct timer_wheel *wheel, struct wheel_timer *t)
+{
+	list_node_del(&t->node);
+	if (list_is_empty(&wheel->slots[t->level][t->slot]))
+		wheel->mask[t->level] &= ~(1ULL << t->slot);
+	t->pending = 0;
+	wheel->count--;
+}
+
+/*
+ * timer_wheel_next - tick of next expiry or cascade, lock held
+ *
+ * Slots before the current index of a level belong to the next
+ * round of that level, the current slot of an upper level is
+ * cascaded on the first tick of it.
+ */
+static uint64_t timer_wheel_next(struct timer_wheel *wheel)
+{
+	uint64_t next = UINT64_MAX;
+	uint64_t mask, later, base, tick;
+	int level, shift, index;
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		mask = wheel->mask[level];
+		if (!mask)
+			continue;
+		shift = level * TIMER_WHEEL_BITS;
+		index = (wheel->curr >> shift) & TIMER_WHEEL_MASK;
+		base = (wheel->curr >> shift) & ~(uint64_t)TIMER_WHEEL_MASK;
+		/* the slot of curr is still pending only on its first tick */
+		if (!(wheel->curr & ((1ULL << shift) - 1)))
+			later = mask & (~0ULL << index);
+		else
+			later = index == TIMER_WHEEL_MASK ? 0 : mask & (~0ULL << (index + 1));
+		if (later)
+			tick = (base + __builtin_ctzll(later)) << shift;
+		else
+			tick = (base + TIMER_WHEEL_SIZE + __builtin_ctzll(mask)) << shift;
+		if (tick < next)
+			next = tick;
+	}
+	return next;
+}
+
+/*
+ * timer_wheel_arm - arm timerfd for the next tick plus slack, lock held
+ */
+static void timer_wheel_arm(struct timer_wheel *wheel)
+{
+	struct itimerspec its;
+	uint64_t next = timer_wheel_next(wheel);
+	uint64_t ns;
+
+	if (next != UINT64_MAX)
+		next += wheel->slack;
+	if (next == wheel->armed)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	if (next != UINT64_MAX) {
+		ns = wheel->base_ns + next * wheel->tick_ns;
+		its.it_value.tv_sec = ns / 1000000000ULL;
+		its.it_value.tv_nsec = ns % 1000000000ULL;
+	}
+	if (timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		pr_err("timerfd_settime fail, %s\n", strerror(errno));
+		return;
+	}
+	wheel->armed = next;
+}
+
+/*
+ * timer_wheel_cascade - move timers of upper level slots down, lock held
+ *
+ * Called when level 0 index of curr is 0.
+ */
+static void timer_wheel_cascade(struct timer_wheel *wheel)
+{
+	LIST_NODE(list);
+	struct wheel_timer *t;
+	int level, index;
+
+	for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		index = (wheel->curr >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+		while (!list_is_empty(&wheel->slots[level][index])) {
+			t = list_node_entry(wheel->slots[level][index].next,
+					struct wheel_timer, node);
+			timer_wheel_del(wheel, t);
+			timer_wheel_add(wheel, t);
+		}
+		if (index)
+			break;
+	}
+}
+
+static void timer_wheel_fire(struct timer_fire *fire, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (fire[i].looper)
+			fire[i].looper->post(fire[i].looper, fire[i].func, fire[i].data);
+		else
+			fire[i].func(fire[i].data);
+	}
+}
+
+void timer_wheel_process(struct timer_wheel *wheel)
+{
+	struct timer_fire fire[TIMER_WHEEL_FIRE_MAX];
+	struct list_node *slot;
+	struct wheel_timer *t;
+	uint64_t expirations;
+	uint64_t now, next;
+	int n = 0;
+
+	if (read(wheel->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		pr_err("timerfd read fail, %s\n", strerror(errno));
+
+	pthread_mutex_lock(&wheel->lock);
+	wheel->armed = UINT64_MAX;
+	now = timer_wheel_now_tick(wheel);
+	while (wheel->curr <= now) {
+		if (!(wheel->curr & TIMER_WHEEL_MASK))
+			timer_wheel_cascade(wheel);
+
+		slot = &wheel->slots[0][wheel->curr & TIMER_WHEEL_MASK];
+		while (!list_is_empty(slot)) {
+			t = list_node_entry(slot->next, struct wheel_timer, node);
+			timer_wheel_del(wheel, t);
+			fire[n].func = t->func;
+			fire[n].data = t->data;
+			fire[n].looper = t->looper;
+			n++;
+			if (t->period) {
+				/* keep the phase, skip periods missed while late */
+				t->expires += t->period;
+				if (t->expires <= now)
+					t->expires += (now - t->expires) / t->period * t->period + t->period;
+				timer_wheel_add(wheel, t);
+			}
+			if (n == TIMER_WHEEL_FIRE_MAX) {
+				pthread_mutex_unlock(&wheel->lock);
+				timer_wheel_fire(fire, n);
+				n = 0;
+				pthread_mutex_lock(&wheel->lock);
+			}
+		}
+
+		/* jump over ticks where nothing expires or cascades */
+		wheel->curr++;
+		next = timer_wheel_next(wheel);
+		if (next > wheel->curr)
+			wheel->curr = next < now + 1 ? next : now + 1;
+	}
+	timer_wheel_arm(wheel);
+	pthread_mutex_unlock(&wheel->lock);
+
+	timer_wheel_fire(fire, n);
+}
+
+static void *timer_wheel_thread(void *private)
+{
+	struct timer_wheel *wheel = (struct timer_wheel *)private;
+	struct pollfd pfd;
+
+	pfd.fd = wheel->fd;
+	pfd.events = POLLIN;
+	while (!__atomic_load_n(&wheel->exit, __ATOMIC_ACQUIRE)) {
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_err("timer wheel poll fail, %s\n", strerror(errno));
+			break;
+		}
+		if (__atomic_load_n(&wheel->exit, __ATOMIC_ACQUIRE))
+			break;
+		timer_wheel_process(wheel);
+	}
+	return NULL;
+}
+
+struct timer_wheel *timer_wheel_create(uint64_t tick_us, uint64_t slack_us)
+{
+	struct timer_wheel *wheel;
+	int level, i;
+
+	if (!tick_us) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	wheel = (struct timer_wheel *)calloc(1, sizeof(*wheel));
+	if (!wheel) {
+		pr_err("timer wheel malloc fail\n");
+		return NULL;
+	}
+	wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (wheel->fd < 0) {
+		pr_err("timerfd_create fail, %s\n", strerror(errno));
+		free(wheel);
+		return NULL;
+	}
+
+	pthread_mutex_init(&wheel->lock, NULL);
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+		for (i = 0; i < TIMER_WHEEL_SIZE; i++)
+			INIT_LIST_NODE(&wheel->slots[level][i]);
+	wheel->tick_ns = tick_us * 1000ULL;
+	wheel->slack = (slack_us + tick_us - 1) / tick_us;
+	wheel->base_ns = timer_wheel_now_ns();
+	wheel->armed = UINT64_MAX;
+	return wheel;
+}
+
+int timer_wheel_start(struct timer_wheel *wheel)
+{
+	int ret;
+
+	if (wheel->thread) {
+		pr_err("timer wheel already started\n");
+		return -1;
+	}
+	ret = pthread_create(&wheel->tid, NULL, timer_wheel_thread, wheel);
+	if (ret) {
+		pr_err("pthread create fail!, %s\n", strerror(ret));
+		return -1;
+	}
+	wheel->thread = 1;
+	return 0;
+}
+
+int timer_wheel_fd(struct timer_wheel *wheel)
+{
+	return wheel->fd;
+}
+
+void timer_wheel_destroy(struct timer_wheel *wheel)
+{
+	struct itimerspec its;
+
+	if (!wheel)
+		return;
+
+	if (wheel->thread) {
+		/* an expired absolute time wakes up the thread at once */
+		__atomic_store_n(&wheel->exit, 1, __ATOMIC_RELEASE);
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_nsec = 1;
+		timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &its, NULL);
+		pthread_join(wheel->tid, NULL);
+	}
+	close(wheel->fd);
+	pthread_mutex_destroy(&wheel->lock);
+	free(wheel);
+}
+
+static struct timer_wheel *default_wheel;
+static pthread_once_t default_wheel_once = PTHREAD_ONCE_INIT;
+
+static void timer_wheel_default_init(void)
+{
+	struct timer_wheel *wheel;
+
+	wheel = timer_wheel_create(TIMER_WHEEL_TICK_US, TIMER_WHEEL_SLACK_US);
+	if (wheel && timer_wheel_start(wheel) < 0) {
+		timer_wheel_destroy(wheel);
+		wheel = NULL;
+	}
+	default_wheel = wheel;
+}
+
+struct timer_wheel *timer_wheel_default(void)
+{
+	pthread_once(&default_wheel_once, timer_wheel_default_init);
+	return default_wheel;
+}
+
+void wheel_timer_init(struct wheel_timer *t, struct timer_wheel *wheel,
+			msg_handler func, void *data, struct looper *looper)
+{
+	memset(t, 0, sizeof(*t));
+	INIT_LIST_NODE(&t->node);
+	t->wheel = wheel;
+	t->func = func;
+	t->data = data;
+	t->looper = looper;
+}
+
+int wheel_timer_start(struct wheel_timer *t, uint64_t usec, uint64_t period_us)
+{
+	struct timer_wheel *wheel = t->wheel;
+	uint64_t now_ns, ticks;
+
+	if (!wheel || !t->func) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&wheel->lock);
+	if (t->pending)
+		timer_wheel_del(wheel, t);
+
+	now_ns = timer_wheel_now_ns() - wheel->base_ns;
+	/* an idle wheel catches up at once instead of walking old ticks */
+	if (!wheel->count && wheel->curr < now_ns / wheel->tick_ns)
+		wheel->curr = now_ns / wheel->tick_ns;
+	/* round up, a timer never fires early */
+	ticks = (now_ns + usec * 1000ULL + wheel->tick_ns - 1) / wheel->tick_ns;
+	t->expires = ticks;
+	t->period = period_us ? (period_us * 1000ULL + wheel->tick_ns - 1) / wheel->tick_ns : 0;
+	timer_wheel_add(wheel, t);
+	if (t->expires + wheel->slack < wheel->armed)
+		timer_wheel_arm(wheel);
+	pthread_mutex_unlock(&wheel->lock);
+	return 0;
+}
+
+int wheel_timer_stop(struct wheel_timer *t)
+{
+	struct timer_wheel *wheel = t->wheel;
+
+	if (!wheel) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* timerfd stays armed, an early wakeup only re-arms it */
+	pthread_mutex_lock(&wheel->lock);
+	if (t->pending)
+		timer_wheel_del(wheel, t);
+	pthread_mutex_unlock(&wheel->lock);
+	return 0;
+}
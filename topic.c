@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LOG_TAG "topic"
+//#define LOG_DEBUG
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "debug.h"
+#include "topic.h"
+
+static inline struct topic_slot *topic_slot_at(struct topic *t, uint64_t seq)
+{
+	return (struct topic_slot *)(t->slots +
+			(size_t)(seq & (t->hdr->slots - 1)) * t->hdr->stride);
+}
+
+static int topic_pid_dead(pid_t pid)
+{
+	return kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+struct topic *topic_open(const char *name, uint32_t slot_size)
+{
+	char path[TOPIC_NAME_SIZE + 16];
+	struct topic_header *hdr;
+	struct topic *t;
+	struct stat st;
+	uint32_t stride;
+	size_t size;
+	void *addr;
+	int fd;
+
+	if (!name || !name[0] || strlen(name) >= TOPIC_NAME_SIZE || strchr(name, '/')) {
+		pr_err("invalid topic name\n");
+		errno = EINVAL;
+		return NULL;
+	}
+	stride = (sizeof(struct topic_slot) + slot_size + 63) & ~63;
+	size = sizeof(struct topic_header) + (size_t)TOPIC_SLOTS * stride;
+
+	/*
+	 * Every user may be the first one. A new object is zero filled,
+	 * which is an empty topic, so creating it twice is harmless.
+	 */
+	snprintf(path, sizeof(path), "/ipc-topic-%s", name);
+	fd = shm_open(path, O_CREAT | O_RDWR, 0666);
+	if (fd < 0) {
+		pr_err("shm_open %s failed, %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || (st.st_size && st.st_size != size)) {
+		pr_err("topic %s exists with another size\n", name);
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!st.st_size && ftruncate(fd, size) < 0) {
+		pr_err("ftruncate failed, %s\n", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		pr_err("mmap failed, %s\n", strerror(errno));
+		return NULL;
+	}
+
+	t = (struct topic *)malloc(sizeof(*t));
+	if (!t) {
+		pr_err("topic malloc fail\n");
+		munmap(addr, size);
+		return NULL;
+	}
+	memset(t, 0, sizeof(*t));
+	snprintf(t->name, TOPIC_NAME_SIZE, "%s", name);
+	hdr = (struct topic_header *)addr;
+	t->hdr = hdr;
+	t->slots = (char *)addr + sizeof(struct topic_header);
+	t->size = size;
+	t->sub = -1;
+	INIT_LIST_NODE(&t->node);
+
+	hdr->slots = TOPIC_SLOTS;
+	hdr->slot_size = slot_size;
+	hdr->stride = stride;
+	__atomic_store_n(&hdr->magic, TOPIC_MAGIC, __ATOMIC_RELEASE);
+	return t;
+}
+
+void topic_close(struct topic *t)
+{
+	if (!t)
+		return;
+	topic_unsubscribe(t);
+	munmap(t->hdr, t->size);
+	free(t);
+}
+
+void *topic_write_begin(struct topic *t, uint64_t *seq)
+{
+	struct topic_slot *slot;
+
+	*seq = __atomic_fetch_add(&t->hdr->reserve, 1, __ATOMIC_ACQ_REL);
+	slot = topic_slot_at(t, *seq);
+	/* readers of the old message see the slot change */
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return slot->data;
+}
+
+void topic_write_end(struct topic *t, uint64_t seq, uint32_t len)
+{
+	struct topic_slot *slot = topic_slot_at(t, seq);
+
+	slot->len = len;
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * topic_claim - move a subscriber from state old to TOPIC_SUB_INIT
+ */
+static int topic_claim(struct topic_sub *sub, uint32_t old)
+{
+	return __atomic_compare_exchange_n(&sub->state, &old, TOPIC_SUB_INIT, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void topic_notify(struct topic *t, topic_notify_fn func, void *data)
+{
+	struct topic_sub *sub;
+	int i;
+
+	/* pairs with the fence in topic_arm */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < TOPIC_SUBS_MAX; i++) {
+		sub = &t->hdr->subs[i];
+		if (__atomic_load_n(&sub->state, __ATOMIC_ACQUIRE) != TOPIC_SUB_USED ||
+				!__atomic_load_n(&sub->waiting, __ATOMIC_RELAXED) ||
+				!__atomic_exchange_n(&sub->waiting, 0, __ATOMIC_ACQ_REL))
+			continue;
+		if (!func(sub->name, data))
+			continue;
+		if (topic_pid_dead(sub->pid)) {
+			pr_info("free subscriber %s of topic %s, exited\n", sub->name, t->name);
+			if (topic_claim(sub, TOPIC_SUB_USED))
+				__atomic_store_n(&sub->state, TOPIC_SUB_FREE, __ATOMIC_RELEASE);
+		} else {
+			__atomic_store_n(&sub->waiting, 1, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+int topic_subscribe(struct topic *t, const char *name)
+{
+	struct topic_sub *sub;
+	int i, index = -1;
+
+	if (t->sub >= 0)
+		return 0;
+	if (name[0] == '/')
+		name++;
+
+	/* take over the slot of a dead instance first */
+	for (i = 0; i < TOPIC_SUBS_MAX && index < 0; i++) {
+		sub = &t->hdr->subs[i];
+		if (__atomic_load_n(&sub->state, __ATOMIC_ACQUIRE) == TOPIC_SUB_USED &&
+				!strncmp(sub->name, name, TOPIC_NAME_SIZE) &&
+				(sub->pid == getpid() || topic_pid_dead(sub->pid)) &&
+				topic_claim(sub, TOPIC_SUB_USED))
+			index = i;
+	}
+	for (i = 0; i < TOPIC_SUBS_MAX && index < 0; i++) {
+		if (topic_claim(&t->hdr->subs[i], TOPIC_SUB_FREE))
+			index = i;
+	}
+	if (index < 0) {
+		pr_err("too many subscribers of topic %s\n", t->name);
+		errno = ENOSPC;
+		return -1;
+	}
+
+	sub = &t->hdr->subs[index];
+	snprintf(sub->name, TOPIC_NAME_SIZE, "%s", name);
+	sub->pid = getpid();
+	sub->waiting = 0;
+	sub->lost = 0;
+	t->cursor = __atomic_load_n(&t->hdr->reserve, __ATOMIC_ACQUIRE);
+	sub->cursor = t->cursor;
+	t->sub = index;
+	__atomic_store_n(&sub->state, TOPIC_SUB_USED, __ATOMIC_RELEASE);
+	pr_info("%s subscribed topic %s\n", name, t->name);
+	return 0;
+}
+
+void topic_unsubscribe(struct topic *t)
+{
+	if (t->sub < 0)
+		return;
+	__atomic_store_n(&t->hdr->subs[t->sub].state, TOPIC_SUB_FREE, __ATOMIC_RELEASE);
+	t->sub = -1;
+}
+
+/*
+ * topic_overrun - skip messages overwritten before they were read
+ *
+ * Returns true if the cursor was moved.
+ */
+static int topic_overrun(struct topic *t)
+{
+	struct topic_sub *sub = &t->hdr->subs[t->sub];
+	uint64_t head = __atomic_load_n(&t->hdr->reserve, __ATOMIC_ACQUIRE);
+
+	if (head - t->cursor <= t->hdr->slots)
+		return 0;
+	__atomic_store_n(&sub->lost, sub->lost + head - t->hdr->slots - t->cursor,
+			__ATOMIC_RELAXED);
+	t->cursor = head - t->hdr->slots;
+	return 1;
+}
+
+int topic_read(struct topic *t, void *buf)
+{
+	struct topic_slot *slot;
+	uint32_t len;
+
+	if (t->sub < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (;;) {
+		slot = topic_slot_at(t, t->cursor);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != t->cursor + 1) {
+			if (topic_overrun(t))
+				continue;
+			errno = EAGAIN;
+			return -1;
+		}
+		len = slot->len;
+		if (len > t->hdr->slot_size)
+			len = t->hdr->slot_size;
+		memcpy(buf, slot->data, len);
+		/* publisher may have reused the slot while it was copied */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != t->cursor + 1)
+			continue;
+		t->cursor++;
+		__atomic_store_n(&t->hdr->subs[t->sub].cursor, t->cursor, __ATOMIC_RELAXED);
+		return len;
+	}
+}
+
+int topic_arm(struct topic *t)
+{
+	struct topic_sub *sub;
+	struct topic_slot *slot;
+
+	if (t->sub < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	sub = &t->hdr->subs[t->sub];
+	__atomic_store_n(&sub->waiting, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	slot = topic_slot_at(t, t->cursor);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == t->cursor + 1 ||
+			__atomic_load_n(&t->hdr->reserve, __ATOMIC_ACQUIRE) - t->cursor >
+			t->hdr->slots) {
+		__atomic_store_n(&sub->waiting, 0, __ATOMIC_RELAXED);
+		errno = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+uint64_t topic_lost(struct topic *t)
+{
+	if (t->sub < 0)
+		return 0;
+	return __atomic_load_n(&t->hdr->subs[t->sub].lost, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2019 xiehaocheng <xiehaocheng127@163.com>
+ *
+ * All Rights Reserved
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LOG_TAG "uring"
+//#define LOG_DEBUG
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "debug.h"
+#include "uring.h"
+
+static int sys_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned int submit, unsigned int wait_nr,
+				unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait_nr, flags, NULL, 0);
+}
+
+int uring_init(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	unsigned int *array;
+	char *ptr;
+	unsigned int i;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = sys_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	/*
+	 * Single mmap is 5.4, no dropped completions is 5.5, older
+	 * kernels are left to epoll.
+	 */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+			!(p.features & IORING_FEAT_NODROP)) {
+		close(ring->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+	ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->ring_ptr == MAP_FAILED) {
+		pr_err("io_uring ring mmap fail, %s\n", strerror(errno));
+		goto err_close;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		pr_err("io_uring sqes mmap fail, %s\n", strerror(errno));
+		munmap(ring->ring_ptr, ring->ring_size);
+		goto err_close;
+	}
+
+	ptr = (char *)ring->ring_ptr;
+	ring->sq_head = (unsigned int *)(ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)(ptr + p.sq_off.tail);
+	ring->sq_mask = *(unsigned int *)(ptr + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_local = *ring->sq_tail;
+	array = (unsigned int *)(ptr + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+	ring->cq_head = (unsigned int *)(ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)(ptr + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)(ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+	return 0;
+
+err_close:
+	close(ring->fd);
+	ring->fd = -1;
+	return -1;
+}
+
+void uring_exit(struct uring *ring)
+{
+	if (ring->fd < 0)
+		return;
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->ring_ptr, ring->ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/*
+ * uring_get_sqe - take a cleared sqe, published by uring_enter
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if (ring->sq_local - head >= ring->sq_entries) {
+		errno = EBUSY;
+		return NULL;
+	}
+	sqe = &ring->sqes[ring->sq_local & ring->sq_mask];
+	ring->sq_local++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int uring_poll(struct uring *ring, int fd, unsigned int events, int multishot,
+				uint64_t data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+	/* kernel reads the two halves swapped on big endian */
+	events = (events << 16) | (events >> 16);
+#endif
+	sqe->poll32_events = events;
+	sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+	sqe->user_data = data;
+	return 0;
+}
+
+int uring_timeout(struct uring *ring, struct __kernel_timespec *ts, int abs,
+				uint64_t data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)ts;
+	sqe->len = 1;
+	/* off 0: a pure timer, not completed by other completions */
+	sqe->off = 0;
+	sqe->timeout_flags = abs ? IORING_TIMEOUT_ABS : 0;
+	sqe->user_data = data;
+	return 0;
+}
+
+int uring_enter(struct uring *ring, unsigned int wait_nr)
+{
+	unsigned int tail = __atomic_load_n(ring->sq_tail, __ATOMIC_RELAXED);
+	int ret;
+
+	if (ring->sq_local != tail) {
+		ring->sq_pending += ring->sq_local - tail;
+		__atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+	}
+	if (!ring->sq_pending && !wait_nr)
+		return 0;
+
+	ret = sys_uring_enter(ring->fd, ring->sq_pending, wait_nr,
+			wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	if (ret < 0)
+		return -1;
+	ring->sq_pending -= ret;
+	return 0;
+}